@@ -0,0 +1,684 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/l2cap.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include "acl.h"
+#include "trace.h"
+
+/*
+ * Used if the adapter info can't be read.
+ */
+#define ACL_DEFAULT_MTU  1019
+#define ACL_DEFAULT_PKTS 8
+
+/*
+ * The controller buffers are shared with the kernel, which counts its own credits and doesn't know about the engines.
+ * The engines leave this many buffers to the kernel's own traffic (signaling, and the packets within the MTU).
+ * This assumes the kernel doesn't fill all the buffers at the same time as the engines:
+ * a controller that gets more packets than it has buffers may drop them.
+ */
+#define ACL_KERNEL_PKTS 2
+
+/*
+ * The number of fragments that can be queued per adapter.
+ */
+#define ACL_QUEUE_SIZE 64
+
+#define ACL_MAX_PEERS 16
+
+/*
+ * A fragment, ready to be written to the HCI socket:
+ * packet type + ACL header (+ L2CAP header for the first fragment) + data.
+ */
+struct acl_frag
+{
+  unsigned short handle;
+  unsigned short len;
+  unsigned char data[];
+};
+
+/*
+ * Each thread that sends frames runs its own engine: its own HCI sockets, ACL handles, queues and credits.
+ * It polls the fd returned by acl_init(), and calls acl_process() when it is ready.
+ * Nothing is shared between the engines but the number of engines that use each adapter.
+ */
+
+/*
+ * An adapter.
+ *
+ * The controller has a fixed number of ACL buffers, each holding up to mtu bytes,
+ * and pkts of them are used by the engines (see ACL_KERNEL_PKTS).
+ * The engines that use the adapter get an even share of them:
+ * a fragment is written only if the engine has less fragments than its share in the controller.
+ * A fragment leaves the controller when a Number Of Completed Packets event reports it.
+ * Fragments that can't be sent are queued until fragments leave the controller.
+ */
+static __thread struct acl_dev
+{
+  int fd;
+  unsigned short mtu;
+  unsigned short pkts;
+  unsigned short inflight;
+  int pollout;
+  unsigned char* queue;
+  size_t stride;
+  unsigned int head;
+  unsigned int count;
+  struct
+  {
+    unsigned long long frames;
+    unsigned long long fragments;
+    unsigned long long queued;
+    unsigned long long dropped;
+  } stats;
+} devs[HCI_MAX_DEV];
+
+/*
+ * The ACL handles of the remote devices, by adapter:
+ * a device connected through several adapters has an ACL link, and a handle, per adapter.
+ */
+static __thread struct
+{
+  bdaddr_t bdaddr;
+  int dev_id;
+  unsigned short handle;
+  unsigned short inflight;
+} peers[ACL_MAX_PEERS];
+
+static __thread int nb_peers = 0;
+
+/*
+ * This epoll fd gathers the HCI sockets of the engine.
+ */
+static __thread int efd = -1;
+
+static __thread struct
+{
+  unsigned long long hits;
+  unsigned long long misses;
+} stats;
+
+/*
+ * The number of engines that use each adapter.
+ * It only changes when an engine adds or removes an adapter.
+ */
+static unsigned int engines[HCI_MAX_DEV];
+
+/*
+ * Set up the engine of the running thread.
+ *
+ * \return an epoll fd that is ready when acl_process() has to be called, -1 on error
+ */
+int acl_init()
+{
+  int i;
+
+  for(i=0; i<HCI_MAX_DEV; ++i)
+  {
+    devs[i].fd = -1;
+  }
+
+  if((efd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+  {
+    perror("epoll_create1");
+  }
+
+  return efd;
+}
+
+static inline struct acl_frag* frag_at(struct acl_dev* dev, unsigned int index)
+{
+  return (struct acl_frag*)(dev->queue + (index % ACL_QUEUE_SIZE) * dev->stride);
+}
+
+/*
+ * The number of fragments the engine can have in the controller.
+ */
+static unsigned short get_share(int dev_id)
+{
+  unsigned int users = __atomic_load_n(engines + dev_id, __ATOMIC_RELAXED);
+  unsigned short share = devs[dev_id].pkts;
+
+  if(users > 1)
+  {
+    share /= users;
+  }
+
+  return share ? share : 1;
+}
+
+static void set_pollout(int dev_id, int pollout)
+{
+  struct epoll_event ev = { .events = EPOLLIN | (pollout ? EPOLLOUT : 0), .data.u32 = dev_id };
+
+  if(devs[dev_id].pollout == pollout)
+  {
+    return;
+  }
+
+  if(epoll_ctl(efd, EPOLL_CTL_MOD, devs[dev_id].fd, &ev) < 0)
+  {
+    trace_printf("epoll_ctl EPOLL_CTL_MOD: %s\n", strerror(errno));
+  }
+
+  devs[dev_id].pollout = pollout;
+}
+
+/*
+ * Add an adapter to the engine.
+ * fd can be any socket that talks the HCI protocol (e.g. a socketpair end that simulates a controller).
+ */
+int acl_add_dev(int dev_id, int fd, unsigned short mtu, unsigned short pkts)
+{
+  struct acl_dev* dev = devs + dev_id;
+  struct epoll_event ev = { .events = EPOLLIN, .data.u32 = dev_id };
+
+  dev->stride = (sizeof(struct acl_frag) + 1 + HCI_ACL_HDR_SIZE + mtu + 3) & ~3;
+  if(!(dev->queue = malloc(ACL_QUEUE_SIZE * dev->stride)))
+  {
+    trace_printf("malloc: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if(epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) < 0)
+  {
+    trace_printf("epoll_ctl EPOLL_CTL_ADD: %s\n", strerror(errno));
+    free(dev->queue);
+    return -1;
+  }
+
+  dev->fd = fd;
+  dev->mtu = mtu;
+  dev->pkts = pkts;
+  dev->inflight = 0;
+  dev->pollout = 0;
+  dev->head = 0;
+  dev->count = 0;
+  memset(&dev->stats, 0x00, sizeof(dev->stats));
+
+  __atomic_add_fetch(engines + dev_id, 1, __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+/*
+ * Open the HCI socket of an adapter, get its ACL buffer size and count,
+ * and only let the disconnection and completed packets events in.
+ */
+static int open_dev(int dev_id)
+{
+  struct hci_dev_info di;
+  struct hci_filter flt;
+  unsigned short pkts;
+  int dd;
+
+  if(devs[dev_id].fd >= 0)
+  {
+    return 0;
+  }
+
+  if ((dd = hci_open_dev(dev_id)) < 0)
+  {
+    trace_printf("hci_open_dev: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (ioctl(dd, HCIGETDEVINFO, (void *) &di) < 0 || !di.acl_mtu || !di.acl_pkts)
+  {
+    trace_printf("ioctl HCIGETDEVINFO: %s\n", strerror(errno));
+    di.acl_mtu = ACL_DEFAULT_MTU;
+    di.acl_pkts = ACL_DEFAULT_PKTS;
+  }
+
+  hci_filter_clear(&flt);
+  hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+  hci_filter_set_event(EVT_DISCONN_COMPLETE, &flt);
+  hci_filter_set_event(EVT_NUM_COMP_PKTS, &flt);
+  if (setsockopt(dd, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0)
+  {
+    trace_printf("setsockopt HCI_FILTER: %s\n", strerror(errno));
+  }
+
+  pkts = (di.acl_pkts > ACL_KERNEL_PKTS) ? di.acl_pkts - ACL_KERNEL_PKTS : 1;
+
+  if(acl_add_dev(dev_id, dd, di.acl_mtu, pkts) < 0)
+  {
+    close(dd);
+    return -1;
+  }
+
+  trace_printf("hci%d: ACL mtu: %hu, buffers: %hu (%hu used by the bypass)\n", dev_id, di.acl_mtu, di.acl_pkts, pkts);
+
+  return 0;
+}
+
+/*
+ * Set the ACL handle of a remote device.
+ */
+int acl_add_peer(const bdaddr_t* ba, int dev_id, unsigned short handle)
+{
+  if(nb_peers == ACL_MAX_PEERS)
+  {
+    trace_printf("too many ACL peers\n");
+    return -1;
+  }
+
+  bacpy(&peers[nb_peers].bdaddr, ba);
+  peers[nb_peers].dev_id = dev_id;
+  peers[nb_peers].handle = handle;
+  peers[nb_peers].inflight = 0;
+
+  return nb_peers++;
+}
+
+/*
+ * Forget a remote device.
+ * Its queued fragments are discarded, and its buffers in the controller are considered as freed.
+ */
+static void remove_peer(int index)
+{
+  struct acl_dev* dev = devs + peers[index].dev_id;
+  unsigned int i;
+
+  for(i=0; i<dev->count; ++i)
+  {
+    struct acl_frag* frag = frag_at(dev, dev->head + i);
+    if(frag->handle == peers[index].handle)
+    {
+      frag->len = 0;
+    }
+  }
+
+  dev->inflight -= peers[index].inflight;
+
+  peers[index] = peers[--nb_peers];
+}
+
+/*
+ * Get the ACL handle of a remote device on an adapter.
+ * If the adapter is unknown (-1), the one the kernel routes to the device is used.
+ * The result is cached until the link goes down or acl_drop() is called.
+ */
+static int get_peer(int dev_id, const bdaddr_t* ba)
+{
+  char buf[sizeof(struct hci_conn_info_req) + sizeof(struct hci_conn_info)] __attribute__((aligned));
+  struct hci_conn_info_req* cr = (struct hci_conn_info_req*) buf;
+  int i;
+
+  for(i=0; i<nb_peers; ++i)
+  {
+    if((dev_id < 0 || peers[i].dev_id == dev_id) && !bacmp(&peers[i].bdaddr, ba))
+    {
+      ++stats.hits;
+      return i;
+    }
+  }
+
+  ++stats.misses;
+
+  if (dev_id < 0 && (dev_id = hci_get_route((bdaddr_t*) ba)) < 0)
+  {
+    trace_printf("hci_get_route: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (open_dev(dev_id) < 0)
+  {
+    return -1;
+  }
+
+  bacpy(&cr->bdaddr, ba);
+  cr->type = ACL_LINK;
+
+  if (ioctl(devs[dev_id].fd, HCIGETCONNINFO, (unsigned long) cr) < 0)
+  {
+    trace_printf("ioctl HCIGETCONNINFO: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return acl_add_peer(ba, dev_id, cr->conn_info->handle);
+}
+
+/*
+ * Drop the cached ACL handle of a remote device on an adapter, or on all adapters (-1).
+ */
+void acl_drop(int dev_id, const char* bdaddr_dst)
+{
+  bdaddr_t ba;
+  int i = 0;
+
+  str2ba(bdaddr_dst, &ba);
+
+  while(i < nb_peers)
+  {
+    if((dev_id < 0 || peers[i].dev_id == dev_id) && !bacmp(&peers[i].bdaddr, &ba))
+    {
+      /*
+       * The last peer takes this slot.
+       */
+      remove_peer(i);
+      continue;
+    }
+    ++i;
+  }
+}
+
+/*
+ * Drop the fragment at the head of the queue, and the next fragments of its frame:
+ * the remote device can't reassemble a frame that misses a fragment.
+ */
+static void drop_frame(struct acl_dev* dev)
+{
+  do
+  {
+    ++dev->head;
+    --dev->count;
+  } while(dev->count && acl_flags(bt_get_le16(frag_at(dev, dev->head)->data + 1)) != ACL_START);
+
+  ++dev->stats.dropped;
+}
+
+/*
+ * Write the queued fragments as long as the engine has free buffers in the controller.
+ */
+static void flush(int dev_id)
+{
+  struct acl_dev* dev = devs + dev_id;
+  unsigned short share = get_share(dev_id);
+  struct acl_frag* frag;
+  int i;
+
+  while(dev->count)
+  {
+    frag = frag_at(dev, dev->head);
+
+    if(frag->len)
+    {
+      if(dev->inflight >= share)
+      {
+        break;
+      }
+
+      if(write(dev->fd, frag->data, frag->len) < 0)
+      {
+        if(errno == EINTR)
+        {
+          continue;
+        }
+        if(errno == EAGAIN)
+        {
+          set_pollout(dev_id, 1);
+          return;
+        }
+        trace_printf("write: %s\n", strerror(errno));
+        drop_frame(dev);
+        continue;
+      }
+      else
+      {
+        ++dev->inflight;
+        ++dev->stats.fragments;
+        for(i=0; i<nb_peers; ++i)
+        {
+          if(peers[i].dev_id == dev_id && peers[i].handle == frag->handle)
+          {
+            ++peers[i].inflight;
+            break;
+          }
+        }
+      }
+    }
+
+    ++dev->head;
+    --dev->count;
+  }
+
+  set_pollout(dev_id, 0);
+}
+
+static void process_event(int dev_id, unsigned char* buf, ssize_t len)
+{
+  hci_event_hdr* hdr = (hci_event_hdr*) (buf + 1);
+  unsigned char* params = buf + 1 + HCI_EVENT_HDR_SIZE;
+  evt_disconn_complete* dc;
+  unsigned short handle, count;
+  int i, j;
+
+  if(len < 1 + HCI_EVENT_HDR_SIZE || buf[0] != HCI_EVENT_PKT || len < 1 + HCI_EVENT_HDR_SIZE + hdr->plen)
+  {
+    return;
+  }
+
+  switch(hdr->evt)
+  {
+    case EVT_DISCONN_COMPLETE:
+      dc = (evt_disconn_complete*) params;
+      if(hdr->plen < EVT_DISCONN_COMPLETE_SIZE || dc->status)
+      {
+        break;
+      }
+      for(i=0; i<nb_peers; ++i)
+      {
+        if(peers[i].dev_id == dev_id && peers[i].handle == btohs(dc->handle))
+        {
+          remove_peer(i);
+          break;
+        }
+      }
+      break;
+    case EVT_NUM_COMP_PKTS:
+      /*
+       * The completed packets of a handle also count the packets sent by the kernel and by the other engines,
+       * so they are only deducted from the fragments sent by this engine.
+       */
+      for(j=0; j<params[0] && 1+4*(j+1) <= hdr->plen; ++j)
+      {
+        handle = bt_get_le16(params + 1 + 4*j);
+        count = bt_get_le16(params + 3 + 4*j);
+        for(i=0; i<nb_peers; ++i)
+        {
+          if(peers[i].dev_id == dev_id && peers[i].handle == handle)
+          {
+            if(count > peers[i].inflight)
+            {
+              count = peers[i].inflight;
+            }
+            peers[i].inflight -= count;
+            devs[dev_id].inflight -= count;
+            break;
+          }
+        }
+      }
+      break;
+  }
+}
+
+static void process_dev(int dev_id, uint32_t events)
+{
+  unsigned char buf[HCI_MAX_EVENT_SIZE];
+  ssize_t len;
+
+  if(events & EPOLLIN)
+  {
+    while((len = recv(devs[dev_id].fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+    {
+      process_event(dev_id, buf, len);
+    }
+  }
+
+  flush(dev_id);
+}
+
+/*
+ * Process the pending HCI events, and send the queued fragments.
+ */
+void acl_process()
+{
+  struct epoll_event events[HCI_MAX_DEV];
+  int i, nfds;
+
+  nfds = epoll_wait(efd, events, HCI_MAX_DEV, 0);
+
+  for(i=0; i<nfds; ++i)
+  {
+    process_dev(events[i].data.u32, events[i].events);
+  }
+}
+
+/*
+ * This function can be used to bypass the l2cap outgoing MTU check of the Linux kernel.
+ * The packet is split into fragments that fit into the controller buffers.
+ * The fragments are queued, and sent as soon as the controller has free buffers.
+ *
+ * \param dev_id  the adapter of the L2CAP channel, -1 to use the route of the kernel
+ *
+ * \return plen if the packet was queued, -1 otherwise, with errno set to
+ * EHOSTUNREACH if there is no ACL link to the remote device, or ENOBUFS if the queue of the adapter is full
+ */
+int acl_send_data (int dev_id, const char *bdaddr_dst, unsigned short cid, const unsigned char *data, unsigned short plen)
+{
+  struct acl_dev* dev;
+  struct acl_frag* frag;
+  bdaddr_t ba;
+  unsigned short handle;
+  unsigned short data_len;
+  unsigned short remaining = plen;
+  unsigned int nb_frags;
+  unsigned char* p;
+  int index;
+
+  str2ba(bdaddr_dst, &ba);
+
+  if((index = get_peer(dev_id, &ba)) < 0)
+  {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+
+  dev_id = peers[index].dev_id;
+  dev = devs + dev_id;
+  handle = peers[index].handle;
+
+  nb_frags = (L2CAP_HDR_SIZE + plen + dev->mtu - 1) / dev->mtu;
+
+  if(dev->count + nb_frags > ACL_QUEUE_SIZE)
+  {
+    ++dev->stats.dropped;
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  ++dev->stats.frames;
+
+  do
+  {
+    frag = frag_at(dev, dev->head + dev->count);
+    frag->handle = handle;
+    p = frag->data;
+
+    *p++ = HCI_ACLDATA_PKT;
+
+    if(remaining == plen)
+    {
+      data_len = dev->mtu - L2CAP_HDR_SIZE;
+      if(remaining < data_len)
+      {
+        data_len = remaining;
+      }
+      bt_put_le16(acl_handle_pack(handle, ACL_START), p);
+      bt_put_le16(data_len + L2CAP_HDR_SIZE, p + 2);
+      bt_put_le16(plen, p + 4);
+      bt_put_le16(cid, p + 6);
+      p += HCI_ACL_HDR_SIZE + L2CAP_HDR_SIZE;
+    }
+    else
+    {
+      data_len = dev->mtu;
+      if(remaining < data_len)
+      {
+        data_len = remaining;
+      }
+      bt_put_le16(acl_handle_pack(handle, ACL_CONT), p);
+      bt_put_le16(data_len, p + 2);
+      p += HCI_ACL_HDR_SIZE;
+    }
+
+    memcpy(p, data + plen - remaining, data_len);
+    p += data_len;
+
+    frag->len = p - frag->data;
+    ++dev->count;
+
+    remaining -= data_len;
+
+  } while(remaining);
+
+  flush(dev_id);
+
+  if(dev->count)
+  {
+    ++dev->stats.queued;
+  }
+
+  return plen;
+}
+
+/*
+ * Print the statistics of the engine of the running thread, if it sent any frame.
+ */
+void acl_print_stats()
+{
+  int i;
+
+  if(!stats.hits && !stats.misses)
+  {
+    return;
+  }
+
+  printf("acl handle cache: %llu hits, %llu misses\n", stats.hits, stats.misses);
+
+  for(i=0; i<HCI_MAX_DEV; ++i)
+  {
+    if(devs[i].fd >= 0)
+    {
+      printf("hci%d: %llu frames, %llu fragments, %llu queued, %llu dropped\n", i,
+          devs[i].stats.frames, devs[i].stats.fragments, devs[i].stats.queued, devs[i].stats.dropped);
+    }
+  }
+}
+
+void acl_cleanup()
+{
+  int i;
+
+  for(i=0; i<HCI_MAX_DEV; ++i)
+  {
+    if(devs[i].fd >= 0)
+    {
+      close(devs[i].fd);
+      devs[i].fd = -1;
+      __atomic_sub_fetch(engines + i, 1, __ATOMIC_RELAXED);
+      free(devs[i].queue);
+      devs[i].queue = NULL;
+    }
+  }
+
+  nb_peers = 0;
+
+  if(efd >= 0)
+  {
+    close(efd);
+    efd = -1;
+  }
+}
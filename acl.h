@@ -0,0 +1,28 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef ACL_H_
+#define ACL_H_
+
+#include <bluetooth/bluetooth.h>
+
+int acl_init();
+
+int acl_add_dev(int dev_id, int fd, unsigned short mtu, unsigned short pkts);
+
+int acl_add_peer(const bdaddr_t* ba, int dev_id, unsigned short handle);
+
+void acl_process();
+
+int acl_send_data(int dev_id, const char* bdaddr_dst, unsigned short cid, const unsigned char* data,
+    unsigned short plen);
+
+void acl_drop(int dev_id, const char* bdaddr_dst);
+
+void acl_print_stats();
+
+void acl_cleanup();
+
+#endif
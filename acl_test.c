@@ -0,0 +1,379 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+/*
+ * Run the ACL fragmentation engine against a simulated controller:
+ * the HCI socket is one end of a socketpair, and the test plays the controller on the other end,
+ * reading the fragments and returning the credits with Number Of Completed Packets events.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/l2cap.h>
+#include "acl.h"
+
+#define DEV_ID 0
+#define OTHER_DEV_ID 1
+#define MTU 27
+#define PKTS 2
+#define HANDLE 0x002a
+#define OTHER_HANDLE 0x002b
+#define CID 0x0040
+
+#define PEER "11:22:33:44:55:66"
+#define UNKNOWN_PEER "66:55:44:33:22:11"
+
+static int failures = 0;
+
+#define CHECK(COND) \
+  do \
+  { \
+    if(!(COND)) \
+    { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #COND); \
+      ++failures; \
+    } \
+  } while(0)
+
+/*
+ * The controller side of the socketpair.
+ */
+static int controller = -1;
+
+/*
+ * The bytes of the current L2CAP frame that the controller didn't get yet.
+ */
+static int frame_left = 0;
+
+/*
+ * Read the fragments written by the engine, and append their payload.
+ *
+ * \return the number of fragments
+ */
+static int read_fragments(unsigned char* payload, int* len)
+{
+  unsigned char buf[1 + HCI_ACL_HDR_SIZE + MTU + 1];
+  unsigned short handle, dlen;
+  int n, count = 0;
+
+  while((n = read(controller, buf, sizeof(buf))) > 0)
+  {
+    CHECK(buf[0] == HCI_ACLDATA_PKT);
+    CHECK(n <= 1 + HCI_ACL_HDR_SIZE + MTU);
+
+    handle = bt_get_le16(buf + 1);
+    dlen = bt_get_le16(buf + 3);
+
+    CHECK(acl_handle(handle) == HANDLE);
+    CHECK(dlen == n - 1 - HCI_ACL_HDR_SIZE);
+    if(!frame_left)
+    {
+      CHECK(acl_flags(handle) == ACL_START);
+      frame_left = L2CAP_HDR_SIZE + bt_get_le16(buf + 1 + HCI_ACL_HDR_SIZE);
+    }
+    else
+    {
+      CHECK(acl_flags(handle) == ACL_CONT);
+    }
+    frame_left -= dlen;
+
+    memcpy(payload + *len, buf + 1 + HCI_ACL_HDR_SIZE, dlen);
+    *len += dlen;
+    ++count;
+  }
+
+  return count;
+}
+
+/*
+ * Tell the engine that the controller sent some packets.
+ */
+static void complete(unsigned short handle, unsigned short count)
+{
+  unsigned char ev[] = { HCI_EVENT_PKT, EVT_NUM_COMP_PKTS, 5, 1, 0, 0, 0, 0 };
+
+  bt_put_le16(handle, ev + 4);
+  bt_put_le16(count, ev + 6);
+
+  if(write(controller, ev, sizeof(ev)) < 0)
+  {
+    perror("write");
+  }
+
+  acl_process();
+}
+
+static void disconnect(unsigned short handle)
+{
+  unsigned char ev[] = { HCI_EVENT_PKT, EVT_DISCONN_COMPLETE, EVT_DISCONN_COMPLETE_SIZE, 0, 0, 0, 0x13 };
+
+  bt_put_le16(handle, ev + 4);
+
+  if(write(controller, ev, sizeof(ev)) < 0)
+  {
+    perror("write");
+  }
+
+  acl_process();
+}
+
+/*
+ * A frame larger than the controller buffers is split, and the fragments only go out as credits come back.
+ */
+static void test_fragmentation()
+{
+  unsigned char data[100];
+  unsigned char payload[L2CAP_HDR_SIZE + sizeof(data)];
+  int len = 0;
+  int fragments, total, i;
+
+  for(i=0; i<sizeof(data); ++i)
+  {
+    data[i] = i;
+  }
+
+  CHECK(acl_send_data(DEV_ID, PEER, CID, data, sizeof(data)) == sizeof(data));
+
+  /*
+   * Only PKTS fragments fit in the controller.
+   */
+  total = fragments = read_fragments(payload, &len);
+  CHECK(fragments == PKTS);
+
+  while(len < sizeof(payload) && fragments)
+  {
+    complete(HANDLE, fragments);
+    total += (fragments = read_fragments(payload, &len));
+    CHECK(fragments <= PKTS);
+  }
+
+  CHECK(total == (sizeof(payload) + MTU - 1) / MTU);
+  CHECK(len == sizeof(payload));
+  CHECK(bt_get_le16(payload) == sizeof(data));
+  CHECK(bt_get_le16(payload + 2) == CID);
+  CHECK(!memcmp(payload + L2CAP_HDR_SIZE, data, sizeof(data)));
+
+  complete(HANDLE, fragments);
+}
+
+/*
+ * The completed packets of other handles, or beyond the fragments in flight, don't add credits.
+ */
+static void test_credits()
+{
+  unsigned char data[MTU - L2CAP_HDR_SIZE] = {};
+  unsigned char payload[4 * MTU];
+  int len = 0;
+
+  complete(HANDLE + 1, PKTS);
+  complete(HANDLE, PKTS);
+
+  for(len=0; len<PKTS+1; ++len)
+  {
+    CHECK(acl_send_data(DEV_ID, PEER, CID, data, sizeof(data)) == sizeof(data));
+  }
+
+  len = 0;
+  CHECK(read_fragments(payload, &len) == PKTS);
+
+  complete(HANDLE, 1);
+  len = 0;
+  CHECK(read_fragments(payload, &len) == 1);
+
+  complete(HANDLE, PKTS);
+}
+
+/*
+ * A device connected through two adapters has a link per adapter:
+ * each packet goes through the controller of its adapter, with the handle of that link.
+ */
+static void test_adapters(int other)
+{
+  unsigned char data[MTU - L2CAP_HDR_SIZE] = {};
+  unsigned char buf[1 + HCI_ACL_HDR_SIZE + MTU];
+  unsigned char payload[MTU];
+  int len = 0;
+
+  CHECK(acl_send_data(OTHER_DEV_ID, PEER, CID, data, sizeof(data)) == sizeof(data));
+
+  CHECK(read(other, buf, sizeof(buf)) == 1 + HCI_ACL_HDR_SIZE + MTU);
+  CHECK(acl_handle(bt_get_le16(buf + 1)) == OTHER_HANDLE);
+  CHECK(read_fragments(payload, &len) == 0);
+
+  /*
+   * Dropping the link of an adapter keeps the link of the other one.
+   */
+  acl_drop(OTHER_DEV_ID, PEER);
+
+  errno = EAGAIN;
+  CHECK(acl_send_data(OTHER_DEV_ID, PEER, CID, data, sizeof(data)) < 0);
+  CHECK(errno == EHOSTUNREACH);
+
+  CHECK(acl_send_data(DEV_ID, PEER, CID, data, sizeof(data)) == sizeof(data));
+  CHECK(read_fragments(payload, &len) == 1);
+
+  complete(HANDLE, 1);
+}
+
+/*
+ * Run another engine on the adapter, until a byte is received on the sync socket.
+ */
+static void* run_engine(void* arg)
+{
+  int sync = *(int*)arg;
+  int sv[2] = { -1, -1 };
+  char c = 0;
+
+  CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, sv) == 0);
+  CHECK(acl_init() >= 0 && acl_add_dev(DEV_ID, sv[0], MTU, PKTS) == 0);
+
+  CHECK(write(sync, &c, 1) == 1);
+  CHECK(read(sync, &c, 1) == 1);
+
+  acl_cleanup();
+  close(sv[1]);
+
+  return NULL;
+}
+
+/*
+ * The engines that use an adapter share its buffers evenly.
+ */
+static void test_engines()
+{
+  unsigned char data[MTU - L2CAP_HDR_SIZE] = {};
+  unsigned char payload[PKTS * MTU];
+  pthread_t thread;
+  int sync[2];
+  char c = 0;
+  int len = 0;
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, sync) < 0)
+  {
+    perror("socketpair");
+    ++failures;
+    return;
+  }
+
+  CHECK(pthread_create(&thread, NULL, run_engine, sync + 1) == 0);
+  CHECK(read(sync[0], &c, 1) == 1);
+
+  CHECK(acl_send_data(DEV_ID, PEER, CID, data, sizeof(data)) == sizeof(data));
+  CHECK(acl_send_data(DEV_ID, PEER, CID, data, sizeof(data)) == sizeof(data));
+  CHECK(read_fragments(payload, &len) == PKTS / 2);
+
+  complete(HANDLE, 1);
+  CHECK(read_fragments(payload, &len) == 1);
+  complete(HANDLE, 1);
+
+  /*
+   * The buffers of an engine that stops are shared by the others.
+   */
+  CHECK(write(sync[0], &c, 1) == 1);
+  pthread_join(thread, NULL);
+
+  len = 0;
+  CHECK(acl_send_data(DEV_ID, PEER, CID, data, sizeof(data)) == sizeof(data));
+  CHECK(acl_send_data(DEV_ID, PEER, CID, data, sizeof(data)) == sizeof(data));
+  CHECK(read_fragments(payload, &len) == PKTS);
+  complete(HANDLE, PKTS);
+
+  close(sync[0]);
+  close(sync[1]);
+}
+
+/*
+ * A full queue or an unknown device fail with an errno the caller can act on.
+ */
+static void test_errors()
+{
+  unsigned char data[MTU - L2CAP_HDR_SIZE] = {};
+  unsigned char payload[MTU];
+  int sent = 0;
+  int len;
+
+  errno = EAGAIN;
+  while(acl_send_data(DEV_ID, PEER, CID, data, sizeof(data)) == sizeof(data))
+  {
+    ++sent;
+  }
+  CHECK(errno == ENOBUFS);
+  CHECK(sent > PKTS);
+
+  errno = EAGAIN;
+  CHECK(acl_send_data(DEV_ID, UNKNOWN_PEER, CID, data, sizeof(data)) < 0);
+  CHECK(errno == EHOSTUNREACH);
+
+  /*
+   * The disconnection discards the queued fragments, and frees the buffers of the link.
+   */
+  len = 0;
+  CHECK(read_fragments(payload, &len) == PKTS);
+  disconnect(HANDLE);
+  frame_left = 0;
+  len = 0;
+  CHECK(read_fragments(payload, &len) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+  int sv[2];
+  int other[2];
+  bdaddr_t ba;
+
+  if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, sv) < 0)
+  {
+    perror("socketpair");
+    return 1;
+  }
+
+  if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, other) < 0)
+  {
+    perror("socketpair");
+    return 1;
+  }
+
+  controller = sv[1];
+
+  if(acl_init() < 0 || acl_add_dev(DEV_ID, sv[0], MTU, PKTS) < 0
+      || acl_add_dev(OTHER_DEV_ID, other[0], MTU, PKTS) < 0)
+  {
+    return 1;
+  }
+
+  str2ba(PEER, &ba);
+  if(acl_add_peer(&ba, DEV_ID, HANDLE) < 0 || acl_add_peer(&ba, OTHER_DEV_ID, OTHER_HANDLE) < 0)
+  {
+    return 1;
+  }
+
+  test_fragmentation();
+  test_credits();
+  test_adapters(other[1]);
+  test_engines();
+  test_errors();
+
+  acl_print_stats();
+
+  acl_cleanup();
+  close(controller);
+  close(other[1]);
+
+  if(failures)
+  {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("acl: all checks passed\n");
+
+  return 0;
+}
@@ -0,0 +1,453 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <bluetooth/bluetooth.h>
+#include "bt_utils.h"
+#include "adapter.h"
+#include "trace.h"
+
+/*
+ * The adapters the legs are spread over, and their load.
+ *
+ * The load of an adapter is the number of legs it carries.
+ * The airtime of the packets is estimated for basic rate ACL links: a packet is split into DH5 baseband packets
+ * (339 bytes, 5 slots), the last one being the smallest type that fits (DH1: 27 bytes, 1 slot; DH3: 183 bytes, 3 slots),
+ * and each baseband packet is answered in the next slot.
+ * The link counts are updated by the loops in sharded mode, and the packets are counted by each relaying thread.
+ */
+
+#define SLOT_US 625
+#define L2CAP_HDR_SIZE 4
+
+#define STATS_ADD(VAR, VAL) __atomic_add_fetch(&(VAR), VAL, __ATOMIC_RELAXED)
+
+static struct adapter
+{
+  bdaddr_t ba;
+  char bdaddr[18];
+  int dev_id; // the HCI device, -1 if it isn't a local adapter
+  unsigned int links;
+} adapters[ADAPTERS_MAX];
+
+/*
+ * The packet counters of a thread.
+ *
+ * Each thread that relays packets has its own block, so that a counter has a single writer:
+ * it is updated with relaxed atomic loads and stores, without locked instructions,
+ * and adapter_print_stats() sums the blocks.
+ * A block is allocated the first time a thread counts a packet, and is kept.
+ */
+struct counters
+{
+  struct counters* next;
+  struct
+  {
+    unsigned long long received;
+    unsigned long long sent;
+    unsigned long long airtime; // in us
+  } adapters[ADAPTERS_MAX];
+} __attribute__((aligned(64)));
+
+static struct counters* blocks = NULL;
+
+static __thread struct counters* counters = NULL;
+
+#define COUNTER_ADD(VAR, VAL) \
+  __atomic_store_n(&(VAR), __atomic_load_n(&(VAR), __ATOMIC_RELAXED) + (VAL), __ATOMIC_RELAXED)
+
+static unsigned int count = 0;
+
+/*
+ * The open legs of each device, per adapter: the legs to the device itself, and the legs to the master for it.
+ * The loops of the sharded mode share them, to tell if an ACL link is still used, and which adapter a device uses.
+ * A slot is claimed the first time a device gets a leg, and is kept: the counts are then updated without locking.
+ */
+#define DEVICES_MAX 128
+
+static struct device
+{
+  bdaddr_t ba;
+  int master;
+  int legs[ADAPTERS_MAX];
+} devices[DEVICES_MAX];
+
+static unsigned int nb_devices = 0;
+
+static pthread_mutex_t devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long start = 0;
+
+static unsigned long long get_time()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int add(const char* bdaddr)
+{
+  bdaddr_t ba;
+
+  str2ba(bdaddr, &ba);
+
+  if(adapter_find(&ba) >= 0)
+  {
+    return 0;
+  }
+
+  if(count == ADAPTERS_MAX)
+  {
+    fprintf(stderr, "too many adapters\n");
+    return -1;
+  }
+
+  memset(adapters + count, 0x00, sizeof(*adapters));
+  bacpy(&adapters[count].ba, &ba);
+  ba2str(&ba, adapters[count].bdaddr);
+  adapters[count].dev_id = get_device_id(adapters[count].bdaddr);
+
+  ++count;
+
+  if(!start)
+  {
+    start = get_time();
+  }
+
+  return 0;
+}
+
+/*
+ * Add all the adapters that are up.
+ *
+ * \return the number of adapters
+ */
+int adapter_add_all()
+{
+  char bdaddr[18];
+  int id;
+
+  for(id = 0; id < ADAPTERS_MAX; ++id)
+  {
+    if(bt_get_device_bdaddr(id, bdaddr) == 0 && add(bdaddr) < 0)
+    {
+      break;
+    }
+  }
+
+  return count;
+}
+
+/*
+ * Add the adapters of a comma-separated list of bdaddrs.
+ *
+ * \param check  check that each adapter exists
+ */
+int adapter_add_list(char* list, int check)
+{
+  char* tok;
+  char* save;
+
+  for(tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+  {
+    if(bachk(tok) < 0 || (check && get_device_id(tok) < 0))
+    {
+      fprintf(stderr, "invalid adapter: %s\n", tok);
+      return -1;
+    }
+    if(add(tok) < 0)
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+unsigned int adapter_count()
+{
+  return count;
+}
+
+int adapter_find(const bdaddr_t* bdaddr)
+{
+  unsigned int i;
+
+  for(i = 0; i < count; ++i)
+  {
+    if(!bacmp(&adapters[i].ba, bdaddr))
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int adapter_find_str(const char* bdaddr)
+{
+  bdaddr_t ba;
+
+  str2ba(bdaddr, &ba);
+
+  return adapter_find(&ba);
+}
+
+const char* adapter_bdaddr(int index)
+{
+  return index < 0 ? NULL : adapters[index].bdaddr;
+}
+
+/*
+ * Get the HCI device of an adapter.
+ *
+ * \return the device id, -1 if the adapter is unknown
+ */
+int adapter_dev_id(int index)
+{
+  return index < 0 ? -1 : adapters[index].dev_id;
+}
+
+/*
+ * Get the adapter with the fewest legs, other than exclude if possible.
+ *
+ * \return the index of the adapter, -1 if there is none
+ */
+int adapter_pick(int exclude)
+{
+  int best = -1;
+  unsigned int i;
+
+  for(i = 0; i < count; ++i)
+  {
+    if(i == exclude)
+    {
+      continue;
+    }
+    if(best < 0 || __atomic_load_n(&adapters[i].links, __ATOMIC_RELAXED)
+        < __atomic_load_n(&adapters[best].links, __ATOMIC_RELAXED))
+    {
+      best = i;
+    }
+  }
+
+  return best < 0 ? exclude : best;
+}
+
+static struct device* find_device(const bdaddr_t* ba, int master)
+{
+  unsigned int n = __atomic_load_n(&nb_devices, __ATOMIC_ACQUIRE);
+  unsigned int i;
+
+  for(i=0; i<n; ++i)
+  {
+    if(devices[i].master == master && !bacmp(&devices[i].ba, ba))
+    {
+      return devices + i;
+    }
+  }
+
+  return NULL;
+}
+
+static struct device* claim_device(const bdaddr_t* ba, int master)
+{
+  struct device* d;
+
+  pthread_mutex_lock(&devices_mutex);
+
+  if(!(d = find_device(ba, master)))
+  {
+    if(nb_devices < DEVICES_MAX)
+    {
+      d = devices + nb_devices;
+      bacpy(&d->ba, ba);
+      d->master = master;
+      __atomic_store_n(&nb_devices, nb_devices + 1, __ATOMIC_RELEASE);
+    }
+    else
+    {
+      trace_printf("too many devices to track their legs\n");
+    }
+  }
+
+  pthread_mutex_unlock(&devices_mutex);
+
+  return d;
+}
+
+/*
+ * Count a leg that opens (delta = 1) or closes (delta = -1) on an adapter.
+ *
+ * \param device  the device of the leg, NULL if none
+ * \param master  the leg goes to the master
+ */
+void adapter_link(int index, const char* device, int master, int delta)
+{
+  struct device* d;
+  bdaddr_t ba;
+
+  if(index < 0)
+  {
+    return;
+  }
+
+  STATS_ADD(adapters[index].links, delta);
+
+  if(!device)
+  {
+    return;
+  }
+
+  str2ba(device, &ba);
+
+  if((d = find_device(&ba, master)) || (delta > 0 && (d = claim_device(&ba, master))))
+  {
+    STATS_ADD(d->legs[index], delta);
+  }
+}
+
+/*
+ * Tell if a device has open legs on an adapter, in any loop.
+ *
+ * \param device  the device, NULL for any device
+ * \param master  count the legs to the master
+ */
+int adapter_has_legs(int index, const char* device, int master)
+{
+  unsigned int n = __atomic_load_n(&nb_devices, __ATOMIC_ACQUIRE);
+  struct device* d;
+  unsigned int i;
+  bdaddr_t ba;
+
+  if(device)
+  {
+    str2ba(device, &ba);
+    return (d = find_device(&ba, master)) && __atomic_load_n(&d->legs[index], __ATOMIC_RELAXED) > 0;
+  }
+
+  for(i=0; i<n; ++i)
+  {
+    if(devices[i].master == master && __atomic_load_n(&devices[i].legs[index], __ATOMIC_RELAXED) > 0)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Get the adapter of the open legs of a device, in any loop.
+ *
+ * \param master  the legs to the master
+ *
+ * \return the index of the adapter, -1 if the device has no open leg
+ */
+int adapter_of_device(const char* device, int master)
+{
+  struct device* d;
+  unsigned int i;
+  bdaddr_t ba;
+
+  str2ba(device, &ba);
+
+  if(!(d = find_device(&ba, master)))
+  {
+    return -1;
+  }
+
+  for(i=0; i<count; ++i)
+  {
+    if(__atomic_load_n(&d->legs[i], __ATOMIC_RELAXED) > 0)
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static unsigned int airtime(int len)
+{
+  unsigned int bytes = len + L2CAP_HDR_SIZE;
+  unsigned int slots = bytes / 339 * (5 + 1);
+
+  bytes %= 339;
+
+  if(bytes)
+  {
+    slots += (bytes <= 27 ? 1 : (bytes <= 183 ? 3 : 5)) + 1;
+  }
+
+  return slots * SLOT_US;
+}
+
+/*
+ * Get the counters of the running thread.
+ */
+static struct counters* get_counters()
+{
+  if(!counters)
+  {
+    if(posix_memalign((void**)&counters, __alignof__(*counters), sizeof(*counters)))
+    {
+      counters = NULL;
+      return NULL;
+    }
+    memset(counters, 0x00, sizeof(*counters));
+    counters->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&blocks, &counters->next, counters, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+  return counters;
+}
+
+void adapter_received(int index, int len)
+{
+  struct counters* c;
+
+  if(index >= 0 && (c = get_counters()))
+  {
+    COUNTER_ADD(c->adapters[index].received, 1);
+    COUNTER_ADD(c->adapters[index].airtime, airtime(len));
+  }
+}
+
+void adapter_sent(int index, int len)
+{
+  struct counters* c;
+
+  if(index >= 0 && (c = get_counters()))
+  {
+    COUNTER_ADD(c->adapters[index].sent, 1);
+    COUNTER_ADD(c->adapters[index].airtime, airtime(len));
+  }
+}
+
+void adapter_print_stats()
+{
+  unsigned long long elapsed = get_time() - start;
+  unsigned long long received, sent, air;
+  struct counters* c;
+  unsigned int i;
+
+  for(i = 0; i < count; ++i)
+  {
+    received = sent = air = 0;
+    for(c = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); c; c = c->next)
+    {
+      received += __atomic_load_n(&c->adapters[i].received, __ATOMIC_RELAXED);
+      sent += __atomic_load_n(&c->adapters[i].sent, __ATOMIC_RELAXED);
+      air += __atomic_load_n(&c->adapters[i].airtime, __ATOMIC_RELAXED);
+    }
+    trace_printf("adapter %s: %u legs, %llu packets received, %llu packets sent, airtime: %llu ms (%.1f%%)\n",
+        adapters[i].bdaddr, adapters[i].links, received, sent, air / 1000, elapsed ? 100.0 * air / elapsed : 0);
+  }
+}
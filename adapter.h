@@ -0,0 +1,41 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef ADAPTER_H_
+#define ADAPTER_H_
+
+#include <bluetooth/bluetooth.h>
+
+#define ADAPTERS_MAX 16
+
+int adapter_add_all();
+
+int adapter_add_list(char* list, int check);
+
+unsigned int adapter_count();
+
+int adapter_find(const bdaddr_t* bdaddr);
+
+int adapter_find_str(const char* bdaddr);
+
+const char* adapter_bdaddr(int index);
+
+int adapter_dev_id(int index);
+
+int adapter_pick(int exclude);
+
+void adapter_link(int index, const char* device, int master, int delta);
+
+int adapter_has_legs(int index, const char* device, int master);
+
+int adapter_of_device(const char* device, int master);
+
+void adapter_received(int index, int len);
+
+void adapter_sent(int index, int len);
+
+void adapter_print_stats();
+
+#endif
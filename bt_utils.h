@@ -7,6 +7,7 @@
 #define BT_UTILS_H_
 
 int bt_get_device_bdaddr(int device_number, char bdaddr[18]);
+int get_device_id(char* bdaddr);
 int bt_write_device_class(char* bdaddr, uint32_t class);
 
 int delete_stored_link_key(char* bdaddr, char* bdaddr_dest);
@@ -0,0 +1,314 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "capture.h"
+
+/*
+ * The frames are written to pcapng files, with the LINKTYPE_BLUETOOTH_HCI_H4_WITH_PHDR link type.
+ * Each L2CAP frame is wrapped into a single ACL packet, and annotated with a packet comment.
+ *
+ * The files are memory-mapped, so that writing a frame doesn't involve any system call.
+ * When a file is full, the capture rotates to the next one, overwriting the oldest file.
+ *
+ * The capture belongs to the thread that opened it: each event loop of the sharded mode writes its own files.
+ */
+
+#define LINKTYPE_BLUETOOTH_HCI_H4_WITH_PHDR 201
+
+#define BLOCK_SHB 0x0A0D0D0A
+#define BLOCK_IDB 0x00000001
+#define BLOCK_EPB 0x00000006
+
+#define OPT_ENDOFOPT 0
+#define OPT_COMMENT 1
+#define OPT_IF_TSRESOL 9
+
+#define H4_ACL 0x02
+#define ACL_START 0x2000
+
+#define COMMENT_SIZE 64
+
+#define PAD4(LEN) (((LEN) + 3) & ~3)
+
+/*
+ * Direction pseudo-header, ACL packet type, ACL header, L2CAP header.
+ */
+#define FRAME_HEADER_SIZE (4 + 1 + 4 + 4)
+
+/*
+ * Section header block, interface description block.
+ */
+#define HEADERS_SIZE (28 + 32)
+
+/*
+ * Block header, interface id, timestamp, captured & original lengths, comment option header,
+ * end of options, block trailer.
+ */
+#define EPB_OVERHEAD (8 + 4 + 8 + 8 + 4 + 4 + 4)
+
+static __thread struct
+{
+  char* prefix;
+  unsigned int file_size;
+  unsigned int nb_files;
+  unsigned int index;
+  int fd;
+  unsigned char* map;
+  unsigned int offset;
+  struct
+  {
+    unsigned long long frames;
+    unsigned long long bytes;
+    unsigned long long rotations;
+    unsigned long long dropped;
+  } stats;
+} capture = { .fd = -1 };
+
+static inline void put32(unsigned char* p, uint32_t v)
+{
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline void put16(unsigned char* p, uint16_t v)
+{
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline void put_le16(unsigned char* p, uint16_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static unsigned int write_headers(unsigned char* p)
+{
+  unsigned char* start = p;
+  int64_t section_length = -1;
+
+  put32(p, BLOCK_SHB);
+  put32(p + 4, 28);
+  put32(p + 8, 0x1A2B3C4D);
+  put16(p + 12, 1);
+  put16(p + 14, 0);
+  memcpy(p + 16, &section_length, sizeof(section_length));
+  put32(p + 24, 28);
+  p += 28;
+
+  put32(p, BLOCK_IDB);
+  put32(p + 4, 32);
+  put16(p + 8, LINKTYPE_BLUETOOTH_HCI_H4_WITH_PHDR);
+  put16(p + 10, 0);
+  put32(p + 12, 0);
+  put16(p + 16, OPT_IF_TSRESOL);
+  put16(p + 18, 1);
+  put32(p + 20, 9); // ns
+  put32(p + 24, OPT_ENDOFOPT);
+  put32(p + 28, 32);
+  p += 32;
+
+  return p - start;
+}
+
+/*
+ * Unmap the current file, and cut it to the written size.
+ */
+static void close_file()
+{
+  if(capture.map)
+  {
+    munmap(capture.map, capture.file_size);
+    capture.map = NULL;
+  }
+
+  if(capture.fd >= 0)
+  {
+    if(ftruncate(capture.fd, capture.offset) < 0)
+    {
+      perror("ftruncate");
+    }
+    close(capture.fd);
+    capture.fd = -1;
+  }
+}
+
+static int open_file()
+{
+  char path[strlen(capture.prefix) + sizeof(".4294967295.pcapng")];
+
+  snprintf(path, sizeof(path), "%s.%u.pcapng", capture.prefix, capture.index);
+
+  if((capture.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+  {
+    perror("open");
+    return -1;
+  }
+
+  if(ftruncate(capture.fd, capture.file_size) < 0)
+  {
+    perror("ftruncate");
+    close(capture.fd);
+    capture.fd = -1;
+    return -1;
+  }
+
+  capture.map = mmap(NULL, capture.file_size, PROT_READ | PROT_WRITE, MAP_SHARED, capture.fd, 0);
+  if(capture.map == MAP_FAILED)
+  {
+    perror("mmap");
+    capture.map = NULL;
+    close(capture.fd);
+    capture.fd = -1;
+    return -1;
+  }
+
+  capture.offset = write_headers(capture.map);
+
+  return 0;
+}
+
+static int rotate()
+{
+  close_file();
+
+  capture.index = (capture.index + 1) % capture.nb_files;
+  ++capture.stats.rotations;
+
+  return open_file();
+}
+
+/*
+ * Start capturing to the files <prefix>.0.pcapng to <prefix>.<nb_files-1>.pcapng.
+ *
+ * \param file_size  the maximum size of a file, in bytes
+ *
+ * \return 0 if successful, -1 otherwise
+ */
+int capture_open(const char* prefix, unsigned int file_size, unsigned int nb_files)
+{
+  if(file_size < 4096 || !nb_files)
+  {
+    fprintf(stderr, "invalid capture file size or count\n");
+    return -1;
+  }
+
+  capture.prefix = strdup(prefix);
+  capture.file_size = file_size;
+  capture.nb_files = nb_files;
+  capture.index = 0;
+
+  if(!capture.prefix || open_file() < 0)
+  {
+    free(capture.prefix);
+    capture.prefix = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Capture an L2CAP frame.
+ * Nothing is done if the capture of the running thread isn't open.
+ *
+ * \param ts        the time of the frame (ns since the epoch)
+ * \param received  0 for a frame sent by the host, 1 for a frame received by the host
+ * \param handle    the ACL handle the frame is written to
+ * \param cid       the channel id of the frame
+ * \param comment   the annotation of the frame, truncated to COMMENT_SIZE - 1 characters
+ */
+void capture_frame(unsigned long long ts, int received, unsigned short handle, unsigned short cid,
+    const unsigned char* buf, int len, const char* comment, ...)
+{
+  unsigned int caplen = FRAME_HEADER_SIZE + len;
+  unsigned int size = EPB_OVERHEAD + PAD4(caplen) + COMMENT_SIZE;
+  unsigned char* p;
+  unsigned char* opt;
+  va_list args;
+  int comment_len;
+
+  if(!capture.map)
+  {
+    return;
+  }
+
+  if(capture.offset + size > capture.file_size)
+  {
+    if(size > capture.file_size - HEADERS_SIZE || rotate() < 0)
+    {
+      ++capture.stats.dropped;
+      return;
+    }
+  }
+
+  p = capture.map + capture.offset;
+
+  put32(p, BLOCK_EPB);
+  put32(p + 8, 0);
+  put32(p + 12, ts >> 32);
+  put32(p + 16, ts);
+  put32(p + 20, caplen);
+  put32(p + 24, caplen);
+
+  p += 28;
+  p[0] = p[1] = p[2] = 0;
+  p[3] = received ? 1 : 0; // big endian
+  p[4] = H4_ACL;
+  put_le16(p + 5, handle | ACL_START);
+  put_le16(p + 7, 4 + len);
+  put_le16(p + 9, len);
+  put_le16(p + 11, cid);
+  memcpy(p + FRAME_HEADER_SIZE, buf, len);
+  memset(p + caplen, 0, PAD4(caplen) - caplen);
+
+  opt = p + PAD4(caplen);
+  va_start(args, comment);
+  comment_len = vsnprintf((char*)opt + 4, COMMENT_SIZE, comment, args);
+  va_end(args);
+  if(comment_len >= COMMENT_SIZE)
+  {
+    comment_len = COMMENT_SIZE - 1;
+  }
+  put16(opt, OPT_COMMENT);
+  put16(opt + 2, comment_len);
+  memset(opt + 4 + comment_len, 0, PAD4(comment_len) - comment_len);
+  opt += 4 + PAD4(comment_len);
+  put32(opt, OPT_ENDOFOPT);
+
+  size = opt + 8 - (capture.map + capture.offset);
+  put32(capture.map + capture.offset + 4, size);
+  put32(opt + 4, size);
+
+  capture.offset += size;
+
+  ++capture.stats.frames;
+  capture.stats.bytes += len;
+}
+
+/*
+ * Stop capturing, and print the capture stats.
+ */
+void capture_close()
+{
+  if(!capture.prefix)
+  {
+    return;
+  }
+
+  close_file();
+
+  printf("capture: %llu frames (%llu bytes), %llu rotations, %llu dropped\n", capture.stats.frames,
+      capture.stats.bytes, capture.stats.rotations, capture.stats.dropped);
+
+  free(capture.prefix);
+  capture.prefix = NULL;
+}
@@ -0,0 +1,19 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#define CAPTURE_FILE_MB 16
+#define CAPTURE_FILES 4
+
+int capture_open(const char* prefix, unsigned int file_size, unsigned int nb_files);
+
+void capture_frame(unsigned long long ts, int received, unsigned short handle, unsigned short cid,
+    const unsigned char* buf, int len, const char* comment, ...) __attribute__ ((format (printf, 7, 8)));
+
+void capture_close();
+
+#endif
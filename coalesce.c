@@ -0,0 +1,174 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <string.h>
+#include "coalesce.h"
+
+/*
+ * \param rate  the target number of forwards per second (all pending reports are forwarded each time),
+ *              0 to forward as soon as the outbound socket is writable
+ */
+void coalesce_init(struct coalescer* co, unsigned int rate)
+{
+  memset(co, 0x00, sizeof(*co));
+  co->period = rate ? 1000000000ULL / rate : 0;
+}
+
+/*
+ * Store a report and its reception time, replacing the pending one with the same report ID.
+ *
+ * \return 0 if the report was stored, -1 if it has to be forwarded right away
+ *         (not an input report, too large, or no free slot)
+ */
+int coalesce_push(struct coalescer* co, const unsigned char* buf, int len, unsigned long long ts)
+{
+  unsigned short key;
+  int i;
+
+  if(len < 2 || len > COALESCE_MAX_SIZE || buf[0] != HIDP_DATA_INPUT)
+  {
+    return -1;
+  }
+
+  key = buf[1];
+
+  for(i=0; i<co->nb_reports; ++i)
+  {
+    if(co->reports[i].key == key)
+    {
+      break;
+    }
+  }
+
+  if(i == co->nb_reports)
+  {
+    if(i == COALESCE_MAX_REPORTS)
+    {
+      return -1;
+    }
+    co->reports[i].key = key;
+    co->reports[i].pending = 0;
+    ++co->nb_reports;
+  }
+
+  ++co->stats.received;
+
+  if(co->reports[i].pending)
+  {
+    ++co->stats.coalesced;
+  }
+
+  memcpy(co->reports[i].buf, buf, len);
+  co->reports[i].len = len;
+  co->reports[i].seq = co->seq++;
+  co->reports[i].ts = ts;
+  co->reports[i].pending = 1;
+
+  return 0;
+}
+
+/*
+ * Get the pending report that a report would replace if it was pushed.
+ *
+ * \return 1 if there is one, 0 otherwise
+ */
+int coalesce_superseded(struct coalescer* co, const unsigned char* buf, int len, unsigned char** old, int* old_len,
+    unsigned long long* old_ts)
+{
+  int i;
+
+  if(len < 2 || len > COALESCE_MAX_SIZE || buf[0] != HIDP_DATA_INPUT)
+  {
+    return 0;
+  }
+
+  for(i=0; i<co->nb_reports; ++i)
+  {
+    if(co->reports[i].key == buf[1] && co->reports[i].pending)
+    {
+      *old = co->reports[i].buf;
+      *old_len = co->reports[i].len;
+      *old_ts = co->reports[i].ts;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * \return 1 if a report is waiting to be forwarded, 0 otherwise
+ */
+int coalesce_pending(struct coalescer* co)
+{
+  int i;
+
+  for(i=0; i<co->nb_reports; ++i)
+  {
+    if(co->reports[i].pending)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int oldest(struct coalescer* co)
+{
+  int i, index = -1;
+
+  for(i=0; i<co->nb_reports; ++i)
+  {
+    if(co->reports[i].pending && (index < 0 || (int)(co->reports[i].seq - co->reports[index].seq) < 0))
+    {
+      index = i;
+    }
+  }
+  return index;
+}
+
+/*
+ * Get the pending report that was updated first.
+ *
+ * \return 1 if there is a pending report, 0 otherwise
+ */
+int coalesce_peek(struct coalescer* co, unsigned char** buf, int* len, unsigned long long* ts)
+{
+  int index = oldest(co);
+
+  if(index < 0)
+  {
+    return 0;
+  }
+
+  *buf = co->reports[index].buf;
+  *len = co->reports[index].len;
+  *ts = co->reports[index].ts;
+
+  return 1;
+}
+
+/*
+ * Mark the report returned by coalesce_peek() as forwarded.
+ */
+void coalesce_pop(struct coalescer* co, unsigned long long now)
+{
+  int index = oldest(co);
+
+  if(index < 0)
+  {
+    return;
+  }
+
+  co->reports[index].pending = 0;
+  ++co->stats.forwarded;
+  co->next = now + co->period;
+}
+
+void coalesce_reset(struct coalescer* co)
+{
+  co->nb_reports = 0;
+  co->next = 0;
+}
@@ -0,0 +1,55 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef COALESCE_H_
+#define COALESCE_H_
+
+#define COALESCE_MAX_REPORTS 4
+#define COALESCE_MAX_SIZE 1024
+
+#define HIDP_DATA_INPUT 0xa1
+
+/*
+ * Keeps the latest HID input report of each report ID until it can be forwarded.
+ */
+struct coalescer
+{
+  unsigned long long period; // ns, 0 means as soon as the outbound socket is writable
+  unsigned long long next;   // time of the next forward
+  unsigned int seq;
+  int nb_reports;
+  struct
+  {
+    unsigned short key;
+    unsigned short len;
+    unsigned int seq;
+    unsigned long long ts;
+    int pending;
+    unsigned char buf[COALESCE_MAX_SIZE];
+  } reports[COALESCE_MAX_REPORTS];
+  struct
+  {
+    unsigned long long received;
+    unsigned long long forwarded;
+    unsigned long long coalesced;
+  } stats;
+};
+
+void coalesce_init(struct coalescer* co, unsigned int rate);
+
+int coalesce_push(struct coalescer* co, const unsigned char* buf, int len, unsigned long long ts);
+
+int coalesce_superseded(struct coalescer* co, const unsigned char* buf, int len, unsigned char** old, int* old_len,
+    unsigned long long* old_ts);
+
+int coalesce_pending(struct coalescer* co);
+
+int coalesce_peek(struct coalescer* co, unsigned char** buf, int* len, unsigned long long* ts);
+
+void coalesce_pop(struct coalescer* co, unsigned long long now);
+
+void coalesce_reset(struct coalescer* co);
+
+#endif
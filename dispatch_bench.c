@@ -0,0 +1,212 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+/*
+ * Measure the cost of dispatching a packet to its leg:
+ * - poll: the former pollfd matrix (5 roles x 13 PSMs), scanned on each wakeup, with a switch on the role,
+ * - epoll: the event loop, where each ready fd leads to its connection.
+ *
+ * One leg receives a packet per iteration (the HID interrupt PSM of a slave), the others are idle.
+ *
+ * make bench, with the CFLAGS of the Makefile (-Wall, no optimization), gcc 12.2, Linux 6.18,
+ * on a single-vCPU Xeon virtual machine: poll 4.9-5.9 us/packet, epoll 2.1-2.2 us/packet.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define ROLES 5
+#define PSMS 13
+#define LEGS (ROLES * PSMS)
+
+#define ITERATIONS 200000
+
+#define HOT_ROLE 1 // slave
+#define HOT_PSM 5  // HID interrupt
+
+struct connection
+{
+  int fd;
+  int role;
+  unsigned short psm;
+  unsigned long long packets;
+};
+
+static int fds[LEGS][2];
+
+static struct connection connections[LEGS];
+
+static unsigned long long get_time()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void receive(struct connection* c)
+{
+  unsigned char buf[64];
+
+  if(read(c->fd, buf, sizeof(buf)) > 0)
+  {
+    ++c->packets;
+  }
+}
+
+static unsigned long long bench_poll(int hot)
+{
+  struct pollfd pfd[ROLES][PSMS];
+  const unsigned char packet[20] = {};
+  unsigned long long start;
+  int i, psm, n;
+
+  for(i=0; i<ROLES; ++i)
+  {
+    for(psm=0; psm<PSMS; ++psm)
+    {
+      pfd[i][psm].fd = connections[i * PSMS + psm].fd;
+      pfd[i][psm].events = POLLIN;
+    }
+  }
+
+  start = get_time();
+
+  for(n=0; n<ITERATIONS; ++n)
+  {
+    if(write(fds[hot][1], packet, sizeof(packet)) < 0)
+    {
+      perror("write");
+      exit(1);
+    }
+
+    if(poll(*pfd, LEGS, -1) < 0)
+    {
+      perror("poll");
+      exit(1);
+    }
+
+    for(i=0; i<ROLES; ++i)
+    {
+      for(psm=0; psm<PSMS; ++psm)
+      {
+        if(pfd[i][psm].revents & POLLIN)
+        {
+          switch(i)
+          {
+            case 0:
+            case 3:
+            case 4:
+              break;
+            default:
+              receive(connections + i * PSMS + psm);
+              break;
+          }
+        }
+      }
+    }
+  }
+
+  return get_time() - start;
+}
+
+static unsigned long long bench_epoll(int hot)
+{
+  struct epoll_event events[16];
+  struct epoll_event ev = { .events = EPOLLIN };
+  const unsigned char packet[20] = {};
+  unsigned long long start;
+  int efd, i, n, nfds;
+
+  if((efd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+  {
+    perror("epoll_create1");
+    exit(1);
+  }
+
+  for(i=0; i<LEGS; ++i)
+  {
+    ev.data.ptr = connections + i;
+    if(epoll_ctl(efd, EPOLL_CTL_ADD, connections[i].fd, &ev) < 0)
+    {
+      perror("epoll_ctl EPOLL_CTL_ADD");
+      exit(1);
+    }
+  }
+
+  start = get_time();
+
+  for(n=0; n<ITERATIONS; ++n)
+  {
+    if(write(fds[hot][1], packet, sizeof(packet)) < 0)
+    {
+      perror("write");
+      exit(1);
+    }
+
+    if((nfds = epoll_wait(efd, events, sizeof(events) / sizeof(*events), -1)) < 0)
+    {
+      perror("epoll_wait");
+      exit(1);
+    }
+
+    for(i=0; i<nfds; ++i)
+    {
+      receive(events[i].data.ptr);
+    }
+  }
+
+  start = get_time() - start;
+
+  close(efd);
+
+  return start;
+}
+
+int main(int argc, char *argv[])
+{
+  int hot = HOT_ROLE * PSMS + HOT_PSM;
+  unsigned long long t_poll, t_epoll;
+  int i;
+
+  for(i=0; i<LEGS; ++i)
+  {
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds[i]) < 0)
+    {
+      perror("socketpair");
+      return 1;
+    }
+    connections[i].fd = fds[i][0];
+    connections[i].role = i / PSMS;
+    connections[i].psm = i % PSMS;
+  }
+
+  t_poll = bench_poll(hot);
+  t_epoll = bench_epoll(hot);
+
+  printf("dispatch of %d packets, 1 ready leg out of %d:\n", ITERATIONS, LEGS);
+  printf("poll:  %.2f us/packet\n", t_poll / 1000.0 / ITERATIONS);
+  printf("epoll: %.2f us/packet\n", t_epoll / 1000.0 / ITERATIONS);
+
+  if(connections[hot].packets != 2 * ITERATIONS)
+  {
+    fprintf(stderr, "%llu packets received, %d expected\n", connections[hot].packets, 2 * ITERATIONS);
+    return 1;
+  }
+
+  for(i=0; i<LEGS; ++i)
+  {
+    close(fds[i][0]);
+    close(fds[i][1]);
+  }
+
+  return 0;
+}
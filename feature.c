@@ -0,0 +1,296 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <bluetooth/bluetooth.h>
+#include "hash.h"
+#include "feature.h"
+#include "trace.h"
+
+/*
+ * Feature reports such as the calibration data, the bdaddr or the firmware version of a controller don't change,
+ * but the master reads them each time the controller connects.
+ * The feature reports of the configured report IDs are kept per device, and the next GET_REPORTs are answered locally.
+ * A SET_REPORT is always relayed, and removes the cached report with the same ID.
+ *
+ * The report IDs are shared, the reports belong to the thread that opened the cache:
+ * each event loop of the sharded mode caches the reports of its own devices.
+ */
+
+#define HIDP_TRANS_MASK 0xf0
+#define HIDP_TRANS_HANDSHAKE 0x00
+#define HIDP_TRANS_GET_REPORT 0x40
+#define HIDP_TRANS_SET_REPORT 0x50
+#define HIDP_DATA_FEATURE 0xa3
+
+#define HIDP_REPORT_TYPE_MASK 0x03
+#define HIDP_REPORT_TYPE_FEATURE 0x03
+#define HIDP_GET_REPORT_SIZE 0x08 // the request holds the maximum size of the answer
+
+#define FEATURE_CACHE_CAPACITY 16
+
+struct feature_entry
+{
+  unsigned short size; // the maximum size of the request that fetched the report
+  int len;
+  unsigned char buf[]; // the DATA message
+};
+
+static struct
+{
+  unsigned char ids[256];
+  int enabled;
+  int bypass; // toggled by the main thread
+} config;
+
+static __thread struct
+{
+  struct hash entries;
+  struct
+  {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long bypassed;
+    unsigned long long learned;
+    unsigned long long invalidated;
+  } stats;
+} cache;
+
+static uint64_t entry_key(const char* bdaddr, unsigned char report_id)
+{
+  bdaddr_t ba;
+  uint64_t key = 0;
+
+  str2ba(bdaddr, &ba);
+  memcpy(&key, &ba, sizeof(ba));
+
+  return key << 8 | report_id;
+}
+
+/*
+ * Parse a cacheable feature GET_REPORT.
+ *
+ * \return 0 if the request can be answered from the cache, -1 otherwise
+ */
+static int parse_get_report(const unsigned char* req, int len, unsigned char* report_id, unsigned short* size)
+{
+  if(len < 2 || (req[0] & HIDP_TRANS_MASK) != HIDP_TRANS_GET_REPORT
+      || (req[0] & HIDP_REPORT_TYPE_MASK) != HIDP_REPORT_TYPE_FEATURE || !config.ids[req[1]])
+  {
+    return -1;
+  }
+
+  *report_id = req[1];
+
+  if(req[0] & HIDP_GET_REPORT_SIZE)
+  {
+    if(len != 4)
+    {
+      return -1;
+    }
+    *size = req[2] | req[3] << 8;
+  }
+  else
+  {
+    if(len != 2)
+    {
+      return -1;
+    }
+    *size = 0;
+  }
+
+  return 0;
+}
+
+/*
+ * Cache the feature reports with this ID.
+ */
+void feature_cache_add(unsigned char report_id)
+{
+  config.enabled = 1;
+  config.ids[report_id] = 1;
+}
+
+int feature_cache_enabled()
+{
+  return config.enabled;
+}
+
+/*
+ * Start caching the reports in the running thread.
+ *
+ * \return 0 if successful or if no report ID is cached, -1 otherwise
+ */
+int feature_cache_open()
+{
+  if(!config.enabled)
+  {
+    return 0;
+  }
+
+  return hash_init(&cache.entries, FEATURE_CACHE_CAPACITY);
+}
+
+/*
+ * Relay all the GET_REPORTs, or answer them from the cache again.
+ * The responses are still learned while the cache is bypassed.
+ */
+void feature_cache_toggle()
+{
+  int bypass = !__atomic_load_n(&config.bypass, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&config.bypass, bypass, __ATOMIC_RELAXED);
+
+  trace_printf("feature report cache %s\n", bypass ? "bypassed" : "enabled");
+}
+
+/*
+ * Answer a GET_REPORT sent to a device, if the report is cached.
+ *
+ * \return the length of the answer, -1 if the request has to be relayed
+ */
+int feature_cache_answer(const char* bdaddr, const unsigned char* req, int len, unsigned char* rsp, int size)
+{
+  struct feature_entry* e;
+  unsigned char report_id;
+  unsigned short max;
+
+  if(!cache.entries.entries || parse_get_report(req, len, &report_id, &max) < 0)
+  {
+    return -1;
+  }
+
+  if(__atomic_load_n(&config.bypass, __ATOMIC_RELAXED))
+  {
+    ++cache.stats.bypassed;
+    return -1;
+  }
+
+  e = hash_get(&cache.entries, entry_key(bdaddr, report_id));
+
+  if(!e || e->size != max || e->len > size)
+  {
+    ++cache.stats.misses;
+    return -1;
+  }
+
+  ++cache.stats.hits;
+
+  memcpy(rsp, e->buf, e->len);
+
+  return e->len;
+}
+
+static void store(const char* bdaddr, struct feature_request* r, const unsigned char* buf, int len)
+{
+  struct feature_entry* e;
+  struct feature_entry* old;
+  uint64_t key = entry_key(bdaddr, r->report_id);
+
+  if(!(e = malloc(sizeof(*e) + len)))
+  {
+    perror("malloc");
+    return;
+  }
+
+  e->size = r->size;
+  e->len = len;
+  memcpy(e->buf, buf, len);
+
+  old = hash_get(&cache.entries, key);
+
+  if(hash_put(&cache.entries, key, e) < 0)
+  {
+    free(e);
+    return;
+  }
+
+  free(old);
+
+  ++cache.stats.learned;
+}
+
+/*
+ * Track a message relayed on a HID control channel.
+ *
+ * \param from_master  the message goes from the master to the device
+ * \param bdaddr       the device
+ */
+void feature_track(struct feature_request* r, int from_master, const char* bdaddr, const unsigned char* buf, int len)
+{
+  struct feature_entry* e;
+  unsigned char report_id;
+  unsigned short size;
+
+  if(!cache.entries.entries || len < 1)
+  {
+    return;
+  }
+
+  if(from_master)
+  {
+    if((buf[0] & HIDP_TRANS_MASK) == HIDP_TRANS_SET_REPORT && len >= 2)
+    {
+      if(config.ids[buf[1]] && (e = hash_del(&cache.entries, entry_key(bdaddr, buf[1]))))
+      {
+        free(e);
+        ++cache.stats.invalidated;
+      }
+      r->pending = 0;
+    }
+    else if(parse_get_report(buf, len, &report_id, &size) == 0)
+    {
+      r->pending = 1;
+      r->report_id = report_id;
+      r->size = size;
+    }
+    else if((buf[0] & HIDP_TRANS_MASK) == HIDP_TRANS_GET_REPORT)
+    {
+      r->pending = 0;
+    }
+    return;
+  }
+
+  if(!r->pending)
+  {
+    return;
+  }
+
+  /*
+   * The answer is either the report, or a handshake with an error code.
+   */
+  if(buf[0] == HIDP_DATA_FEATURE && len >= 2 && buf[1] == r->report_id)
+  {
+    store(bdaddr, r, buf, len);
+    r->pending = 0;
+  }
+  else if((buf[0] & HIDP_TRANS_MASK) == HIDP_TRANS_HANDSHAKE)
+  {
+    r->pending = 0;
+  }
+}
+
+void feature_cache_close()
+{
+  unsigned int i;
+
+  if(!cache.entries.entries)
+  {
+    return;
+  }
+
+  printf("feature report cache: %u reports, %llu hits, %llu misses, %llu bypassed, %llu learned, %llu invalidated\n",
+      cache.entries.count, cache.stats.hits, cache.stats.misses, cache.stats.bypassed, cache.stats.learned,
+      cache.stats.invalidated);
+
+  for(i = 0; i < cache.entries.capacity; ++i)
+  {
+    free(hash_at(&cache.entries, i));
+  }
+  hash_free(&cache.entries);
+}
@@ -0,0 +1,34 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef FEATURE_H_
+#define FEATURE_H_
+
+/*
+ * The pending GET_REPORT of a HID control channel.
+ * The master waits for the answer to a request before it sends the next one.
+ */
+struct feature_request
+{
+  int pending;
+  unsigned char report_id;
+  unsigned short size; // the maximum size of the answer, 0 if none
+};
+
+void feature_cache_add(unsigned char report_id);
+
+int feature_cache_enabled();
+
+int feature_cache_open();
+
+void feature_cache_toggle();
+
+int feature_cache_answer(const char* bdaddr, const unsigned char* req, int len, unsigned char* rsp, int size);
+
+void feature_track(struct feature_request* r, int from_master, const char* bdaddr, const unsigned char* buf, int len);
+
+void feature_cache_close();
+
+#endif
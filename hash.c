@@ -0,0 +1,170 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "hash.h"
+
+/*
+ * The table grows when it's more than 3/4 full.
+ */
+#define HASH_MAX_LOAD(CAPACITY) ((CAPACITY) / 4 * 3)
+
+static inline unsigned int slot(const struct hash* h, uint64_t key)
+{
+  return (key * 0x9E3779B97F4A7C15ULL) >> h->shift;
+}
+
+static int alloc_entries(struct hash* h, unsigned int capacity)
+{
+  unsigned int bits = 0;
+
+  while((1U << bits) < capacity)
+  {
+    ++bits;
+  }
+
+  if(!(h->entries = calloc(1U << bits, sizeof(*h->entries))))
+  {
+    perror("calloc");
+    return -1;
+  }
+
+  h->capacity = 1U << bits;
+  h->shift = 64 - (bits ? bits : 1);
+  h->count = 0;
+
+  return 0;
+}
+
+/*
+ * \param capacity  the initial capacity, rounded up to a power of 2
+ *
+ * \return 0 if successful, -1 otherwise
+ */
+int hash_init(struct hash* h, unsigned int capacity)
+{
+  return alloc_entries(h, capacity < 2 ? 2 : capacity);
+}
+
+void hash_free(struct hash* h)
+{
+  free(h->entries);
+  h->entries = NULL;
+  h->capacity = 0;
+  h->count = 0;
+}
+
+void* hash_get(const struct hash* h, uint64_t key)
+{
+  unsigned int mask = h->capacity - 1;
+  unsigned int i;
+
+  for(i = slot(h, key) & mask; h->entries[i].value; i = (i + 1) & mask)
+  {
+    if(h->entries[i].key == key)
+    {
+      return h->entries[i].value;
+    }
+  }
+
+  return NULL;
+}
+
+static void insert(struct hash* h, uint64_t key, void* value)
+{
+  unsigned int mask = h->capacity - 1;
+  unsigned int i;
+
+  for(i = slot(h, key) & mask; h->entries[i].value && h->entries[i].key != key; i = (i + 1) & mask);
+
+  if(!h->entries[i].value)
+  {
+    ++h->count;
+  }
+
+  h->entries[i].key = key;
+  h->entries[i].value = value;
+}
+
+static int grow(struct hash* h)
+{
+  struct hash_entry* old = h->entries;
+  unsigned int capacity = h->capacity;
+  unsigned int i;
+
+  if(alloc_entries(h, 2 * capacity) < 0)
+  {
+    h->entries = old;
+    h->capacity = capacity;
+    return -1;
+  }
+
+  for(i=0; i<capacity; ++i)
+  {
+    if(old[i].value)
+    {
+      insert(h, old[i].key, old[i].value);
+    }
+  }
+
+  free(old);
+
+  return 0;
+}
+
+/*
+ * Add an entry, or replace the value of an existing key.
+ *
+ * \return 0 if successful, -1 otherwise
+ */
+int hash_put(struct hash* h, uint64_t key, void* value)
+{
+  if(h->count + 1 > HASH_MAX_LOAD(h->capacity) && grow(h) < 0)
+  {
+    return -1;
+  }
+
+  insert(h, key, value);
+
+  return 0;
+}
+
+/*
+ * Remove an entry.
+ *
+ * \return the value of the removed entry, NULL if the key wasn't found
+ */
+void* hash_del(struct hash* h, uint64_t key)
+{
+  unsigned int mask = h->capacity - 1;
+  unsigned int i, j, k;
+  void* value;
+
+  for(i = slot(h, key) & mask; h->entries[i].value && h->entries[i].key != key; i = (i + 1) & mask);
+
+  if(!(value = h->entries[i].value))
+  {
+    return NULL;
+  }
+
+  /*
+   * Move back the entries of the cluster that can't be reached from their slot anymore.
+   */
+  for(j = (i + 1) & mask; h->entries[j].value; j = (j + 1) & mask)
+  {
+    k = slot(h, h->entries[j].key) & mask;
+    if(((j - k) & mask) >= ((j - i) & mask))
+    {
+      h->entries[i] = h->entries[j];
+      i = j;
+    }
+  }
+
+  h->entries[i].value = NULL;
+  --h->count;
+
+  return value;
+}
@@ -0,0 +1,47 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stdint.h>
+
+/*
+ * An open-addressing hash table, with linear probing.
+ * The keys are 64-bit integers, the values are non-NULL pointers.
+ * Removing an entry shifts the following entries of its cluster back, so there are no tombstones.
+ */
+struct hash
+{
+  unsigned int capacity; // a power of 2
+  unsigned int count;
+  unsigned int shift;
+  struct hash_entry
+  {
+    uint64_t key;
+    void* value;
+  }* entries;
+};
+
+int hash_init(struct hash* h, unsigned int capacity);
+
+void hash_free(struct hash* h);
+
+void* hash_get(const struct hash* h, uint64_t key);
+
+int hash_put(struct hash* h, uint64_t key, void* value);
+
+void* hash_del(struct hash* h, uint64_t key);
+
+/*
+ * Iterate over the values: for(i = 0; i < h->capacity; ++i) if((value = hash_at(h, i))) ...
+ * The table must not be modified while iterating.
+ */
+static inline void* hash_at(const struct hash* h, unsigned int i)
+{
+  return h->entries[i].value;
+}
+
+#endif
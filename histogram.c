@@ -0,0 +1,80 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <stdio.h>
+#include "histogram.h"
+#include "trace.h"
+
+/*
+ * Get the highest value of a bucket.
+ */
+unsigned long long histogram_bucket_max(unsigned int index)
+{
+  unsigned int e, sub;
+
+  if(index < HISTOGRAM_SUB_BUCKETS)
+  {
+    return index;
+  }
+
+  e = index / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+  sub = index % HISTOGRAM_SUB_BUCKETS;
+
+  return (((unsigned long long)(HISTOGRAM_SUB_BUCKETS + sub + 1)) << (e - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+/*
+ * \param percentile  in the ]0, 100] range
+ *
+ * \return the highest value of the bucket holding the percentile, 0 if the histogram is empty
+ */
+unsigned long long histogram_percentile(struct histogram* h, double percentile)
+{
+  unsigned long long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+  unsigned long long rank = count * percentile / 100;
+  unsigned long long total = 0;
+  unsigned long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  unsigned long long value;
+  unsigned int i;
+
+  if(!count)
+  {
+    return 0;
+  }
+
+  if(!rank)
+  {
+    rank = 1;
+  }
+
+  for(i=0; i<HISTOGRAM_BUCKETS; ++i)
+  {
+    total += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+    if(total >= rank)
+    {
+      value = histogram_bucket_max(i);
+      return value < max ? value : max;
+    }
+  }
+
+  return max;
+}
+
+/*
+ * Print the percentiles of a histogram of durations in ns, in us.
+ */
+void histogram_print(struct histogram* h, const char* name)
+{
+  unsigned long long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+
+  if(!count)
+  {
+    return;
+  }
+
+  trace_printf("%s: %llu packets, p50: %.1f us, p99: %.1f us, p99.9: %.1f us, max: %.1f us\n", name, count,
+      histogram_percentile(h, 50) / 1000.0, histogram_percentile(h, 99) / 1000.0,
+      histogram_percentile(h, 99.9) / 1000.0, __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1000.0);
+}
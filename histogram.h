@@ -0,0 +1,66 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+/*
+ * Each power of 2 is split into 2^HISTOGRAM_SUB_BITS linear buckets,
+ * so that the relative error of a value is at most 1/2^HISTOGRAM_SUB_BITS.
+ */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/*
+ * A log-linear histogram (HDR style).
+ *
+ * It has a single writer, and can be read from any thread at any time:
+ * the counters are updated with relaxed atomic loads and stores, without locked instructions.
+ */
+struct histogram
+{
+  unsigned long long count;
+  unsigned long long sum;
+  unsigned long long max;
+  unsigned long long buckets[HISTOGRAM_BUCKETS];
+} __attribute__((aligned(64)));
+
+static inline unsigned int histogram_index(unsigned long long value)
+{
+  unsigned int e;
+
+  if(value < HISTOGRAM_SUB_BUCKETS)
+  {
+    return value;
+  }
+
+  e = 63 - __builtin_clzll(value);
+
+  return (e - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+      + ((value >> (e - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+#define HISTOGRAM_INC(VAR, VALUE) \
+  __atomic_store_n(&(VAR), __atomic_load_n(&(VAR), __ATOMIC_RELAXED) + (VALUE), __ATOMIC_RELAXED)
+
+static inline void histogram_record(struct histogram* h, unsigned long long value)
+{
+  HISTOGRAM_INC(h->buckets[histogram_index(value)], 1);
+  HISTOGRAM_INC(h->count, 1);
+  HISTOGRAM_INC(h->sum, value);
+  if(value > __atomic_load_n(&h->max, __ATOMIC_RELAXED))
+  {
+    __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+  }
+}
+
+unsigned long long histogram_bucket_max(unsigned int index);
+
+unsigned long long histogram_percentile(struct histogram* h, double percentile);
+
+void histogram_print(struct histogram* h, const char* name);
+
+#endif
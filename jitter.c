@@ -0,0 +1,117 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jitter.h"
+
+int jitter_init(struct jitter* j, unsigned int size, unsigned int target)
+{
+  memset(j, 0x00, sizeof(*j));
+
+  if(target > size)
+  {
+    fprintf(stderr, "jitter buffer: the target delay is larger than the buffer\n");
+    return -1;
+  }
+
+  if(!(j->buf = malloc(size)))
+  {
+    perror("malloc");
+    return -1;
+  }
+
+  j->size = size;
+  j->target = target;
+
+  return 0;
+}
+
+void jitter_push(struct jitter* j, const unsigned char* data, unsigned int len)
+{
+  unsigned int tail;
+  unsigned int first;
+
+  j->stats.pushed += len;
+
+  if(len > j->size)
+  {
+    data += len - j->size;
+    len = j->size;
+  }
+
+  if(j->count + len > j->size)
+  {
+    unsigned int drop = j->count + len - j->size;
+
+    j->head = (j->head + drop) % j->size;
+    j->count -= drop;
+    ++j->stats.overruns;
+  }
+
+  tail = (j->head + j->count) % j->size;
+  first = j->size - tail < len ? j->size - tail : len;
+
+  memcpy(j->buf + tail, data, first);
+  memcpy(j->buf, data + first, len - first);
+
+  j->count += len;
+
+  if(j->count > j->stats.max)
+  {
+    j->stats.max = j->count;
+  }
+}
+
+void jitter_pull(struct jitter* j, unsigned char* data, unsigned int len)
+{
+  unsigned int avail;
+  unsigned int first;
+
+  if(!j->playing)
+  {
+    if(j->count < j->target || !j->count)
+    {
+      memset(data, 0x00, len);
+      return;
+    }
+    j->playing = 1;
+  }
+
+  avail = j->count < len ? j->count : len;
+  first = j->size - j->head < avail ? j->size - j->head : avail;
+
+  memcpy(data, j->buf + j->head, first);
+  memcpy(data + first, j->buf, avail - first);
+
+  j->head = (j->head + avail) % j->size;
+  j->count -= avail;
+  j->stats.played += avail;
+
+  if(avail < len)
+  {
+    memset(data + avail, 0x00, len - avail);
+    ++j->stats.underruns;
+    j->playing = 0;
+  }
+}
+
+/*
+ * Empty the buffer and clear the statistics, the memory is kept.
+ */
+void jitter_reset(struct jitter* j)
+{
+  j->head = 0;
+  j->count = 0;
+  j->playing = 0;
+  memset(&j->stats, 0x00, sizeof(j->stats));
+}
+
+void jitter_free(struct jitter* j)
+{
+  free(j->buf);
+  j->buf = NULL;
+}
@@ -0,0 +1,45 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef JITTER_H_
+#define JITTER_H_
+
+/*
+ * A jitter buffer for a stream of audio bytes, in a preallocated ring.
+ *
+ * The bytes are pulled at the pace of the receiving link, which may differ from the pace of the sending link.
+ * Playout starts once the buffer holds the target delay, and silence is played until then.
+ * An underrun (not enough bytes to pull) plays silence, and waits for the target delay again.
+ * An overrun (no room for the pushed bytes) drops the oldest bytes.
+ */
+struct jitter
+{
+  unsigned char* buf;
+  unsigned int size;
+  unsigned int head;   // the oldest byte
+  unsigned int count;
+  unsigned int target; // the bytes to hold before playing out
+  int playing;
+  struct
+  {
+    unsigned long long pushed;
+    unsigned long long played;   // bytes, silence excluded
+    unsigned long long underruns;
+    unsigned long long overruns;
+    unsigned int max;            // the maximum number of bytes held
+  } stats;
+};
+
+int jitter_init(struct jitter* j, unsigned int size, unsigned int target);
+
+void jitter_push(struct jitter* j, const unsigned char* data, unsigned int len);
+
+void jitter_pull(struct jitter* j, unsigned char* data, unsigned int len);
+
+void jitter_reset(struct jitter* j);
+
+void jitter_free(struct jitter* j);
+
+#endif
@@ -3,17 +3,20 @@
  License: GPLv3
  */
 
+#define _GNU_SOURCE
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
 #include <unistd.h>
 #include "bt_utils.h"
 #include <errno.h>
 #include <stdlib.h>
-#include <bluetooth/hci.h>
-#include <bluetooth/hci_lib.h>
+#include <string.h>
 #include <fcntl.h>
-#include <sys/ioctl.h>
-#include <sys/uio.h>
+#include "acl.h"
+#include "l2cap_con.h"
+#include "sco_con.h"
+#include "transport.h"
+#include "trace.h"
 
 #ifdef BT_POWER
 #warning "BT_POWER is already defined."
@@ -27,137 +30,51 @@ struct bt_power {
 };
 #endif
 
-#define ACL_MTU 1024
+#define L2CAP_MTU 1024
 
 /*
- * This function can be used to bypass the l2cap outgoing MTU check of the Linux kernel.
- * If plen is higher than ACL_MTU, it sends a segmented packet.
+ * The packets sent by the proxy, and the ones that didn't fit the outgoing MTU of their leg.
+ *
+ * Each sending thread counts them in its own block, with relaxed atomic loads and stores
+ * (a counter has a single writer), and l2cap_print_stats() sums the blocks.
+ * A block is allocated the first time a thread sends a packet, and is kept.
  */
-int acl_send_data (const char *bdaddr_dst, unsigned short cid, const unsigned char *data, unsigned short plen)
+struct counters
 {
-  int ret = -1, dd, device;
-  struct hci_conn_info_req *cr = 0;
-  bdaddr_t ba;
-  uint8_t type = HCI_ACLDATA_PKT;
-  hci_acl_hdr acl_hdr;
-  l2cap_hdr l2_hdr;
-  struct iovec iv[4];
-  int ivn;
-  unsigned short data_len;
-  char* pdata = (char*)data;
-
-  str2ba(bdaddr_dst, &ba);
-
-  // find the connection handle to the specified bluetooth device
-  cr = (struct hci_conn_info_req*) malloc(
-      sizeof(struct hci_conn_info_req) + sizeof(struct hci_conn_info));
-  bacpy(&cr->bdaddr, &ba);
-  cr->type = ACL_LINK;
-
-  if ((device = hci_get_route(&ba)) < 0)
-  {
-    perror("hci_get_route");
-    goto cleanup;
-  }
-
-  if ((dd = hci_open_dev(device)) < 0)
-  {
-    perror("hci_open_dev");
-    goto cleanup;
-  }
-
-  if (ioctl(dd, HCIGETCONNINFO, (unsigned long) cr) < 0)
-  {
-    perror("ioctl HCIGETCONNINFO");
-    goto cleanup;
-  }
-  
-  data_len = ACL_MTU-1-HCI_ACL_HDR_SIZE-L2CAP_HDR_SIZE;
-  if(plen < data_len)
-  {
-    data_len = plen;
-  }
+  struct counters* next;
+  unsigned long long packets;
+  unsigned long long bypassed;
+} __attribute__((aligned(64)));
 
-  iv[0].iov_base = &type;
-  iv[0].iov_len = 1;
+static struct counters* blocks = NULL;
 
-  acl_hdr.handle = htobs(acl_handle_pack(cr->conn_info->handle, ACL_START));
-  acl_hdr.dlen = htobs(data_len+L2CAP_HDR_SIZE);
-  
-  iv[1].iov_base = &acl_hdr;
-  iv[1].iov_len = HCI_ACL_HDR_SIZE;
-
-  l2_hdr.cid = htobs(cid);
-  l2_hdr.len = htobs(plen);
+static __thread struct counters* counters = NULL;
 
-  iv[2].iov_base = &l2_hdr;
-  iv[2].iov_len = L2CAP_HDR_SIZE;
+#define COUNTER_ADD(VAR, VAL) \
+  __atomic_store_n(&(VAR), __atomic_load_n(&(VAR), __ATOMIC_RELAXED) + (VAL), __ATOMIC_RELAXED)
 
-  ivn = 3;
-  
-  if (data_len)
-  {
-    iv[3].iov_base = pdata;
-    iv[3].iov_len = htobs(data_len);
-    ivn = 4;
-  }
-  
-  while ((ret = writev(dd, iv, ivn)) < 0)
+/*
+ * Count sent packets in the block of the running thread.
+ */
+static void count_sent(unsigned int packets, unsigned int bypassed)
+{
+  if(!counters)
   {
-    if (errno == EAGAIN || errno == EINTR)
+    if(posix_memalign((void**)&counters, __alignof__(*counters), sizeof(*counters)))
     {
-      continue;
+      counters = NULL;
+      return;
     }
-    perror("writev: ");
-    break;
+    memset(counters, 0x00, sizeof(*counters));
+    counters->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&blocks, &counters->next, counters, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
   }
-  
-  plen -= data_len;
-  
-  while(plen)
-  {
-    pdata += data_len;
-    data_len = ACL_MTU-1-HCI_ACL_HDR_SIZE;
-    if(plen < data_len)
-    {
-      data_len = plen;
-    }
-
-    iv[0].iov_base = &type;
-    iv[0].iov_len = 1;
 
-    acl_hdr.handle = htobs(acl_handle_pack(cr->conn_info->handle, ACL_CONT));
-    acl_hdr.dlen = htobs(plen);
-
-    iv[1].iov_base = &acl_hdr;
-    iv[1].iov_len = HCI_ACL_HDR_SIZE;
-
-    iv[2].iov_base = pdata;
-    iv[2].iov_len = htobs(data_len);
-    ivn = 3;
-  
-    while ((ret = writev(dd, iv, ivn)) < 0)
-    {
-      if (errno == EAGAIN || errno == EINTR)
-      {
-        continue;
-      }
-      perror("writev: ");
-      break;
-    }
-    
-    plen -= data_len;
-  }
-  
-  cleanup: free(cr);
-  if (dd >= 0)
-    close(dd);
-  return ret;
+  COUNTER_ADD(counters->packets, packets);
+  COUNTER_ADD(counters->bypassed, bypassed);
 }
 
-#define L2CAP_MTU 1024
-
-static void l2cap_setsockopt(int fd)
+static void l2cap_setsockopt(int fd, unsigned short imtu, unsigned short omtu)
 {
   struct l2cap_options l2o;
   socklen_t len = sizeof(l2o);
@@ -165,37 +82,37 @@ static void l2cap_setsockopt(int fd)
   int opt = L2CAP_LM_MASTER;
   if (setsockopt(fd, SOL_L2CAP, L2CAP_LM, &opt, sizeof(opt)) < 0)
   {
-    perror("setsockopt L2CAP_LM");
+    trace_printf("setsockopt L2CAP_LM: %s\n", strerror(errno));
   }
 
   memset(&l2o, 0, sizeof(l2o));
   if(getsockopt(fd, SOL_L2CAP, L2CAP_OPTIONS, &l2o, &len) < 0)
   {
-    perror("getsockopt L2CAP_OPTIONS");
+    trace_printf("getsockopt L2CAP_OPTIONS: %s\n", strerror(errno));
   }
   else
   {
-    l2o.omtu = L2CAP_MTU;
-    l2o.imtu = L2CAP_MTU;
+    l2o.omtu = omtu ? omtu : L2CAP_MTU;
+    l2o.imtu = imtu ? imtu : L2CAP_MTU;
     if(setsockopt(fd, SOL_L2CAP, L2CAP_OPTIONS, &l2o, sizeof(l2o)) < 0)
     {
-      perror("setsockopt L2CAP_OPTIONS");
+      trace_printf("setsockopt L2CAP_OPTIONS: %s\n", strerror(errno));
     }
   }
 
   /*if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
   {
-    perror("fcntl O_NONBLOCK");
+    trace_printf("fcntl O_NONBLOCK: %s\n", strerror(errno));
   }*/
 
   struct bt_power pwr = {.force_active = BT_POWER_FORCE_ACTIVE_OFF};
   if (setsockopt(fd, SOL_BLUETOOTH, BT_POWER, &pwr, sizeof(pwr)) < 0)
   {
-    perror("setsockopt BT_POWER");
+    trace_printf("setsockopt BT_POWER: %s\n", strerror(errno));
   }
 }
 
-int l2cap_connect(const char *bdaddr_src, const char *bdaddr_dest, int psm)
+int l2cap_connect(const char *bdaddr_src, const char *bdaddr_dest, int psm, unsigned short imtu, unsigned short omtu)
 {
     int fd;
     struct sockaddr_l2 addr;
@@ -203,19 +120,19 @@ int l2cap_connect(const char *bdaddr_src, const char *bdaddr_dest, int psm)
 
     if ((fd = socket(PF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK, BTPROTO_L2CAP)) == -1)
     {
-      perror("socket");
+      trace_printf("socket: %s\n", strerror(errno));
       return -1;
     }
 
     /*opt = 0;
     if (setsockopt(fd, SOL_L2CAP, L2CAP_LM, &opt, sizeof(opt)) < 0)
     {
-      perror("setsockopt L2CAP_LM");
+      trace_printf("setsockopt L2CAP_LM: %s\n", strerror(errno));
       close(fd);
       return -3;
     }*/
 
-    l2cap_setsockopt(fd);
+    l2cap_setsockopt(fd, imtu, omtu);
 
     memset(&addr, 0, sizeof(addr));
     addr.l2_family = AF_BLUETOOTH;
@@ -231,7 +148,7 @@ int l2cap_connect(const char *bdaddr_src, const char *bdaddr_dest, int psm)
     {
       if(errno != EINPROGRESS)
       {
-        perror("connect");
+        trace_printf("connect: %s\n", strerror(errno));
         close(fd);
         return -4;
       }
@@ -240,23 +157,42 @@ int l2cap_connect(const char *bdaddr_src, const char *bdaddr_dest, int psm)
     return fd;
 }
 
-int l2cap_send(const char* bdaddr_dst, unsigned short cid, int fd, const unsigned char* buf, int len)
+/*
+ * Get the outgoing MTU to compare the packets with.
+ * The default L2CAP MTU is used if the negotiated one is unknown.
+ */
+static inline unsigned short get_omtu(unsigned short omtu)
+{
+  return omtu ? omtu : L2CAP_DEFAULT_MTU;
+}
+
+/*
+ * Send a packet.
+ * Packets that don't fit the negotiated outgoing MTU go through the ACL bypass of the adapter.
+ */
+int l2cap_send(int dev_id, const char* bdaddr_dst, unsigned short cid, unsigned short omtu, int fd,
+    const unsigned char* buf, int len)
 {
-  if(len > L2CAP_DEFAULT_MTU)
+  if(len > get_omtu(omtu))
   {
-    if(acl_send_data(bdaddr_dst, cid, buf, len) < 0)
+    if(acl_send_data(dev_id, bdaddr_dst, cid, buf, len) < 0)
     {
-      perror("acl_send_data");
+      trace_printf("acl_send_data: %s\n", strerror(errno));
       return -1;
     }
+    count_sent(1, 1);
   }
   else
   {
     if(write(fd, buf, len) != len)
     {
-      perror("write");
+      if(errno != EAGAIN)
+      {
+        trace_printf("write: %s\n", strerror(errno));
+      }
       return -1;
     }
+    count_sent(1, 0);
   }
   return len;
 }
@@ -266,7 +202,69 @@ int l2cap_recv(int fd, unsigned char* buf, int len)
     return recv(fd, buf, len, MSG_DONTWAIT);
 }
 
-int l2cap_listen(unsigned short psm)
+/*
+ * Receive up to n packets with a single system call.
+ *
+ * \return the number of packets received (a 0-length packet means the connection was closed),
+ *         or -1 in case of error
+ */
+int l2cap_recv_batch(int fd, struct mmsghdr* msgs, unsigned int n)
+{
+  return recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+}
+
+/*
+ * Send a batch of packets.
+ * Consecutive packets that fit the outgoing MTU are sent with a single system call,
+ * the others go through the ACL bypass.
+ *
+ * \return the number of packets sent, or -1 if the first packet could not be sent
+ */
+int l2cap_send_batch(int dev_id, const char* bdaddr_dst, unsigned short cid, unsigned short omtu, int fd,
+    struct mmsghdr* msgs, unsigned int n)
+{
+  unsigned int i = 0, j;
+  int ret;
+
+  while(i < n)
+  {
+    if(msgs[i].msg_hdr.msg_iov->iov_len > get_omtu(omtu))
+    {
+      if(acl_send_data(dev_id, bdaddr_dst, cid, msgs[i].msg_hdr.msg_iov->iov_base, msgs[i].msg_hdr.msg_iov->iov_len) < 0)
+      {
+        trace_printf("acl_send_data: %s\n", strerror(errno));
+        break;
+      }
+      count_sent(1, 1);
+      ++i;
+      continue;
+    }
+
+    for(j = i; j < n && msgs[j].msg_hdr.msg_iov->iov_len <= get_omtu(omtu); ++j);
+
+    if((ret = sendmmsg(fd, msgs + i, j - i, MSG_DONTWAIT)) < 0)
+    {
+      if(errno != EAGAIN)
+      {
+        trace_printf("sendmmsg: %s\n", strerror(errno));
+      }
+      break;
+    }
+
+    i += ret;
+
+    count_sent(ret, 0);
+
+    if(i < j)
+    {
+      break;
+    }
+  }
+
+  return i ? i : -1;
+}
+
+int l2cap_listen(unsigned short psm, unsigned short mtu)
 {
   struct sockaddr_l2 loc_addr = { 0 };
   int s;
@@ -278,7 +276,7 @@ int l2cap_listen(unsigned short psm)
     return -1;
   }
 
-  l2cap_setsockopt(s);
+  l2cap_setsockopt(s, mtu, mtu);
 
   // bind socket to port psm of the first available
   // bluetooth adapter
@@ -313,15 +311,15 @@ int l2cap_accept(int s, bdaddr_t* src, unsigned short* psm, unsigned short* cid)
   char buf[sizeof("00:00:00:00:00:00")+1] = { 0 };
   socklen_t opt = sizeof(rem_addr);
 
-  // accept one connection
-  if((client = accept(s, (struct sockaddr *) &rem_addr, &opt)) < 0)
+  // accept one connection, the proxy never blocks on the accepted socket
+  if((client = accept4(s, (struct sockaddr *) &rem_addr, &opt, SOCK_NONBLOCK)) < 0)
   {
-    perror("accept");
+    trace_printf("accept: %s\n", strerror(errno));
     return -1;
   }
 
   ba2str(&rem_addr.l2_bdaddr, buf);
-  printf("accepted connection from %s (psm: 0x%04x)\n", buf, btohs(rem_addr.l2_psm));
+  trace_printf("accepted connection from %s (psm: 0x%04x)\n", buf, btohs(rem_addr.l2_psm));
   
   bacpy(src, &rem_addr.l2_bdaddr);
   *psm = btohs(rem_addr.l2_psm);
@@ -330,6 +328,73 @@ int l2cap_accept(int s, bdaddr_t* src, unsigned short* psm, unsigned short* cid)
   return client;
 }
 
+/*
+ * Get the remote channel identifier of a connected socket.
+ */
+unsigned short l2cap_get_cid(int fd)
+{
+  struct sockaddr_l2 addr = { 0 };
+  socklen_t len = sizeof(addr);
+
+  if(getpeername(fd, (struct sockaddr *) &addr, &len) < 0)
+  {
+    trace_printf("getpeername: %s\n", strerror(errno));
+    return 0;
+  }
+
+  return btohs(addr.l2_cid);
+}
+
+/*
+ * Get the bdaddr of the adapter a socket is bound to.
+ */
+int l2cap_get_src(int fd, bdaddr_t* src)
+{
+  struct sockaddr_l2 addr = { 0 };
+  socklen_t len = sizeof(addr);
+
+  if(getsockname(fd, (struct sockaddr *) &addr, &len) < 0)
+  {
+    trace_printf("getsockname: %s\n", strerror(errno));
+    return -1;
+  }
+
+  bacpy(src, &addr.l2_bdaddr);
+
+  return 0;
+}
+
+/*
+ * Get the MTUs negotiated by a connected socket.
+ */
+void l2cap_get_mtu(int fd, unsigned short* imtu, unsigned short* omtu)
+{
+  struct l2cap_options l2o = { 0 };
+  socklen_t len = sizeof(l2o);
+
+  if(getsockopt(fd, SOL_L2CAP, L2CAP_OPTIONS, &l2o, &len) < 0)
+  {
+    trace_printf("getsockopt L2CAP_OPTIONS: %s\n", strerror(errno));
+  }
+
+  *imtu = l2o.imtu;
+  *omtu = l2o.omtu;
+}
+
+void l2cap_print_stats()
+{
+  unsigned long long packets = 0, bypassed = 0;
+  struct counters* c;
+
+  for(c = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); c; c = c->next)
+  {
+    packets += __atomic_load_n(&c->packets, __ATOMIC_RELAXED);
+    bypassed += __atomic_load_n(&c->bypassed, __ATOMIC_RELAXED);
+  }
+
+  printf("l2cap: %llu packets sent, %llu through the ACL bypass\n", packets, bypassed);
+}
+
 int l2cap_is_connected(int fd)
 {
   int error = 0;
@@ -339,17 +404,17 @@ int l2cap_is_connected(int fd)
 
   if(ret < 0)
   {
-    perror("getsockopt SO_ERROR");
+    trace_printf("getsockopt SO_ERROR: %s\n", strerror(errno));
   }
   else
   {
     if(error == EINPROGRESS)
     {
-      fprintf(stderr, "EINPROGRESS\n");
+      trace_printf("EINPROGRESS\n");
     }
     else if(error)
     {
-      fprintf(stderr, "connection failed: %s\n", strerror(error));
+      trace_printf("connection failed: %s\n", strerror(error));
     }
     else
     {
@@ -358,3 +423,31 @@ int l2cap_is_connected(int fd)
   }
   return 0;
 }
+
+/*
+ * The L2CAP socket is bound to the first available adapter, whatever bdaddr_src.
+ */
+static int l2cap_listen_any(const char* bdaddr_src, unsigned short psm, unsigned short mtu)
+{
+  return l2cap_listen(psm, mtu);
+}
+
+const struct transport transport_bluetooth =
+{
+  .name = "bluetooth",
+  .listen = l2cap_listen_any,
+  .accept = l2cap_accept,
+  .connect = l2cap_connect,
+  .is_connected = l2cap_is_connected,
+  .get_cid = l2cap_get_cid,
+  .get_src = l2cap_get_src,
+  .get_mtu = l2cap_get_mtu,
+  .send = l2cap_send,
+  .recv = l2cap_recv,
+  .recv_batch = l2cap_recv_batch,
+  .send_batch = l2cap_send_batch,
+  .sco_listen = sco_listen,
+  .sco_accept = sco_accept,
+  .sco_connect = sco_connect,
+  .sco_authorize = sco_authorize,
+};
@@ -8,16 +8,32 @@
 
 #include <bluetooth/bluetooth.h>
 
-int l2cap_connect(const char*, const char*, int);
+int l2cap_connect(const char*, const char*, int, unsigned short imtu, unsigned short omtu);
 
 int l2cap_is_connected(int fd);
 
-int l2cap_send(const char* bdaddr_dst, unsigned short cid, int fd, const unsigned char* buf, int len);
+unsigned short l2cap_get_cid(int fd);
+
+int l2cap_get_src(int fd, bdaddr_t* src);
+
+void l2cap_get_mtu(int fd, unsigned short* imtu, unsigned short* omtu);
+
+int l2cap_send(int dev_id, const char* bdaddr_dst, unsigned short cid, unsigned short omtu, int fd,
+    const unsigned char* buf, int len);
 
 int l2cap_recv(int, unsigned char*, int);
 
-int l2cap_listen(int);
+struct mmsghdr;
+
+int l2cap_recv_batch(int fd, struct mmsghdr* msgs, unsigned int n);
+
+int l2cap_send_batch(int dev_id, const char* bdaddr_dst, unsigned short cid, unsigned short omtu, int fd,
+    struct mmsghdr* msgs, unsigned int n);
+
+int l2cap_listen(unsigned short psm, unsigned short mtu);
 
 int l2cap_accept(int s, bdaddr_t* src, unsigned short* psm, unsigned short* cid);
 
+void l2cap_print_stats();
+
 #endif
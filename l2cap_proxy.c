@@ -1,388 +1,3996 @@
-/*
- Copyright (c) 2013 Mathieu Laurendeau
- License: GPLv3
- */
-
-#define _GNU_SOURCE
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <errno.h>
-#include "l2cap_con.h"
-#include <sys/time.h>
-#include <signal.h>
-#include <err.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <poll.h>
-#include <bluetooth/bluetooth.h>
-#include <sys/types.h>
-#include "bt_utils.h"
-
-#include <sched.h>
-
-
-
-/*
- * https://www.bluetooth.org/en-us/specification/assigned-numbers/logical-link-control
- */
-#define PSM_SDP 0x0001 //Service Discovery Protocol
-#define PSM_RFCOMM  0x0003 //Can't be used for L2CAP sockets
-#define PSM_TCS_BIN 0x0005 //Telephony Control Specification
-#define PSM_TCS_BIN_CORDLESS  0x0007 //Telephony Control Specification
-#define PSM_BNEP  0x000F //Bluetooth Network Encapsulation Protocol
-#define PSM_HID_Control 0x0011 //Human Interface Device
-#define PSM_HID_Interrupt 0x0013 //Human Interface Device
-#define PSM_UPnP  0x0015
-#define PSM_AVCTP 0x0017 //Audio/Video Control Transport Protocol
-#define PSM_AVDTP 0x0019 //Audio/Video Distribution Transport Protocol
-#define PSM_AVCTP_Browsing  0x001B //Audio/Video Remote Control Profile
-#define PSM_UDI_C_Plane 0x001D //Unrestricted Digital Information Profile
-#define PSM_ATT 0x001F
-#define PSM_3DSP 0x0021 //3D Synchronization Profile
-
-static unsigned short psm_list[] =
-{
-    PSM_SDP,
-    PSM_TCS_BIN,
-    PSM_TCS_BIN_CORDLESS,
-    PSM_BNEP,
-    PSM_HID_Control,
-    PSM_HID_Interrupt,
-    PSM_UPnP,
-    PSM_AVCTP,
-    PSM_AVDTP,
-    PSM_AVCTP_Browsing,
-    PSM_UDI_C_Plane,
-    PSM_ATT,
-    PSM_3DSP
-};
-
-#define PSM_MAX_INDEX (sizeof(psm_list)/sizeof(*psm_list))
-
-#define LISTEN_INDEX 0
-#define SLAVE_INDEX  1
-#define MASTER_INDEX 2
-
-#define SLAVE_CONNECTING_INDEX 3
-#define MASTER_CONNECTING_INDEX 4
-
-#define MAX_INDEX 5
-
-#define CID_SLAVE_INDEX 0
-#define CID_MASTER_INDEX 1
-
-#define CID_MAX_INDEX 2
-
-static int debug = 0;
-
-static volatile int done = 0;
-
-void terminate(int sig)
-{
-  done = 1;
-}
-
-void dump(unsigned char* buf, int len)
-{
-  int i;
-  for(i=0; i<len; ++i)
-  {
-    printf("0x%02x ", buf[i]);
-    if(!((i+1)%8))
-    {
-      printf("\n");
-    }
-  }
-  printf("\n");
-}
-
-static void close_fd(struct pollfd* pfd)
-{
-  close(pfd->fd);
-  pfd->fd = -1;
-}
-
-int main(int argc, char *argv[])
-{
-  char* master = NULL;
-  char* local = NULL;
-  uint32_t device_class = 0x508;
-  unsigned char buf[4096];
-  ssize_t len;
-  int ret;
-  unsigned int cpt = 0;
-  bdaddr_t bdaddr_a;
-  unsigned short psm_a;
-  unsigned short cid_a;
-  int fd_a;
-  bdaddr_t bdaddr_m;
-  char slave[sizeof("00:00:00:00:00:00")+1] = {};
-  unsigned short cid[CID_MAX_INDEX][PSM_MAX_INDEX];
-
-  /*
-   * Set highest priority & scheduler policy.
-   */
-  struct sched_param p =
-  { .sched_priority = sched_get_priority_max(SCHED_FIFO) };
-
-  sched_setscheduler(0, SCHED_FIFO, &p);
-
-  setlinebuf(stdout);
-
-  (void) signal(SIGINT, terminate);
-
-  /* Check args */
-  if (argc >= 1)
-    master = argv[1];
-
-  if (argc >= 2)
-    local = argv[2];
-
-  if (argc >= 3)
-    device_class = strtol(argv[3], NULL, 0);
-
-  if (!master || bachk(master) == -1 || (local && bachk(local) == -1)) {
-    printf("usage: %s <ps3-mac-address> <dongle-mac-address> <device-class>\n", *argv);
-    return 1;
-  }
-
-  str2ba(master, &bdaddr_m);
-
-  if(bt_write_device_class(local, device_class) < 0)
-  {
-    printf("failed to set device class\n");
-    return 1;
-  }
-
-  /*
-   * table 1: fds to accept new connections
-   * table 2: fds connected to the slave
-   * table 3: fds connected to the master
-   *
-   * table 4: fds connecting to the slave
-   * table 5: fds connecting to the master
-   */
-  struct pollfd pfd[MAX_INDEX][PSM_MAX_INDEX] = {};
-
-  int i, psm;
-  for(i=0; i<MAX_INDEX; ++i)
-  {
-    for(psm=0; psm<PSM_MAX_INDEX; ++psm)
-    {
-      pfd[i][psm].fd = -1;
-    }
-  }
-
-  for(psm=0; psm<PSM_MAX_INDEX; ++psm)
-  {
-    pfd[LISTEN_INDEX][psm].fd = l2cap_listen(psm_list[psm]);
-    pfd[LISTEN_INDEX][psm].events = POLLIN;
-  }
-
-  while(!done)
-  {
-    if(poll(*pfd, MAX_INDEX*PSM_MAX_INDEX, -1))
-    {
-      for(i=0; i<MAX_INDEX; ++i)
-      {
-        for(psm=0; psm<PSM_MAX_INDEX; ++psm)
-        {
-          if (pfd[i][psm].revents & (POLLERR | POLLHUP))
-          {
-            switch(i)
-            {
-              case LISTEN_INDEX:
-                printf("poll error from listening socket (psm: 0x%04x)\n", psm_list[psm]);
-                break;
-              case SLAVE_INDEX:
-                printf("poll error from SLAVE (psm: 0x%04x)\n", psm_list[psm]);
-                close_fd(&pfd[SLAVE_INDEX][psm]);
-                close_fd(&pfd[MASTER_INDEX][psm]);
-                break;
-              case MASTER_INDEX:
-                printf("poll error from MASTER (psm: 0x%04x)\n", psm_list[psm]);
-                close_fd(&pfd[MASTER_INDEX][psm]);
-                close_fd(&pfd[SLAVE_INDEX][psm]);
-                break;
-            }
-          }
-
-          if(pfd[i][psm].revents & POLLOUT)
-          {
-            if(l2cap_is_connected(pfd[i][psm].fd))
-            {
-              switch(i)
-              {
-                case SLAVE_CONNECTING_INDEX:
-                  printf("connected to %s (psm: 0x%04x)\n", slave, psm_list[psm]);
-                  pfd[SLAVE_INDEX][psm].fd = pfd[i][psm].fd;
-                  pfd[SLAVE_INDEX][psm].events = POLLIN;
-                  break;
-                case MASTER_CONNECTING_INDEX:
-                  printf("connected to %s (psm: 0x%04x)\n", master, psm_list[psm]);
-                  pfd[MASTER_INDEX][psm].fd = pfd[i][psm].fd;
-                  pfd[MASTER_INDEX][psm].events = POLLIN;
-                  break;
-              }
-              pfd[i][psm].fd = -1;
-            }
-          }
-
-          if(pfd[i][psm].revents & POLLIN)
-          {
-            switch(i)
-            {
-              case LISTEN_INDEX:
-
-                fd_a = l2cap_accept(pfd[i][psm].fd, &bdaddr_a, &psm_a, &cid_a);
-
-                if(fd_a < 0)
-                {
-                  printf("accept error (psm: 0x%04x)\n", psm_list[psm]);
-                  break;
-                }
-
-                if(bacmp(&bdaddr_a, &bdaddr_m))
-                {
-                  ba2str(&bdaddr_a, slave);
-                  
-                  cid[CID_SLAVE_INDEX][psm] = cid_a;
-
-                  if(pfd[SLAVE_INDEX][psm].fd < 0)
-                  {
-                    pfd[SLAVE_INDEX][psm].fd = fd_a;
-                    pfd[SLAVE_INDEX][psm].events = POLLIN;
-
-                    printf("connecting with %s to %s (psm: 0x%04x)\n", local, master, psm_list[psm]);
-
-                    pfd[MASTER_CONNECTING_INDEX][psm].fd = l2cap_connect(local, master, psm_list[psm]);
-                    pfd[MASTER_CONNECTING_INDEX][psm].events = POLLOUT;
-
-                    if(pfd[MASTER_CONNECTING_INDEX][psm].fd < 0)
-                    {
-                      printf("can't start connection to MASTER (psm: 0x%04x)\n", psm_list[psm]);
-                      close_fd(&pfd[SLAVE_INDEX][psm]);
-                    }
-                  }
-                  else
-                  {
-                    close(fd_a);
-                    fprintf(stderr, "psm already used: 0x%04x\n", psm_list[psm]);
-                  }
-                }
-                else
-                {
-                  cid[CID_MASTER_INDEX][psm] = cid_a;
-
-                  if(pfd[MASTER_INDEX][psm].fd < 0)
-                  {
-                    pfd[MASTER_INDEX][psm].fd = fd_a;
-                    pfd[MASTER_INDEX][psm].events = POLLIN;
-
-                    printf("connecting with %s to %s (psm: 0x%04x)\n", local, slave, psm_list[psm]);
-
-                    pfd[SLAVE_CONNECTING_INDEX][psm].fd = l2cap_connect(local, slave, psm_list[psm]);
-                    pfd[SLAVE_CONNECTING_INDEX][psm].events = POLLOUT;
-
-                    if(pfd[SLAVE_CONNECTING_INDEX][psm].fd < 0)
-                    {
-                      printf("can't start connection to SLAVE (psm: 0x%04x)\n", psm_list[psm]);
-                      close_fd(&pfd[MASTER_INDEX][psm]);
-                    }
-                  }
-                  else
-                  {
-                    close(fd_a);
-                    fprintf(stderr, "psm already used: 0x%04x\n", psm_list[psm]);
-                  }
-                }
-                break;
-              case SLAVE_INDEX:
-                if(pfd[MASTER_INDEX][psm].fd < 0)
-                {
-                  break;
-                }
-                len = read(pfd[SLAVE_INDEX][psm].fd, buf, sizeof(buf));
-                cpt++;
-                if(psm_list[psm] == PSM_HID_Interrupt)
-                {
-                  if(cpt%8)
-                  {
-                    /*
-                     * TODO: try to get rid of this
-                     */
-                    break;
-                  }
-                }
-                if (len > 0)
-                {
-                  ret = l2cap_send(master, cid[MASTER_INDEX][psm], pfd[MASTER_INDEX][psm].fd, buf, len);
-                  if(ret < 0)
-                  {
-                    printf("write error (SLAVE > MASTER) (psm: 0x%04x)\n", psm_list[psm]);
-                  }
-                  if(debug)
-                  {
-                    printf("SLAVE > MASTER (psm: 0x%04x)\n", psm_list[psm]);
-                    dump(buf, len);
-                  }
-                }
-                else if(errno != EINTR)
-                {
-                  printf("recv error from SLAVE (psm: 0x%04x)\n", psm_list[psm]);
-                  close_fd(&pfd[SLAVE_INDEX][psm]);
-                  close_fd(&pfd[MASTER_INDEX][psm]);
-                }
-                else
-                {
-                  printf("write interrupted (SLAVE > MASTER) (psm: 0x%04x)\n", psm_list[psm]);
-                }
-                break;
-              case MASTER_INDEX:
-                if(pfd[SLAVE_INDEX][psm].fd < 0)
-                {
-                  break;
-                }
-                len = read(pfd[MASTER_INDEX][psm].fd, buf, sizeof(buf));
-                if (len > 0)
-                {
-                  ret = l2cap_send(master, cid[SLAVE_INDEX][psm], pfd[SLAVE_INDEX][psm].fd, buf, len);
-                  if(ret < 0)
-                  {
-                    printf("write error (MASTER > SLAVE) (psm: 0x%04x)\n", psm_list[psm]);
-                  }
-                  if(debug)
-                  {
-                    printf("MASTER > SLAVE (psm: 0x%04x)\n", psm_list[psm]);
-                    dump(buf, len);
-                  }
-                }
-                else if(errno != EINTR)
-                {
-                  printf("recv error from server (psm: 0x%04x)\n", psm_list[psm]);
-                  close_fd(&pfd[MASTER_INDEX][psm]);
-                  close_fd(&pfd[SLAVE_INDEX][psm]);
-                }
-                else
-                {
-                  printf("write interrupted (MASTER > SLAVE) (psm: 0x%04x)\n", psm_list[psm]);
-                }
-                break;
-            }
-          }
-        }
-      }
-    }
-  }
-
-  for(i=0; i<MAX_INDEX; ++i)
-  {
-    for(psm=0; psm<PSM_MAX_INDEX; ++psm)
-    {
-      close(pfd[i][psm].fd);
-    }
-  }
-
-  return 0;
-}
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "transport.h"
+#include "l2cap_con.h"
+#include <sys/time.h>
+#include <signal.h>
+#include <err.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <stddef.h>
+#include <bluetooth/bluetooth.h>
+#include <sys/types.h>
+#include "bt_utils.h"
+#include "acl.h"
+#include "coalesce.h"
+#include "queue.h"
+#include "pool.h"
+#include "ring.h"
+#include "histogram.h"
+#include "trace.h"
+#include "capture.h"
+#include "replay.h"
+#include "hash.h"
+#include "sdp.h"
+#include "feature.h"
+#include "psm_config.h"
+#include "jitter.h"
+#include "adapter.h"
+#include "metrics.h"
+#include "wheel.h"
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+#include <sched.h>
+
+
+
+/*
+ * https://www.bluetooth.org/en-us/specification/assigned-numbers/logical-link-control
+ */
+#define PSM_SDP 0x0001 //Service Discovery Protocol
+#define PSM_RFCOMM  0x0003 //Can't be used for L2CAP sockets
+#define PSM_TCS_BIN 0x0005 //Telephony Control Specification
+#define PSM_TCS_BIN_CORDLESS  0x0007 //Telephony Control Specification
+#define PSM_BNEP  0x000F //Bluetooth Network Encapsulation Protocol
+#define PSM_HID_Control 0x0011 //Human Interface Device
+#define PSM_HID_Interrupt 0x0013 //Human Interface Device
+#define PSM_UPnP  0x0015
+#define PSM_AVCTP 0x0017 //Audio/Video Control Transport Protocol
+#define PSM_AVDTP 0x0019 //Audio/Video Distribution Transport Protocol
+#define PSM_AVCTP_Browsing  0x001B //Audio/Video Remote Control Profile
+#define PSM_UDI_C_Plane 0x001D //Unrestricted Digital Information Profile
+#define PSM_ATT 0x001F
+#define PSM_3DSP 0x0021 //3D Synchronization Profile
+
+#define DEFAULT_PSM(PSM, CLASS, OVERFLOW, COALESCE) \
+  { .psm = PSM, .class = CLASS, .overflow = OVERFLOW, .relay = RELAY_BOTH, .priority = -1, .coalesce = COALESCE }
+
+/*
+ * The PSMs proxied when there is no configuration file.
+ */
+static const struct psm_config default_psms[] =
+{
+    DEFAULT_PSM(PSM_SDP,              CLASS_CONTROL,   OVERFLOW_BLOCK,       0),
+    DEFAULT_PSM(PSM_TCS_BIN,          CLASS_BULK,      OVERFLOW_BLOCK,       0),
+    DEFAULT_PSM(PSM_TCS_BIN_CORDLESS, CLASS_BULK,      OVERFLOW_BLOCK,       0),
+    DEFAULT_PSM(PSM_BNEP,             CLASS_BULK,      OVERFLOW_BLOCK,       0),
+    DEFAULT_PSM(PSM_HID_Control,      CLASS_CONTROL,   OVERFLOW_BLOCK,       0),
+    DEFAULT_PSM(PSM_HID_Interrupt,    CLASS_INTERRUPT, OVERFLOW_DROP_OLDEST, 1),
+    DEFAULT_PSM(PSM_UPnP,             CLASS_BULK,      OVERFLOW_BLOCK,       0),
+    DEFAULT_PSM(PSM_AVCTP,            CLASS_CONTROL,   OVERFLOW_BLOCK,       0),
+    DEFAULT_PSM(PSM_AVDTP,            CLASS_BULK,      OVERFLOW_BLOCK,       0),
+    DEFAULT_PSM(PSM_AVCTP_Browsing,   CLASS_CONTROL,   OVERFLOW_BLOCK,       0),
+    DEFAULT_PSM(PSM_UDI_C_Plane,      CLASS_BULK,      OVERFLOW_BLOCK,       0),
+    DEFAULT_PSM(PSM_ATT,              CLASS_CONTROL,   OVERFLOW_BLOCK,       0),
+    DEFAULT_PSM(PSM_3DSP,             CLASS_BULK,      OVERFLOW_BLOCK,       0),
+};
+
+/*
+ * The proxied PSMs. The channels and the histograms use the same indexes.
+ */
+static struct psm_table psms;
+
+#define MAX_EVENTS 16
+
+#define RELAY_BATCH 8
+#define RELAY_BUF_SIZE PSM_MTU_MAX
+
+/*
+ * The packet buffers of a thread: the batch, and the queued packets.
+ */
+#define POOL_BUFFERS 512
+
+#define TRACE_RECORDS 4096
+
+#define SESSIONS_CAPACITY 16
+
+/*
+ * The time after which a speculative connection to the master is closed, if the device didn't claim it.
+ */
+#define PRECONNECT_TIMEOUT 5000000000ULL
+
+/*
+ * A connection to a device or to the master that doesn't complete in time is tried again,
+ * after a delay that doubles with each attempt. The other leg stays open meanwhile.
+ */
+#define CONNECT_TIMEOUT 10000000000ULL
+#define CONNECT_RETRIES 3
+#define CONNECT_BACKOFF 500000000ULL
+
+/*
+ * The pseudo ACL handles of the captured frames.
+ */
+#define CAPTURE_HANDLE_MASTER 1
+#define CAPTURE_HANDLE_SLAVE 2
+
+typedef enum
+{
+  ROLE_LISTEN,
+  ROLE_SLAVE,
+  ROLE_MASTER,
+  ROLE_HCI,
+  ROLE_TIMER,
+  ROLE_MAILBOX,
+  ROLE_SCO_LISTEN,
+  ROLE_SCO_SLAVE,
+  ROLE_SCO_MASTER,
+} e_role;
+
+typedef enum
+{
+  DIR_SLAVE_TO_MASTER,
+  DIR_MASTER_TO_SLAVE,
+  DIR_MAX,
+} e_dir;
+
+typedef enum
+{
+  STATE_CLOSED,
+  STATE_CONNECTING,
+  STATE_CONNECTED,
+} e_state;
+
+/*
+ * Pipelined mode: where a writer thread sends the packets of a leg.
+ * The reader thread copies it from the leg into each slot, as it rewrites the leg when it reconnects.
+ */
+struct pipe_dest
+{
+  int fd;
+  int dev_id;
+  unsigned short cid;
+  unsigned short omtu;
+};
+
+/*
+ * One socket of the proxy.
+ * Packets that can't be written right away wait in the queue, until the socket becomes writable.
+ * The pointer to this structure is stored in the epoll event data,
+ * so that a ready descriptor directly leads to its connection.
+ */
+struct connection
+{
+  int fd;
+  e_role role;
+  e_state state;
+  unsigned short psm;
+  unsigned short cid;
+  unsigned short imtu; // negotiated, 0 if unknown
+  unsigned short omtu;
+  int adapter; // the index of the adapter of the leg, -1 if unknown
+  struct connection* peer;
+  uint32_t events;
+  e_overflow overflow;
+  struct queue queue;
+  int pollout;
+  int starved; // the pool had no buffer to read into: the leg isn't read until buffers are returned
+  struct pipe_dest tx; // pipelined mode: where the queued packets go, owned by the writer thread
+  int closing;         // pipelined mode: tx.fd is closed once the queue is drained
+  struct connection* next_closing;
+  struct histogram* latency; // time spent in the proxy by the packets written to this leg
+  struct coalescer* coalescer;
+  struct wheel_timer pace;    // the coalescer waits for its next period
+  struct wheel_timer connect; // the connection times out, or is tried again
+  unsigned int attempts;      // failed connection attempts
+  struct session* session;
+};
+
+/*
+ * The listening socket of a PSM.
+ */
+struct channel
+{
+  struct connection listen;
+};
+
+static struct channel* channels = NULL;
+
+/*
+ * Sharded mode: each adapter gets its own event loop thread, which owns the sessions of the devices connected to it,
+ * with both their legs. The main thread only accepts the legs, and hands them over to the loops.
+ * A relayed packet never leaves its loop: the state of a loop is thread-local, including its capture files and caches,
+ * and the only shared state is the accepted legs, and the counts of the open legs of each device (see adapter.c).
+ */
+#define SHARD_RING_SIZE 64
+
+struct shard_msg
+{
+  int fd;
+  int index;          // the index of the PSM
+  bdaddr_t bdaddr_a;  // the remote device of the leg
+  bdaddr_t bdaddr_s;  // the slave device of the session
+  unsigned short cid;
+  int adapter;
+};
+
+static struct shard
+{
+  struct ring ring;         // the accepted legs, from the main thread
+  struct connection mailbox; // the eventfd that signals the ring
+  pthread_t thread;
+  int cpu;
+} shards[ADAPTERS_MAX];
+
+static unsigned int nb_shards = 0;
+
+/*
+ * The shard of the running loop, NULL for the main thread.
+ */
+static __thread struct shard* self = NULL;
+
+/*
+ * The shard of the last slave device that connected to the proxy.
+ */
+static unsigned int slave_shard = 0;
+
+/*
+ * The time spent in the proxy by the packets of each PSM and direction.
+ * A histogram is written by a single thread: all the legs of a direction are written by the same thread.
+ */
+static __thread struct histogram* (*latencies)[DIR_MAX] = NULL;
+
+/*
+ * The metrics updated by the running thread, NULL if they aren't served.
+ */
+static __thread struct metrics* metrics = NULL;
+
+/*
+ * Update the metrics of the packets written to a leg, or of the PSM of a channel.
+ */
+#define METRIC(C, FIELD, VALUE) \
+  do \
+  { \
+    if(metrics && (C)->session) \
+    { \
+      METRICS_ADD(metrics->psms[(C)->session->config - psms.entries].dir[dir_to(C)].FIELD, VALUE); \
+    } \
+  } while(0)
+
+#define PSM_METRIC(INDEX, FIELD, VALUE) \
+  do \
+  { \
+    if(metrics) \
+    { \
+      METRICS_ADD(metrics->psms[INDEX].FIELD, VALUE); \
+    } \
+  } while(0)
+
+/*
+ * The two legs between a slave device and the master, for a PSM.
+ * A session is created when its first leg is accepted, and removed once both legs are closed.
+ * In pipelined mode, a writer thread holds a reference to the session of a leg it has to close.
+ * The last reference frees the session.
+ */
+struct session
+{
+  struct connection slave;
+  struct connection master;
+  uint64_t key;
+  char bdaddr[sizeof("00:00:00:00:00:00")]; // of the slave device
+  int refs;
+  int released;
+  struct session* next_released;
+  struct wheel_timer park;    // a speculative master leg waits for the slave leg
+  struct wheel_timer idle;    // the session is closed if nothing was relayed meanwhile
+  unsigned long long active;  // time the last packet was relayed, if idle sessions are closed
+  unsigned long long setup;   // time the device connected its first leg, in ns
+  int reported;               // the first input report of the device was forwarded
+  struct sdp_transactions* sdp;
+  struct feature_request feature;
+  const struct psm_config* config;
+  unsigned long long filtered; // packets of a direction that isn't relayed
+};
+
+/*
+ * The sessions, by bdaddr of the slave device and PSM.
+ * Connecting to the proxy is the only lookup: the epoll event data leads to the legs.
+ */
+static __thread struct hash sessions;
+
+/*
+ * The sessions removed while processing a batch of events.
+ * They are released after the batch, as the next events may point to their legs.
+ */
+static __thread struct session* released = NULL;
+
+static __thread struct
+{
+  unsigned long long started;
+  unsigned long long claimed;
+  unsigned long long expired;
+} preconnects;
+
+/*
+ * The HCI event sockets of the ACL engine of the running thread.
+ */
+static __thread struct connection hci = { .fd = -1, .role = ROLE_HCI };
+
+/*
+ * The timers of the loop: coalescer periods, connection timeouts and retries, parked and idle sessions.
+ * The timerfd is armed for the next deadline of the wheel, and isn't armed if the wheel is empty.
+ */
+static __thread struct connection timer = { .fd = -1, .role = ROLE_TIMER };
+
+static __thread unsigned long long timer_deadline = 0;
+
+static __thread struct wheel wheel;
+
+static void on_pace_timer(struct wheel_timer* t, unsigned long long now);
+static void on_connect_timer(struct wheel_timer* t, unsigned long long now);
+static void on_park_timer(struct wheel_timer* t, unsigned long long now);
+static void on_idle_timer(struct wheel_timer* t, unsigned long long now);
+
+/*
+ * The time after which a session is closed if no packet was relayed, 0 if idle sessions aren't closed.
+ */
+static unsigned long long idle_timeout = 0;
+
+/*
+ * SCO bridging: an SCO link accepted from a device (or from the master) is bridged to a new SCO link with the other side.
+ * The accepted link is only established once the other one is.
+ *
+ * The two links run on different clocks. The audio received from a link is buffered,
+ * and each packet received from a link is answered with a packet of the same size,
+ * pulled from the audio of the other link: each link is written at its own pace.
+ * The jitter buffers absorb the timing differences, and are preallocated at startup.
+ */
+#define SCO_BRIDGES 4
+#define SCO_BUF_SIZE 512
+#define SCO_BYTES_PER_MS 16 // 8 kHz, 16-bit linear PCM
+#define SCO_MAX_DELAY 1000
+
+struct sco_bridge
+{
+  struct connection slave;
+  struct connection master;
+  struct connection* pending; // the accepted link, until the other link is established
+  struct jitter jitter[DIR_MAX]; // the audio waiting to be written, by direction
+  unsigned long long lost[DIR_MAX]; // packets the links couldn't take
+  char bdaddr[sizeof("00:00:00:00:00:00")];
+};
+
+static struct sco_bridge sco_bridges[SCO_BRIDGES];
+
+static struct connection sco_listener = { .fd = -1, .role = ROLE_SCO_LISTEN };
+
+/*
+ * The target delay of the jitter buffers in ms, -1 if SCO links aren't bridged.
+ */
+static int sco_delay = -1;
+
+/*
+ * The target rate of the HID input reports, 0 means no limit.
+ */
+static unsigned int hid_rate = 0;
+
+static __thread int efd = -1;
+
+static char* master = NULL;
+static char* local = NULL;
+static __thread char slave[sizeof("00:00:00:00:00:00")+1] = {};
+
+/*
+ * Spread the legs over the adapters: a slave device and the master are reached through different adapters,
+ * and the devices are spread by the number of legs of each adapter.
+ * Otherwise, the legs to the master are connected with the local adapter.
+ */
+static int spreading = 0;
+
+static int local_adapter = -1;
+
+/*
+ * The adapter the last slave device connected to.
+ */
+static __thread int slave_adapter = -1;
+
+static const char* dir_name[] =
+{
+  [DIR_SLAVE_TO_MASTER] = "SLAVE > MASTER",
+  [DIR_MASTER_TO_SLAVE] = "MASTER > SLAVE",
+};
+
+static const char* role_name[] =
+{
+  [ROLE_LISTEN] = "LISTEN",
+  [ROLE_SLAVE] = "SLAVE",
+  [ROLE_MASTER] = "MASTER",
+  [ROLE_HCI] = "HCI",
+  [ROLE_TIMER] = "TIMER",
+  [ROLE_MAILBOX] = "MAILBOX",
+  [ROLE_SCO_LISTEN] = "SCO LISTEN",
+  [ROLE_SCO_SLAVE] = "SCO SLAVE",
+  [ROLE_SCO_MASTER] = "SCO MASTER",
+};
+
+/*
+ * Pipelined mode: the packets of each direction are written by a dedicated thread.
+ * The main thread reads the packets and handles the connection lifecycle.
+ * It passes the packets to the writer threads through lock-free rings.
+ *
+ * A leg that is closed while connected is handed over to the writer thread,
+ * that closes it once it has processed the packets queued before, and written the send queue of the leg.
+ * The reader thread waits for a free slot to hand a leg over, and drops a packet if the ring is full.
+ * The send queue of a leg is owned by the writer thread.
+ */
+#define PIPE_RING_SIZE 256
+
+struct pipe_slot
+{
+  struct connection* c;
+  struct pipe_dest dest;
+  int len; // -1 to close dest.fd, -2 to drop the ACL handle of the device in data
+  unsigned long long ts;
+  unsigned char data[RELAY_BUF_SIZE];
+};
+
+static struct pipe
+{
+  struct ring ring;
+  pthread_t thread;
+  int cpu;
+  int efd;
+  int evfd;
+  int sleeping;
+  int space;    // eventfd: the writer thread freed slots
+  int waiting;  // the reader thread waits for a free slot
+  int stopping;
+  struct connection* closing; // the legs waiting for their queue to be drained to be closed
+  struct pool pool; // the packets that can't be written at once are copied from the ring to the pool
+  struct
+  {
+    unsigned long long packets;
+    unsigned long long overflows;
+    unsigned long long wakeups;
+  } stats;
+} pipes[DIR_MAX] = { { .cpu = -1 }, { .cpu = -1 } };
+
+static int pipelined = 0;
+
+/*
+ * The size of the packet buffers: the largest configured MTU, or RELAY_BUF_SIZE if a PSM has none.
+ */
+static unsigned int buf_size = RELAY_BUF_SIZE;
+
+/*
+ * The packet buffers of the running thread.
+ * No packet is allocated once the proxy runs: a queued packet shares the buffer it was received in,
+ * or is copied to a buffer of the pool.
+ */
+static __thread struct pool pool;
+
+/*
+ * Some legs of the running loop wait for free buffers.
+ */
+static __thread int starving = 0;
+
+/*
+ * The buffers used to receive and forward a batch of packets.
+ * A buffer that is still queued when the next batch is read is replaced with a free one.
+ */
+static __thread struct
+{
+  unsigned char* bufs[RELAY_BATCH];
+  struct iovec iovs[RELAY_BATCH];
+  struct mmsghdr msgs[RELAY_BATCH];
+  unsigned char ctrl[RELAY_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+  unsigned long long ts[RELAY_BATCH];
+  struct
+  {
+    unsigned long long reads;
+    unsigned long long packets;
+  } stats;
+} batch;
+
+/*
+ * The ready events of an iteration of the loop are served by class, with a deficit round-robin.
+ * Each class gets a quantum of packets per iteration, the interrupt class first.
+ * The events a class has no credit left for are reported again by the next epoll_wait (level-triggered),
+ * so that bulk traffic is served a share of each iteration, but can't delay the input reports by more than that.
+ */
+static const int sched_quantum[CLASS_MAX] =
+{
+  [CLASS_INTERRUPT] = 4 * RELAY_BATCH,
+  [CLASS_CONTROL] = 2 * RELAY_BATCH,
+  [CLASS_BULK] = RELAY_BATCH,
+};
+
+static __thread struct
+{
+  struct epoll_event* ready[CLASS_MAX][MAX_EVENTS];
+  unsigned int count[CLASS_MAX];
+  int deficit[CLASS_MAX];
+  struct histogram* service[CLASS_MAX]; // time between the reception of a packet and its read by the loop
+  struct
+  {
+    unsigned long long packets;
+    unsigned long long deferred;
+  } stats[CLASS_MAX];
+} sched;
+
+static int debug = 0;
+
+static int capturing = 0;
+
+static const char* capture_prefix = NULL;
+static unsigned int capture_size = CAPTURE_FILE_MB;
+static unsigned int capture_files = CAPTURE_FILES;
+
+/*
+ * Answer the SDP requests from the cache when possible.
+ */
+static int sdp_caching = 0;
+
+static const char* sdp_path = NULL;
+
+/*
+ * Replay mode: the legs are local sockets fed from a capture.
+ */
+static int replaying = 0;
+
+static const struct transport* transport = &transport_bluetooth;
+
+static volatile int done = 0;
+
+/*
+ * Incremented by SIGUSR1: each loop prints its latencies when it sees a new value.
+ */
+static volatile int print_latency = 0;
+
+static volatile int toggle_bypass = 0;
+
+static bdaddr_t bdaddr_m;
+
+void terminate(int sig)
+{
+  done = 1;
+}
+
+void request_latency(int sig)
+{
+  ++print_latency;
+}
+
+void request_bypass(int sig)
+{
+  toggle_bypass = 1;
+}
+
+static int ev_register(struct connection* c, uint32_t events)
+{
+  struct epoll_event ev = { .events = events, .data.ptr = c };
+
+  if(epoll_ctl(efd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+  {
+    trace_printf("epoll_ctl EPOLL_CTL_ADD: %s\n", strerror(errno));
+    return -1;
+  }
+  c->events = events;
+  return 0;
+}
+
+/*
+ * Poll a leg for:
+ * - writability while it connects, or while packets wait to be written to it,
+ * - input while the other leg is connected and can take more packets, and the pool has buffers to read into.
+ */
+static void update_events(struct connection* c)
+{
+  struct connection* peer = c->peer;
+  struct epoll_event ev = { .data.ptr = c };
+
+  if(c->fd < 0)
+  {
+    return;
+  }
+
+  if(c->state == STATE_CONNECTING)
+  {
+    ev.events = EPOLLOUT;
+  }
+  else
+  {
+    ev.events = c->pollout ? EPOLLOUT : 0;
+    if(peer->state == STATE_CONNECTED && !c->starved
+        && (pipelined || !(peer->overflow == OVERFLOW_BLOCK && queue_full(&peer->queue))))
+    {
+      ev.events |= EPOLLIN;
+    }
+  }
+
+  if(ev.events == c->events)
+  {
+    return;
+  }
+
+  if(epoll_ctl(efd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+  {
+    trace_printf("epoll_ctl EPOLL_CTL_MOD: %s\n", strerror(errno));
+  }
+
+  c->events = ev.events;
+}
+
+static const char* remote_bdaddr(struct connection* c)
+{
+  return c->role == ROLE_MASTER ? master : c->session->bdaddr;
+}
+
+/*
+ * The ACL bypass and the device class only apply to bluetooth legs.
+ */
+static int is_bluetooth()
+{
+  return transport == &transport_bluetooth;
+}
+
+/*
+ * Get the time used to timestamp the packets, in ns.
+ * This is the clock of the kernel timestamps (SO_TIMESTAMPNS).
+ */
+static unsigned long long get_realtime()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Get the direction of the packets written to a leg.
+ */
+static e_dir dir_to(struct connection* c)
+{
+  return (c->role == ROLE_MASTER || c->role == ROLE_SCO_MASTER) ? DIR_SLAVE_TO_MASTER : DIR_MASTER_TO_SLAVE;
+}
+
+/*
+ * Record a packet written to a leg: the time it spent in the proxy, the load of the adapter, and the metrics.
+ */
+static void record_sent(struct connection* c, int len, unsigned long long ts, unsigned long long now)
+{
+  histogram_record(c->latency, now > ts ? now - ts : 0);
+  adapter_sent(c->adapter, len);
+  METRIC(c, packets, 1);
+  METRIC(c, bytes, len);
+}
+
+static void pipe_wake(struct pipe* p)
+{
+  uint64_t one = 1;
+
+  /*
+   * Pairs with the fence in pipe_run(): either the writer sees the new slot,
+   * or this thread sees that the writer is about to sleep.
+   */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if(__atomic_load_n(&p->sleeping, __ATOMIC_RELAXED))
+  {
+    if(write(p->evfd, &one, sizeof(one)) < 0)
+    {
+      trace_printf("write eventfd: %s\n", strerror(errno));
+    }
+  }
+}
+
+/*
+ * Reader thread: copy the destination of the packets of a leg.
+ */
+static void get_dest(struct connection* c, struct pipe_dest* d)
+{
+  d->fd = c->fd;
+  d->dev_id = adapter_dev_id(c->adapter);
+  d->cid = c->cid;
+  d->omtu = c->omtu;
+}
+
+/*
+ * Reader thread: reserve a slot of a ring, and wait for the writer thread to free one if the ring is full.
+ */
+static struct pipe_slot* pipe_reserve(struct pipe* p)
+{
+  struct pipe_slot* slot;
+  uint64_t value;
+
+  while(!(slot = ring_reserve(&p->ring)))
+  {
+    __atomic_store_n(&p->waiting, 1, __ATOMIC_RELAXED);
+
+    /*
+     * Pairs with the fence in pipe_run(): either this thread sees the freed slots,
+     * or the writer sees that this thread is about to wait.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if(!ring_reserve(&p->ring) && read(p->space, &value, sizeof(value)) < 0)
+    {
+      trace_printf("read eventfd: %s\n", strerror(errno));
+    }
+
+    __atomic_store_n(&p->waiting, 0, __ATOMIC_RELAXED);
+  }
+
+  return slot;
+}
+
+/*
+ * Pass a packet to the writer thread of a leg.
+ */
+static int pipe_push(struct connection* c, const unsigned char* buf, int len, unsigned long long ts)
+{
+  struct pipe* p = pipes + dir_to(c);
+  struct pipe_slot* slot = ring_reserve(&p->ring);
+
+  if(!slot)
+  {
+    ++p->stats.overflows;
+    METRIC(c, drops, 1);
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  slot->c = c;
+  get_dest(c, &slot->dest);
+  slot->len = len;
+  slot->ts = ts;
+  memcpy(slot->data, buf, len);
+
+  ring_commit(&p->ring);
+
+  pipe_wake(p);
+
+  return 0;
+}
+
+/*
+ * Hand a leg over to its writer thread, which will close it.
+ */
+static void pipe_close(struct connection* c)
+{
+  struct pipe* p = pipes + dir_to(c);
+  struct pipe_slot* slot = pipe_reserve(p);
+
+  __atomic_add_fetch(&c->session->refs, 1, __ATOMIC_RELAXED);
+
+  slot->c = c;
+  get_dest(c, &slot->dest);
+  slot->len = -1;
+
+  ring_commit(&p->ring);
+
+  pipe_wake(p);
+}
+
+/*
+ * Drop the ACL handle of the remote device of a leg in the engine of its writer thread.
+ * If the ring is full, the handle is dropped when the link goes down.
+ */
+static void pipe_drop(struct connection* c)
+{
+  struct pipe* p = pipes + dir_to(c);
+  struct pipe_slot* slot = ring_reserve(&p->ring);
+
+  if(!slot)
+  {
+    return;
+  }
+
+  slot->c = NULL;
+  get_dest(c, &slot->dest);
+  slot->len = -2;
+  strcpy((char*)slot->data, remote_bdaddr(c));
+
+  ring_commit(&p->ring);
+
+  pipe_wake(p);
+}
+
+static void init_connection(struct connection* c, e_role role, unsigned short psm, struct connection* peer)
+{
+  c->fd = -1;
+  c->role = role;
+  c->state = STATE_CLOSED;
+  c->psm = psm;
+  c->cid = 0;
+  c->imtu = 0;
+  c->omtu = 0;
+  c->adapter = -1;
+  c->peer = peer;
+  c->coalescer = NULL;
+  wheel_timer_init(&c->pace, on_pace_timer);
+  wheel_timer_init(&c->connect, on_connect_timer);
+  c->attempts = 0;
+  c->events = 0;
+  c->overflow = OVERFLOW_BLOCK;
+  memset(&c->queue, 0x00, sizeof(c->queue));
+  c->pollout = 0;
+  c->starved = 0;
+  c->tx.fd = -1;
+  c->closing = 0;
+  c->next_closing = NULL;
+  c->latency = NULL;
+  c->session = NULL;
+}
+
+static void print_queue_stats(struct connection* c)
+{
+  if(!c->queue.stats.queued)
+  {
+    return;
+  }
+
+  trace_printf("queue to %s %s (psm: 0x%04x): %llu queued, max depth: %u, %llu overflows\n", role_name[c->role],
+      remote_bdaddr(c), c->psm,
+      c->queue.stats.queued, c->queue.stats.max_depth, c->queue.stats.overflows);
+}
+
+static void print_session_stats(struct session* s)
+{
+  struct coalescer* co = s->slave.coalescer;
+
+  print_queue_stats(&s->slave);
+  print_queue_stats(&s->master);
+
+  if(s->filtered)
+  {
+    trace_printf("%llu packets not relayed for %s (psm: 0x%04x)\n", s->filtered, s->bdaddr, s->slave.psm);
+  }
+
+  if(co && co->stats.received)
+  {
+    trace_printf("HID reports from %s (psm: 0x%04x): %llu received, %llu forwarded, %llu coalesced\n",
+        s->bdaddr, s->slave.psm, co->stats.received, co->stats.forwarded, co->stats.coalesced);
+  }
+}
+
+/*
+ * Drop a reference to a session. This can be called by any thread.
+ */
+static void put_session(struct session* s)
+{
+  if(__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL))
+  {
+    return;
+  }
+
+  print_session_stats(s);
+
+  free(s->slave.coalescer);
+  free(s->sdp);
+  free(s);
+}
+
+/*
+ * Get the time a device connected its first leg: the sessions of a device share it, as long as one of their legs is open.
+ */
+static unsigned long long device_setup(const char* bdaddr)
+{
+  struct session* s;
+  unsigned int i;
+
+  for(i=0; i<sessions.capacity; ++i)
+  {
+    if((s = hash_at(&sessions, i)) && !strcmp(s->bdaddr, bdaddr)
+        && (s->slave.state != STATE_CLOSED || s->master.state != STATE_CLOSED))
+    {
+      return s->setup;
+    }
+  }
+  return get_realtime();
+}
+
+static uint64_t session_key(const bdaddr_t* bdaddr, unsigned short psm)
+{
+  uint64_t key = 0;
+
+  memcpy(&key, bdaddr, sizeof(*bdaddr));
+
+  return key << 16 | psm;
+}
+
+/*
+ * Get the session of a slave device for a PSM, or create it.
+ */
+static struct session* get_session(const bdaddr_t* bdaddr, int index)
+{
+  const struct psm_config* config = psms.entries + index;
+  uint64_t key = session_key(bdaddr, config->psm);
+  struct session* s;
+
+  if((s = hash_get(&sessions, key)))
+  {
+    return s;
+  }
+
+  if(!(s = calloc(1, sizeof(*s))))
+  {
+    trace_printf("calloc: %s\n", strerror(errno));
+    return NULL;
+  }
+
+  init_connection(&s->slave, ROLE_SLAVE, config->psm, &s->master);
+  init_connection(&s->master, ROLE_MASTER, config->psm, &s->slave);
+
+  s->slave.session = s;
+  s->master.session = s;
+  s->slave.overflow = config->overflow;
+  s->master.overflow = config->overflow;
+  s->slave.latency = latencies[index][DIR_MASTER_TO_SLAVE];
+  s->master.latency = latencies[index][DIR_SLAVE_TO_MASTER];
+
+  s->config = config;
+  s->key = key;
+  s->refs = 1;
+  wheel_timer_init(&s->park, on_park_timer);
+  wheel_timer_init(&s->idle, on_idle_timer);
+  ba2str(bdaddr, s->bdaddr);
+  s->setup = device_setup(s->bdaddr);
+
+  if(config->coalesce)
+  {
+    if(!(s->slave.coalescer = malloc(sizeof(*s->slave.coalescer))))
+    {
+      trace_printf("malloc: %s\n", strerror(errno));
+      free(s);
+      return NULL;
+    }
+    coalesce_init(s->slave.coalescer, hid_rate);
+  }
+
+  if(config->psm == PSM_SDP && sdp_caching)
+  {
+    if(!(s->sdp = calloc(1, sizeof(*s->sdp))))
+    {
+      trace_printf("calloc: %s\n", strerror(errno));
+      free(s->slave.coalescer);
+      free(s);
+      return NULL;
+    }
+  }
+
+  if(hash_put(&sessions, key, s) < 0)
+  {
+    free(s->slave.coalescer);
+    free(s->sdp);
+    free(s);
+    return NULL;
+  }
+
+  trace_printf("new session with %s (psm: 0x%04x), %u sessions\n", s->bdaddr, s->slave.psm, sessions.count);
+
+  return s;
+}
+
+/*
+ * Remove a session whose legs are both closed.
+ */
+static void release_session(struct session* s)
+{
+  if(s->released || s->slave.state != STATE_CLOSED || s->master.state != STATE_CLOSED)
+  {
+    return;
+  }
+
+  hash_del(&sessions, s->key);
+
+  wheel_del(&wheel, &s->park);
+  wheel_del(&wheel, &s->idle);
+
+  s->released = 1;
+  s->next_released = released;
+  released = s;
+}
+
+/*
+ * Drop the references of the sessions removed while processing the last batch of events.
+ */
+static void flush_released()
+{
+  struct session* s;
+
+  while((s = released))
+  {
+    released = s->next_released;
+    put_session(s);
+  }
+}
+
+/*
+ * Check if there is any other open leg to the remote device of a leg, through the same adapter.
+ * The legs of the other loops are counted too, as they may share the ACL link.
+ */
+static int has_legs(struct connection* c)
+{
+  struct connection* leg;
+  struct session* s;
+  unsigned int i;
+
+  if(c->adapter >= 0)
+  {
+    return adapter_has_legs(c->adapter, c->role == ROLE_MASTER ? NULL : c->session->bdaddr, c->role == ROLE_MASTER);
+  }
+
+  for(i=0; i<sessions.capacity; ++i)
+  {
+    if(!(s = hash_at(&sessions, i)))
+    {
+      continue;
+    }
+    leg = (c->role == ROLE_SLAVE) ? &s->slave : &s->master;
+    if(leg != c && leg->state != STATE_CLOSED && leg->adapter == c->adapter
+        && !strcmp(remote_bdaddr(leg), remote_bdaddr(c)))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void close_connection(struct connection* c)
+{
+  if(c->fd >= 0)
+  {
+    if(pipelined && c->state == STATE_CONNECTED && c->role != ROLE_LISTEN)
+    {
+      if(epoll_ctl(efd, EPOLL_CTL_DEL, c->fd, NULL) < 0)
+      {
+        trace_printf("epoll_ctl EPOLL_CTL_DEL: %s\n", strerror(errno));
+      }
+      pipe_close(c);
+    }
+    else
+    {
+      /*
+       * Closing the last reference also removes the fd from the epoll set.
+       */
+      close(c->fd);
+    }
+    c->fd = -1;
+  }
+  wheel_del(&wheel, &c->pace);
+  wheel_del(&wheel, &c->connect);
+  c->attempts = 0;
+  if(c->coalescer)
+  {
+    coalesce_reset(c->coalescer);
+  }
+  if(!pipelined)
+  {
+    METRIC(c, queued, -(long long)c->queue.count);
+    queue_clear(&c->queue);
+  }
+  c->pollout = 0;
+  c->starved = 0;
+  if(c->state != STATE_CLOSED)
+  {
+    c->state = STATE_CLOSED;
+    adapter_link(c->adapter, c->session ? c->session->bdaddr : NULL, c->role == ROLE_MASTER, -1);
+    if(c->session)
+    {
+      PSM_METRIC(c->session->config - psms.entries, legs, -1);
+    }
+    if(c->role != ROLE_LISTEN && is_bluetooth() && !has_legs(c))
+    {
+      if(pipelined)
+      {
+        pipe_drop(c);
+      }
+      else
+      {
+        acl_drop(adapter_dev_id(c->adapter), remote_bdaddr(c));
+      }
+    }
+  }
+  if(c->session)
+  {
+    release_session(c->session);
+  }
+}
+
+static void close_channel(struct connection* c)
+{
+  close_connection(c);
+  close_connection(c->peer);
+}
+
+/*
+ * Ask the kernel to timestamp the received packets.
+ */
+static void enable_timestamps(int fd)
+{
+  int on = 1;
+
+  if(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+  {
+    trace_printf("setsockopt SO_TIMESTAMPNS: %s\n", strerror(errno));
+  }
+}
+
+static unsigned long long get_time()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void arm_timer(unsigned long long deadline)
+{
+  struct itimerspec its = { .it_value = { deadline / 1000000000ULL, deadline % 1000000000ULL } };
+
+  if(timer_deadline && timer_deadline <= deadline)
+  {
+    return;
+  }
+
+  if(timerfd_settime(timer.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+  {
+    trace_printf("timerfd_settime: %s\n", strerror(errno));
+    return;
+  }
+
+  timer_deadline = deadline;
+}
+
+/*
+ * Start a timer of the loop, or move it to another deadline.
+ */
+static void start_timer(struct wheel_timer* t, unsigned long long deadline)
+{
+  wheel_add(&wheel, t, deadline);
+  arm_timer(deadline);
+}
+
+/*
+ * Get the adapter of the open legs of a device with a role, -1 if there is none.
+ * The legs of all the loops are considered: the main thread asks it for the SCO links.
+ */
+static int device_adapter(const char* bdaddr, e_role role)
+{
+  return adapter_of_device(bdaddr, role == ROLE_MASTER);
+}
+
+/*
+ * Choose the adapter to connect a leg with.
+ * The legs of a device with the same role share their adapter, as they share an ACL link.
+ * Otherwise, the adapter with the fewest legs is chosen, other than the one of the legs with the other role.
+ * The slave legs connected for the master prefer the adapter the device last connected to.
+ */
+static int pick_adapter(struct connection* c)
+{
+  const char* bdaddr = c->session->bdaddr;
+  int exclude;
+  int i;
+
+  if(!spreading)
+  {
+    return local_adapter;
+  }
+
+  if((i = device_adapter(bdaddr, c->role)) >= 0)
+  {
+    return i;
+  }
+
+  exclude = device_adapter(bdaddr, c->role == ROLE_SLAVE ? ROLE_MASTER : ROLE_SLAVE);
+
+  if(c->role == ROLE_SLAVE && slave_adapter >= 0 && slave_adapter != exclude && !strcmp(bdaddr, slave))
+  {
+    return slave_adapter;
+  }
+
+  return adapter_pick(exclude);
+}
+
+/*
+ * Start a non-blocking connection for a leg.
+ * If the other leg is connected, the MTUs are mirrored from it:
+ * the packets received on a leg then fit the other leg, and don't need the ACL bypass.
+ */
+static int connect_leg(struct connection* c)
+{
+  struct connection* peer = c->peer;
+  unsigned short imtu = c->session->config->mtu;
+  unsigned short omtu = c->session->config->mtu;
+  const char* src;
+
+  if(peer->state == STATE_CONNECTED && peer->omtu)
+  {
+    imtu = peer->omtu;
+    omtu = peer->imtu;
+  }
+
+  /*
+   * The packets received on the leg have to fit the packet buffers.
+   */
+  if(imtu > buf_size)
+  {
+    imtu = buf_size;
+  }
+
+  c->adapter = pick_adapter(c);
+  src = spreading ? adapter_bdaddr(c->adapter) : local;
+
+  trace_printf("connecting with %s to %s (psm: 0x%04x)\n", src, remote_bdaddr(c), c->psm);
+
+  c->fd = transport->connect(src, remote_bdaddr(c), c->psm, imtu, omtu);
+
+  if(c->fd < 0)
+  {
+    trace_printf("can't start connection to %s (psm: 0x%04x)\n", role_name[c->role], c->psm);
+    return -1;
+  }
+
+  c->state = STATE_CONNECTING;
+  adapter_link(c->adapter, c->session->bdaddr, c->role == ROLE_MASTER, 1);
+  PSM_METRIC(c->session->config - psms.entries, legs, 1);
+
+  if(ev_register(c, EPOLLOUT) < 0)
+  {
+    close_connection(c);
+    return -1;
+  }
+
+  start_timer(&c->connect, get_time() + CONNECT_TIMEOUT);
+
+  return 0;
+}
+
+/*
+ * Close a leg that failed to connect, and connect it again later, as long as the other leg is connected.
+ * After the last attempt, or if the other leg isn't connected, close both legs.
+ */
+static void retry_leg(struct connection* c)
+{
+  unsigned int attempts = c->attempts + 1;
+  unsigned long long delay;
+
+  if(attempts > CONNECT_RETRIES || c->peer->state != STATE_CONNECTED)
+  {
+    trace_printf("can't connect to %s (psm: 0x%04x)\n", remote_bdaddr(c), c->psm);
+    close_channel(c);
+    return;
+  }
+
+  delay = CONNECT_BACKOFF << (attempts - 1);
+
+  trace_printf("connecting again to %s (psm: 0x%04x) in %llu ms\n", remote_bdaddr(c), c->psm, delay / 1000000);
+
+  close_connection(c);
+
+  c->attempts = attempts;
+  start_timer(&c->connect, get_time() + delay);
+}
+
+/*
+ * A connection timed out, or is to be tried again.
+ */
+static void on_connect_timer(struct wheel_timer* t, unsigned long long now)
+{
+  struct connection* c = (struct connection*)((char*)t - offsetof(struct connection, connect));
+  unsigned int attempts = c->attempts;
+
+  if(c->state == STATE_CONNECTING)
+  {
+    trace_printf("connection to %s timed out (psm: 0x%04x)\n", remote_bdaddr(c), c->psm);
+    retry_leg(c);
+  }
+  else if(c->state == STATE_CLOSED && c->peer->state == STATE_CONNECTED)
+  {
+    if(connect_leg(c) < 0)
+    {
+      c->attempts = attempts;
+      retry_leg(c);
+    }
+  }
+}
+
+/*
+ * Connect to the master on the pre-connected PSMs of a device, without waiting for the device to connect them.
+ * The master legs are parked until the device connects the same PSMs, their input isn't polled meanwhile.
+ */
+static void preconnect(const bdaddr_t* bdaddr, int index)
+{
+  struct session* s;
+  int i;
+
+  for(i=0; i<psms.count; ++i)
+  {
+    if(i == index || !psms.entries[i].preconnect || !(s = get_session(bdaddr, i)))
+    {
+      continue;
+    }
+
+    if(s->slave.state != STATE_CLOSED || s->master.state != STATE_CLOSED)
+    {
+      continue;
+    }
+
+    if(connect_leg(&s->master) < 0)
+    {
+      close_connection(&s->master);
+      continue;
+    }
+
+    start_timer(&s->park, get_time() + PRECONNECT_TIMEOUT);
+
+    ++preconnects.started;
+  }
+}
+
+/*
+ * Close a parked master leg that wasn't claimed in time.
+ */
+static void on_park_timer(struct wheel_timer* t, unsigned long long now)
+{
+  struct session* s = (struct session*)((char*)t - offsetof(struct session, park));
+
+  trace_printf("closing unclaimed connection to %s (psm: 0x%04x)\n", master, s->master.psm);
+  ++preconnects.expired;
+  close_connection(&s->master);
+}
+
+/*
+ * Close a session that didn't relay any packet for the idle timeout.
+ */
+static void on_idle_timer(struct wheel_timer* t, unsigned long long now)
+{
+  struct session* s = (struct session*)((char*)t - offsetof(struct session, idle));
+
+  if(now - s->active < idle_timeout)
+  {
+    start_timer(&s->idle, s->active + idle_timeout);
+    return;
+  }
+
+  trace_printf("closing idle session with %s (psm: 0x%04x)\n", s->bdaddr, s->slave.psm);
+  close_channel(&s->slave);
+}
+
+/*
+ * Apply the priority of the PSM to the outgoing packets of a leg.
+ */
+static void set_priority(struct connection* c)
+{
+  int priority = c->session->config->priority;
+
+  if(priority >= 0 && setsockopt(c->fd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority)) < 0)
+  {
+    trace_printf("setsockopt SO_PRIORITY: %s\n", strerror(errno));
+  }
+}
+
+/*
+ * Get the MTUs a leg negotiated.
+ */
+static void get_mtu(struct connection* c)
+{
+  transport->get_mtu(c->fd, &c->imtu, &c->omtu);
+
+  if(c->omtu)
+  {
+    trace_printf("mtu with %s %s (psm: 0x%04x): in %u, out %u\n", role_name[c->role], remote_bdaddr(c), c->psm,
+        c->imtu, c->omtu);
+  }
+}
+
+/*
+ * Add an accepted leg to its session, and connect the other leg.
+ */
+static void add_leg(int index, const bdaddr_t* bdaddr_a, const bdaddr_t* bdaddr_s, int fd_a, unsigned short cid_a,
+    int adapter)
+{
+  struct connection* c;
+  struct connection* peer;
+  struct session* s;
+
+  if(!(s = get_session(bdaddr_s, index)))
+  {
+    close(fd_a);
+    PSM_METRIC(index, rejects, 1);
+    return;
+  }
+
+  c = bacmp(bdaddr_a, &bdaddr_m) ? &s->slave : &s->master;
+
+  if(c->state != STATE_CLOSED)
+  {
+    close(fd_a);
+    trace_printf("%s %s already connected (psm: 0x%04x)\n", role_name[c->role], remote_bdaddr(c), c->psm);
+    PSM_METRIC(index, rejects, 1);
+    return;
+  }
+
+  c->fd = fd_a;
+  c->cid = cid_a;
+  c->state = STATE_CONNECTED;
+
+  c->adapter = adapter;
+  adapter_link(c->adapter, c->session->bdaddr, c->role == ROLE_MASTER, 1);
+  PSM_METRIC(index, legs, 1);
+  PSM_METRIC(index, connects, 1);
+
+  /*
+   * In sharded mode, this is the last slave device of the loop.
+   */
+  if(c->role == ROLE_SLAVE)
+  {
+    ba2str(bdaddr_s, slave);
+    slave_adapter = c->adapter;
+  }
+
+  get_mtu(c);
+
+  enable_timestamps(c->fd);
+  set_priority(c);
+
+  /*
+   * Don't poll for input until the other leg is connected.
+   */
+  if(ev_register(c, 0) < 0)
+  {
+    close_connection(c);
+    return;
+  }
+
+  peer = c->peer;
+
+  if(wheel_pending(&s->park) && c->role == ROLE_SLAVE)
+  {
+    /*
+     * The master leg was connected speculatively.
+     */
+    wheel_del(&wheel, &s->park);
+    ++preconnects.claimed;
+  }
+
+  if(idle_timeout && !wheel_pending(&s->idle))
+  {
+    s->active = get_time();
+    start_timer(&s->idle, s->active + idle_timeout);
+  }
+
+  if(peer->state == STATE_CLOSED)
+  {
+    if(connect_leg(peer) < 0)
+    {
+      retry_leg(peer);
+      return;
+    }
+  }
+  else if(peer->state == STATE_CONNECTED)
+  {
+    update_events(c);
+    update_events(peer);
+  }
+
+  if(c->role == ROLE_SLAVE)
+  {
+    preconnect(bdaddr_s, index);
+  }
+}
+
+/*
+ * Sharded mode: hand an accepted leg over to a loop.
+ */
+static void shard_post(struct shard* sh, int index, const bdaddr_t* bdaddr_a, const bdaddr_t* bdaddr_s, int fd_a,
+    unsigned short cid_a, int adapter)
+{
+  struct shard_msg* msg = ring_reserve(&sh->ring);
+  uint64_t one = 1;
+
+  if(!msg)
+  {
+    close(fd_a);
+    trace_printf("loop %u can't take more legs (psm: 0x%04x)\n", (unsigned int)(sh - shards), psms.entries[index].psm);
+    return;
+  }
+
+  msg->fd = fd_a;
+  msg->index = index;
+  bacpy(&msg->bdaddr_a, bdaddr_a);
+  bacpy(&msg->bdaddr_s, bdaddr_s);
+  msg->cid = cid_a;
+  msg->adapter = adapter;
+
+  ring_commit(&sh->ring);
+
+  if(write(sh->mailbox.fd, &one, sizeof(one)) < 0)
+  {
+    trace_printf("write eventfd: %s\n", strerror(errno));
+  }
+}
+
+/*
+ * Sharded mode: add the legs handed over by the main thread.
+ */
+static void on_mailbox(struct connection* c)
+{
+  struct shard_msg* msg;
+  uint64_t value;
+
+  if(read(c->fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+  {
+    trace_printf("read eventfd: %s\n", strerror(errno));
+  }
+
+  while((msg = ring_peek(&self->ring)))
+  {
+    add_leg(msg->index, &msg->bdaddr_a, &msg->bdaddr_s, msg->fd, msg->cid, msg->adapter);
+    ring_release(&self->ring);
+  }
+}
+
+static void on_accept(struct connection* l)
+{
+  struct channel* ch = (struct channel*)((char*)l - offsetof(struct channel, listen));
+  bdaddr_t bdaddr_a;
+  bdaddr_t bdaddr_s;
+  bdaddr_t bdaddr_l;
+  unsigned short psm_a;
+  unsigned short cid_a;
+  unsigned int shard;
+  int adapter;
+  int fd_a;
+
+  fd_a = transport->accept(l->fd, &bdaddr_a, &psm_a, &cid_a);
+
+  if(fd_a < 0)
+  {
+    trace_printf("accept error (psm: 0x%04x)\n", l->psm);
+    return;
+  }
+
+  adapter = (transport->get_src(fd_a, &bdaddr_l) < 0) ? -1 : adapter_find(&bdaddr_l);
+
+  if(bacmp(&bdaddr_a, &bdaddr_m))
+  {
+    ba2str(&bdaddr_a, slave);
+    bacpy(&bdaddr_s, &bdaddr_a);
+    /*
+     * The sessions of a device are owned by the loop of the adapter it connected to.
+     */
+    shard = slave_shard = (adapter >= 0) ? adapter % (nb_shards ? nb_shards : 1) : 0;
+  }
+  else if(*slave)
+  {
+    /*
+     * The master connects to the last slave device that connected to the proxy.
+     */
+    str2ba(slave, &bdaddr_s);
+    shard = slave_shard;
+  }
+  else
+  {
+    close(fd_a);
+    trace_printf("no slave device to connect the master to (psm: 0x%04x)\n", l->psm);
+    PSM_METRIC(ch - channels, rejects, 1);
+    return;
+  }
+
+  if(nb_shards)
+  {
+    shard_post(shards + shard, ch - channels, &bdaddr_a, &bdaddr_s, fd_a, cid_a, adapter);
+  }
+  else
+  {
+    add_leg(ch - channels, &bdaddr_a, &bdaddr_s, fd_a, cid_a, adapter);
+  }
+}
+
+static void on_connected(struct connection* c)
+{
+  if(!transport->is_connected(c->fd))
+  {
+    retry_leg(c);
+    return;
+  }
+
+  trace_printf("connected to %s (psm: 0x%04x)\n", remote_bdaddr(c), c->psm);
+
+  wheel_del(&wheel, &c->connect);
+  c->attempts = 0;
+
+  c->state = STATE_CONNECTED;
+  c->cid = transport->get_cid(c->fd);
+  PSM_METRIC(c->session->config - psms.entries, connects, 1);
+
+  get_mtu(c);
+
+  enable_timestamps(c->fd);
+  set_priority(c);
+
+  update_events(c);
+  update_events(c->peer);
+}
+
+/*
+ * Replay mode: use connected sockets as the legs of a session.
+ */
+static int attach_session(int index, int slave_fd, int master_fd)
+{
+  struct session* s = get_session(BDADDR_ANY, index);
+
+  if(!s)
+  {
+    close(slave_fd);
+    close(master_fd);
+    return -1;
+  }
+
+  s->slave.fd = slave_fd;
+  s->master.fd = master_fd;
+  s->slave.state = STATE_CONNECTED;
+  s->master.state = STATE_CONNECTED;
+  PSM_METRIC(index, legs, 2);
+  PSM_METRIC(index, connects, 2);
+
+  enable_timestamps(slave_fd);
+  enable_timestamps(master_fd);
+  set_priority(&s->slave);
+  set_priority(&s->master);
+
+  if(ev_register(&s->slave, 0) < 0 || ev_register(&s->master, 0) < 0)
+  {
+    close_channel(&s->slave);
+    return -1;
+  }
+
+  update_events(&s->slave);
+  update_events(&s->master);
+
+  return 0;
+}
+
+/*
+ * Capture a frame written to a leg, with the decision the proxy made about it.
+ */
+static void capture(struct connection* c, const unsigned char* buf, int len, unsigned long long ts, const char* verdict)
+{
+  if(capturing)
+  {
+    capture_frame(ts, dir_to(c) == DIR_MASTER_TO_SLAVE, c->role == ROLE_MASTER ? CAPTURE_HANDLE_MASTER : CAPTURE_HANDLE_SLAVE,
+        c->cid, buf, len, "%s psm 0x%04x %s %s", c->session->bdaddr, c->psm, dir_name[dir_to(c)], verdict);
+  }
+}
+
+/*
+ * Write a packet to a leg, or queue it if the leg can't take it right now.
+ *
+ * \return 0 if the packet was written or queued, -1 in case of error
+ */
+static int send_packet(struct connection* c, const unsigned char* buf, int len, unsigned long long ts)
+{
+  unsigned char* old;
+  unsigned long long old_ts;
+  int old_len;
+
+  if(pipelined)
+  {
+    if(pipe_push(c, buf, len, ts) < 0)
+    {
+      capture(c, buf, len, ts, "dropped");
+      return -1;
+    }
+    capture(c, buf, len, ts, "forwarded");
+    return 0;
+  }
+
+  if(!c->pollout)
+  {
+    if(transport->send(adapter_dev_id(c->adapter), remote_bdaddr(c), c->cid, c->omtu, c->fd, buf, len) == len)
+    {
+      record_sent(c, len, ts, get_realtime());
+      capture(c, buf, len, ts, "forwarded");
+      return 0;
+    }
+    if(errno != EAGAIN)
+    {
+      METRIC(c, send_errors, 1);
+      capture(c, buf, len, ts, "dropped");
+      return -1;
+    }
+    c->pollout = 1;
+    update_events(c);
+  }
+
+  if(queue_full(&c->queue))
+  {
+    /*
+     * With OVERFLOW_BLOCK, the other leg isn't read while the queue is full,
+     * so this only happens when the queue is fed by a coalescer.
+     */
+    ++c->queue.stats.overflows;
+    if(capturing && queue_peek(&c->queue, &old, &old_len, &old_ts))
+    {
+      capture(c, old, old_len, old_ts, "dropped");
+    }
+    queue_pop(&c->queue);
+    METRIC(c, queued, -1);
+    METRIC(c, drops, 1);
+  }
+
+  if(queue_push(&c->queue, &pool, buf, len, ts) < 0)
+  {
+    METRIC(c, drops, 1);
+    capture(c, buf, len, ts, "dropped");
+    return -1;
+  }
+
+  METRIC(c, queued, 1);
+
+  capture(c, buf, len, ts, "forwarded");
+
+  if(c->overflow == OVERFLOW_BLOCK && queue_full(&c->queue))
+  {
+    ++c->queue.stats.overflows;
+    update_events(c->peer);
+  }
+
+  return 0;
+}
+
+/*
+ * Write the queued packets to a leg that became writable.
+ */
+static void drain_queue(struct connection* c)
+{
+  unsigned char* buf;
+  unsigned long long ts;
+  int len;
+  int was_full = queue_full(&c->queue);
+
+  while(queue_peek(&c->queue, &buf, &len, &ts))
+  {
+    if(transport->send(adapter_dev_id(c->adapter), remote_bdaddr(c), c->cid, c->omtu, c->fd, buf, len) != len)
+    {
+      if(errno == EAGAIN)
+      {
+        break;
+      }
+      trace_printf("write error (%s) (psm: 0x%04x)\n", dir_name[dir_to(c)], c->psm);
+      METRIC(c, send_errors, 1);
+    }
+    else
+    {
+      record_sent(c, len, ts, get_realtime());
+    }
+    queue_pop(&c->queue);
+    METRIC(c, queued, -1);
+  }
+
+  if(queue_empty(&c->queue))
+  {
+    c->pollout = 0;
+  }
+
+  update_events(c);
+
+  if(was_full && !queue_full(&c->queue))
+  {
+    update_events(c->peer);
+  }
+}
+
+/*
+ * Forward the pending reports of a coalescer, if its period has elapsed.
+ * If the outbound socket is full, wait for it to become writable.
+ */
+static void flush_reports(struct connection* c)
+{
+  struct coalescer* co = c->coalescer;
+  struct connection* peer = c->peer;
+  unsigned long long now = get_time();
+  unsigned long long ts;
+  unsigned char* buf;
+  int len;
+
+  /*
+   * Don't let reports wait behind older packets: keep coalescing until the queue is drained.
+   */
+  if(wheel_pending(&c->pace) || peer->pollout)
+  {
+    return;
+  }
+
+  if(now < co->next)
+  {
+    start_timer(&c->pace, co->next);
+    return;
+  }
+
+  while(coalesce_peek(co, &buf, &len, &ts))
+  {
+    if(pipelined)
+    {
+      if(pipe_push(peer, buf, len, ts) < 0)
+      {
+        trace_printf("write error (SLAVE > MASTER) (psm: 0x%04x)\n", c->psm);
+        capture(peer, buf, len, ts, "dropped");
+      }
+      else
+      {
+        capture(peer, buf, len, ts, "forwarded");
+      }
+      coalesce_pop(co, now);
+      continue;
+    }
+    if(transport->send(adapter_dev_id(peer->adapter), remote_bdaddr(peer), peer->cid, peer->omtu, peer->fd, buf,
+        len) < 0)
+    {
+      if(errno == EAGAIN)
+      {
+        peer->pollout = 1;
+        update_events(peer);
+        return;
+      }
+      trace_printf("write error (SLAVE > MASTER) (psm: 0x%04x)\n", c->psm);
+      METRIC(peer, send_errors, 1);
+      capture(peer, buf, len, ts, "dropped");
+    }
+    else
+    {
+      record_sent(peer, len, ts, get_realtime());
+      capture(peer, buf, len, ts, "forwarded");
+    }
+    coalesce_pop(co, now);
+  }
+}
+
+/*
+ * The coalescer of a leg is allowed to forward again.
+ */
+static void on_pace_timer(struct wheel_timer* t, unsigned long long now)
+{
+  struct connection* c = (struct connection*)((char*)t - offsetof(struct connection, pace));
+
+  if(c->state == STATE_CONNECTED && c->peer->state == STATE_CONNECTED)
+  {
+    flush_reports(c);
+  }
+}
+
+static void on_timer()
+{
+  unsigned long long expirations;
+  unsigned long long next;
+
+  if(read(timer.fd, &expirations, sizeof(expirations)) < 0 && errno == EAGAIN)
+  {
+    return;
+  }
+
+  /*
+   * The expired timers may arm it again.
+   */
+  timer_deadline = 0;
+
+  wheel_expire(&wheel, get_time());
+
+  if((next = wheel_next(&wheel)))
+  {
+    arm_timer(next);
+  }
+}
+
+/*
+ * Check if the requests of a leg may be answered from a cache (SDP responses or HID feature reports).
+ */
+static int is_cached(struct connection* c)
+{
+  return c->session->sdp || (c->psm == PSM_HID_Control && feature_cache_enabled());
+}
+
+/*
+ * Get the cached answer to a request from a leg.
+ *
+ * \return the length of the answer, -1 if the request has to be relayed
+ */
+static int answer(struct connection* c, const unsigned char* req, int len, unsigned char* rsp, int size)
+{
+  if(c->session->sdp)
+  {
+    return sdp_cache_answer(remote_bdaddr(c->peer), req, len, rsp, size);
+  }
+  if(c->role == ROLE_MASTER)
+  {
+    return feature_cache_answer(c->session->bdaddr, req, len, rsp, size);
+  }
+  return -1;
+}
+
+/*
+ * Learn the answers relayed from a leg.
+ */
+static void track(struct connection* c, const unsigned char* buf, int len)
+{
+  if(c->session->sdp)
+  {
+    sdp_track(c->session->sdp, c->role == ROLE_MASTER, remote_bdaddr(c), buf, len);
+  }
+  else
+  {
+    feature_track(&c->session->feature, c->role == ROLE_MASTER, c->session->bdaddr, buf, len);
+  }
+}
+
+/*
+ * Forward the first n packets of a cached channel to the other leg.
+ * The requests whose answer is cached are answered right away.
+ */
+static void forward_cached(struct connection* c, unsigned int n)
+{
+  struct connection* peer = c->peer;
+  unsigned char rsp[RELAY_BUF_SIZE];
+  unsigned int i;
+  int len;
+
+  for(i=0; i<n; ++i)
+  {
+    len = answer(c, batch.bufs[i], batch.msgs[i].msg_len, rsp, sizeof(rsp));
+    if(len <= 0)
+    {
+      track(c, batch.bufs[i], batch.msgs[i].msg_len);
+    }
+    if(len > 0)
+    {
+      capture(peer, batch.bufs[i], batch.msgs[i].msg_len, batch.ts[i], "answered from cache");
+      if(send_packet(c, rsp, len, batch.ts[i]) < 0)
+      {
+        trace_printf("write error (%s) (psm: 0x%04x)\n", role_name[c->role], c->psm);
+      }
+      continue;
+    }
+    if(send_packet(peer, batch.bufs[i], batch.msgs[i].msg_len, batch.ts[i]) < 0)
+    {
+      trace_printf("write error (%s) (psm: 0x%04x)\n", role_name[peer->role], c->psm);
+    }
+  }
+}
+
+/*
+ * Forward the first n packets of the batch to the other leg.
+ */
+static void forward(struct connection* c, unsigned int n)
+{
+  struct connection* peer = c->peer;
+  const char* dir = (c->role == ROLE_SLAVE) ? "SLAVE > MASTER" : "MASTER > SLAVE";
+  unsigned long long now;
+  unsigned long long old_ts;
+  unsigned char* old;
+  unsigned int i = 0;
+  int old_len;
+  int ret;
+
+  if(debug)
+  {
+    for(i=0; i<n; ++i)
+    {
+      trace_packet(dir, c->psm, batch.bufs[i], batch.msgs[i].msg_len);
+    }
+    i = 0;
+  }
+
+  /*
+   * The packets of a direction that isn't relayed are dropped.
+   */
+  if(!(c->session->config->relay & (c->role == ROLE_SLAVE ? RELAY_TO_MASTER : RELAY_TO_SLAVE)))
+  {
+    for(i=0; i<n; ++i)
+    {
+      capture(peer, batch.bufs[i], batch.msgs[i].msg_len, batch.ts[i], "filtered");
+    }
+    c->session->filtered += n;
+    METRIC(peer, drops, n);
+    return;
+  }
+
+  if(c->coalescer)
+  {
+    for(i=0; i<n; ++i)
+    {
+      if(!c->session->reported && batch.msgs[i].msg_len && batch.bufs[i][0] == HIDP_DATA_INPUT)
+      {
+        c->session->reported = 1;
+        trace_printf("first input report from %s, %llu ms after its first connection\n", c->session->bdaddr,
+            (get_realtime() - c->session->setup) / 1000000);
+      }
+      if(capturing && coalesce_superseded(c->coalescer, batch.bufs[i], batch.msgs[i].msg_len, &old, &old_len, &old_ts))
+      {
+        capture(peer, old, old_len, old_ts, "coalesced");
+      }
+      if(coalesce_push(c->coalescer, batch.bufs[i], batch.msgs[i].msg_len, batch.ts[i]) < 0
+          && send_packet(peer, batch.bufs[i], batch.msgs[i].msg_len, batch.ts[i]) < 0)
+      {
+        trace_printf("write error (%s) (psm: 0x%04x)\n", dir, c->psm);
+      }
+    }
+    flush_reports(c);
+    return;
+  }
+
+  if(is_cached(c))
+  {
+    forward_cached(c, n);
+    return;
+  }
+
+  if(!peer->pollout && !pipelined)
+  {
+    /*
+     * The control messages hold the reception timestamps, they are not sent.
+     */
+    for(i=0; i<n; ++i)
+    {
+      batch.iovs[i].iov_len = batch.msgs[i].msg_len;
+      batch.msgs[i].msg_hdr.msg_controllen = 0;
+    }
+    ret = transport->send_batch(adapter_dev_id(peer->adapter), remote_bdaddr(peer), peer->cid, peer->omtu, peer->fd,
+        batch.msgs, n);
+    for(i=0; i<n; ++i)
+    {
+      batch.iovs[i].iov_len = pool.size;
+    }
+    i = (ret < 0) ? 0 : ret;
+    now = get_realtime();
+    for(ret=0; ret<i; ++ret)
+    {
+      record_sent(peer, batch.msgs[ret].msg_len, batch.ts[ret], now);
+      capture(peer, batch.bufs[ret], batch.msgs[ret].msg_len, batch.ts[ret], "forwarded");
+    }
+  }
+
+  /*
+   * The packets that couldn't be sent at once are queued.
+   */
+  for(; i<n; ++i)
+  {
+    if(send_packet(peer, batch.bufs[i], batch.msgs[i].msg_len, batch.ts[i]) < 0)
+    {
+      trace_printf("write error (%s) (psm: 0x%04x)\n", dir, c->psm);
+    }
+  }
+}
+
+/*
+ * Get the reception times of the first n packets of the batch.
+ * The kernel timestamps are used if available, the current time otherwise.
+ */
+static void get_timestamps(unsigned int n)
+{
+  struct cmsghdr* cmsg;
+  struct timespec* ts;
+  unsigned long long now = 0;
+  unsigned int i;
+
+  for(i=0; i<n; ++i)
+  {
+    batch.ts[i] = 0;
+    for(cmsg = CMSG_FIRSTHDR(&batch.msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&batch.msgs[i].msg_hdr, cmsg))
+    {
+      if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+      {
+        ts = (struct timespec*) CMSG_DATA(cmsg);
+        batch.ts[i] = ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+        break;
+      }
+    }
+    if(!batch.ts[i])
+    {
+      if(!now)
+      {
+        now = get_realtime();
+      }
+      batch.ts[i] = now;
+    }
+  }
+}
+
+/*
+ * Record how long the first n packets of the batch waited to be read.
+ */
+static void record_service(struct connection* c, unsigned int n)
+{
+  struct histogram* h = sched.service[c->session->config->class];
+  unsigned long long now = get_realtime();
+  unsigned int i;
+
+  for(i=0; i<n; ++i)
+  {
+    histogram_record(h, now > batch.ts[i] ? now - batch.ts[i] : 0);
+  }
+}
+
+/*
+ * Drop the packets that didn't fit their buffer, and move the next ones down.
+ *
+ * \return the number of packets left
+ */
+static unsigned int drop_truncated(struct connection* c, unsigned int n)
+{
+  unsigned char* buf;
+  unsigned int i, j = 0;
+
+  for(i=0; i<n; ++i)
+  {
+    if(batch.msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+    {
+      trace_printf("truncated packet from %s (psm: 0x%04x)\n", role_name[c->role], c->psm);
+      METRIC(c->peer, drops, 1);
+      continue;
+    }
+    if(i != j)
+    {
+      buf = batch.bufs[j];
+      batch.bufs[j] = batch.bufs[i];
+      batch.bufs[i] = buf;
+      batch.iovs[j].iov_base = batch.bufs[j];
+      batch.iovs[i].iov_base = batch.bufs[i];
+      batch.msgs[j].msg_len = batch.msgs[i].msg_len;
+      batch.ts[j] = batch.ts[i];
+    }
+    ++j;
+  }
+
+  return j;
+}
+
+/*
+ * Read the pending packets of a leg, and forward them to the other leg.
+ * At most RELAY_BATCH packets are read, so that a busy leg can't starve the others.
+ */
+static void relay(struct connection* c)
+{
+  struct connection* peer = c->peer;
+  unsigned int max = RELAY_BATCH;
+  unsigned char* buf;
+  int i, j, n;
+
+  /*
+   * A previous event of the same batch may have filled the queue of the other leg.
+   */
+  if(!(c->events & EPOLLIN))
+  {
+    return;
+  }
+
+  /*
+   * Don't read more than the queue of the other leg can take.
+   */
+  if(!pipelined && peer->overflow == OVERFLOW_BLOCK && QUEUE_SIZE - peer->queue.count < max)
+  {
+    max = QUEUE_SIZE - peer->queue.count;
+  }
+
+  /*
+   * Replace the buffers that are still queued.
+   * If the pool is exhausted, read fewer packets, until the queues drain.
+   * If there is no buffer at all, the leg isn't polled for input until buffers are returned.
+   */
+  for(i=0; i<max; ++i)
+  {
+    if(pool_refs(batch.bufs[i]) > 1)
+    {
+      if(!(buf = pool_get(&pool)))
+      {
+        if(!i)
+        {
+          c->starved = 1;
+          starving = 1;
+          update_events(c);
+          return;
+        }
+        max = i;
+        break;
+      }
+      pool_put(batch.bufs[i]);
+      batch.bufs[i] = buf;
+      batch.iovs[i].iov_base = buf;
+    }
+    batch.msgs[i].msg_hdr.msg_controllen = sizeof(*batch.ctrl);
+  }
+
+  if(!max)
+  {
+    return;
+  }
+
+  n = transport->recv_batch(c->fd, batch.msgs, max);
+
+  if(n < 0)
+  {
+    if(errno == EAGAIN)
+    {
+      return;
+    }
+    if(errno == EINTR)
+    {
+      trace_printf("read interrupted (%s) (psm: 0x%04x)\n", role_name[c->role], c->psm);
+      return;
+    }
+    trace_printf("recv error from %s (psm: 0x%04x)\n", role_name[c->role], c->psm);
+    close_channel(c);
+    return;
+  }
+
+  for(i=0; i<n; ++i)
+  {
+    if(!batch.msgs[i].msg_len)
+    {
+      break;
+    }
+  }
+
+  get_timestamps(i);
+
+  record_service(c, i);
+
+  for(j=0; j<i; ++j)
+  {
+    adapter_received(c->adapter, batch.msgs[j].msg_len);
+  }
+
+  ++batch.stats.reads;
+  batch.stats.packets += i;
+
+  if(idle_timeout && i)
+  {
+    c->session->active = get_time();
+  }
+
+  forward(c, drop_truncated(c, i));
+
+  /*
+   * A 0-length packet means the connection was closed.
+   */
+  if(i < n)
+  {
+    trace_printf("connection closed by %s (psm: 0x%04x)\n", role_name[c->role], c->psm);
+    close_channel(c);
+  }
+}
+
+/*
+ * Writer thread: close the socket of a leg closed by the reader thread.
+ * This is done once its queue is drained, or when the leg is reconnected or the thread stops:
+ * the packets left are then dropped.
+ */
+static void pipe_finish(struct pipe* p, struct connection* c)
+{
+  struct connection** prev;
+
+  METRIC(c, queued, -(long long)c->queue.count);
+  METRIC(c, drops, c->queue.count);
+  queue_clear(&c->queue);
+
+  /*
+   * Closing the last reference also removes the fd from the epoll set.
+   */
+  close(c->tx.fd);
+  c->tx.fd = -1;
+
+  for(prev = &p->closing; *prev != c; prev = &(*prev)->next_closing);
+  *prev = c->next_closing;
+  c->closing = 0;
+
+  put_session(c->session);
+}
+
+/*
+ * Writer thread: write the queued packets of a leg that became writable.
+ */
+static void pipe_drain(struct pipe* p, struct connection* c)
+{
+  unsigned char* buf;
+  unsigned long long ts;
+  int len;
+
+  while(queue_peek(&c->queue, &buf, &len, &ts))
+  {
+    if(transport->send(c->tx.dev_id, remote_bdaddr(c), c->tx.cid, c->tx.omtu, c->tx.fd, buf, len) != len)
+    {
+      if(errno == EAGAIN)
+      {
+        return;
+      }
+      trace_printf("write error (%s) (psm: 0x%04x)\n", dir_name[dir_to(c)], c->psm);
+      METRIC(c, send_errors, 1);
+    }
+    else
+    {
+      record_sent(c, len, ts, get_realtime());
+      ++p->stats.packets;
+    }
+    queue_pop(&c->queue);
+    METRIC(c, queued, -1);
+  }
+
+  if(c->closing)
+  {
+    pipe_finish(p, c);
+  }
+  else if(epoll_ctl(p->efd, EPOLL_CTL_DEL, c->tx.fd, NULL) < 0)
+  {
+    trace_printf("epoll_ctl EPOLL_CTL_DEL: %s\n", strerror(errno));
+  }
+}
+
+/*
+ * Writer thread: process a slot of the ring.
+ * A packet that can't be written right away is queued, and the leg is polled for writability.
+ * As the reader thread can't be told to stop reading, a full queue always drops its oldest packet.
+ */
+static void pipe_process(struct pipe* p, struct pipe_slot* slot)
+{
+  struct connection* c = slot->c;
+  struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+
+  if(slot->len == -2)
+  {
+    acl_drop(slot->dest.dev_id, (char*)slot->data);
+    return;
+  }
+
+  if(c->closing)
+  {
+    /*
+     * The leg was reconnected before the queue of its former socket could be drained.
+     */
+    pipe_finish(p, c);
+  }
+
+  if(slot->len < 0)
+  {
+    if(queue_empty(&c->queue))
+    {
+      close(slot->dest.fd);
+      put_session(c->session);
+      return;
+    }
+    /*
+     * The queued packets are written to slot->dest.fd, which is polled for writability.
+     */
+    c->closing = 1;
+    c->next_closing = p->closing;
+    p->closing = c;
+    return;
+  }
+
+  if(queue_empty(&c->queue))
+  {
+    if(transport->send(slot->dest.dev_id, remote_bdaddr(c), slot->dest.cid, slot->dest.omtu, slot->dest.fd, slot->data,
+        slot->len) == slot->len)
+    {
+      record_sent(c, slot->len, slot->ts, get_realtime());
+      ++p->stats.packets;
+      return;
+    }
+    if(errno != EAGAIN)
+    {
+      trace_printf("write error (%s) (psm: 0x%04x)\n", dir_name[dir_to(c)], c->psm);
+      METRIC(c, send_errors, 1);
+      return;
+    }
+    c->tx = slot->dest;
+    if(epoll_ctl(p->efd, EPOLL_CTL_ADD, c->tx.fd, &ev) < 0)
+    {
+      trace_printf("epoll_ctl EPOLL_CTL_ADD: %s\n", strerror(errno));
+    }
+  }
+
+  if(queue_full(&c->queue))
+  {
+    ++c->queue.stats.overflows;
+    queue_pop(&c->queue);
+    METRIC(c, queued, -1);
+    METRIC(c, drops, 1);
+  }
+
+  if(queue_push(&c->queue, &p->pool, slot->data, slot->len, slot->ts) == 0)
+  {
+    METRIC(c, queued, 1);
+  }
+}
+
+static void* pipe_run(void* arg)
+{
+  struct pipe* p = arg;
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &hci };
+  struct epoll_event events[MAX_EVENTS];
+  struct pipe_slot* slot;
+  uint64_t value;
+  uint64_t one = 1;
+  cpu_set_t cpus;
+  int i, nfds;
+
+  if(p->cpu >= 0)
+  {
+    CPU_ZERO(&cpus);
+    CPU_SET(p->cpu, &cpus);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+    {
+      fprintf(stderr, "can't pin %s thread to cpu %d\n", dir_name[p - pipes], p->cpu);
+    }
+  }
+
+  /*
+   * The histograms of the legs are registered by the loop.
+   */
+  metrics = metrics_register(NULL);
+
+  /*
+   * The frames above the MTU of a leg go through the ACL engine of the writer thread.
+   */
+  if(is_bluetooth() && (hci.fd = acl_init()) >= 0 && epoll_ctl(p->efd, EPOLL_CTL_ADD, hci.fd, &ev) < 0)
+  {
+    trace_printf("epoll_ctl EPOLL_CTL_ADD: %s\n", strerror(errno));
+  }
+
+  /*
+   * The reader thread may wait for a free slot until it stops: the thread runs until pipe_stop().
+   */
+  while(!__atomic_load_n(&p->stopping, __ATOMIC_RELAXED))
+  {
+    while((slot = ring_peek(&p->ring)))
+    {
+      pipe_process(p, slot);
+      ring_release(&p->ring);
+    }
+
+    __atomic_store_n(&p->sleeping, 1, __ATOMIC_RELAXED);
+
+    /*
+     * Pairs with the fences in pipe_wake() and pipe_reserve().
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&p->waiting, __ATOMIC_RELAXED) && write(p->space, &one, sizeof(one)) < 0)
+    {
+      trace_printf("write eventfd: %s\n", strerror(errno));
+    }
+
+    if(ring_peek(&p->ring))
+    {
+      __atomic_store_n(&p->sleeping, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    nfds = epoll_wait(p->efd, events, MAX_EVENTS, -1);
+
+    __atomic_store_n(&p->sleeping, 0, __ATOMIC_RELAXED);
+
+    ++p->stats.wakeups;
+
+    for(i=0; i<nfds; ++i)
+    {
+      if(events[i].data.ptr == &hci)
+      {
+        acl_process();
+      }
+      else if(events[i].data.ptr)
+      {
+        pipe_drain(p, events[i].data.ptr);
+      }
+      else if(read(p->evfd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+      {
+        trace_printf("read eventfd: %s\n", strerror(errno));
+      }
+    }
+  }
+
+  while((slot = ring_peek(&p->ring)))
+  {
+    pipe_process(p, slot);
+    ring_release(&p->ring);
+  }
+
+  while(p->closing)
+  {
+    pipe_finish(p, p->closing);
+  }
+
+  if(hci.fd >= 0)
+  {
+    acl_print_stats();
+    acl_cleanup();
+  }
+
+  return NULL;
+}
+
+static int pipe_start()
+{
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  sigset_t mask, old;
+  int i;
+
+  /*
+   * Signals are handled by the main thread only.
+   */
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+  for(i=0; i<DIR_MAX; ++i)
+  {
+    struct pipe* p = pipes + i;
+
+    if(ring_init(&p->ring, PIPE_RING_SIZE, sizeof(struct pipe_slot)) < 0
+        || pool_init(&p->pool, POOL_BUFFERS, buf_size) < 0)
+    {
+      return -1;
+    }
+
+    if((p->efd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+      perror("epoll_create1");
+      return -1;
+    }
+
+    if((p->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+      perror("eventfd");
+      return -1;
+    }
+
+    if(epoll_ctl(p->efd, EPOLL_CTL_ADD, p->evfd, &ev) < 0)
+    {
+      perror("epoll_ctl EPOLL_CTL_ADD");
+      return -1;
+    }
+
+    /*
+     * The reader thread blocks on it.
+     */
+    if((p->space = eventfd(0, EFD_CLOEXEC)) < 0)
+    {
+      perror("eventfd");
+      return -1;
+    }
+
+    if(pthread_create(&p->thread, NULL, pipe_run, p))
+    {
+      fprintf(stderr, "can't create %s thread\n", dir_name[i]);
+      return -1;
+    }
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  return 0;
+}
+
+static void pipe_stop()
+{
+  struct session* s;
+  unsigned int j;
+  uint64_t one = 1;
+  int i;
+
+  for(i=0; i<DIR_MAX; ++i)
+  {
+    __atomic_store_n(&pipes[i].stopping, 1, __ATOMIC_RELAXED);
+    if(write(pipes[i].evfd, &one, sizeof(one)) < 0)
+    {
+      perror("write eventfd");
+    }
+    pthread_join(pipes[i].thread, NULL);
+  }
+
+  /*
+   * The send queues were owned by the writer threads, and hold buffers of their pools.
+   */
+  for(j=0; j<sessions.capacity; ++j)
+  {
+    if((s = hash_at(&sessions, j)))
+    {
+      queue_clear(&s->slave.queue);
+      queue_clear(&s->master.queue);
+    }
+  }
+
+  for(i=0; i<DIR_MAX; ++i)
+  {
+    struct pipe* p = pipes + i;
+
+    printf("pipeline %s: %llu packets, %llu ring overflows, %llu wakeups\n", dir_name[i],
+        p->stats.packets, p->stats.overflows, p->stats.wakeups);
+
+    pool_print_stats(&p->pool, "pool");
+    pool_free(&p->pool);
+    ring_free(&p->ring);
+    close(p->space);
+    close(p->evfd);
+    close(p->efd);
+  }
+}
+
+static struct sco_bridge* sco_bridge_of(struct connection* c)
+{
+  return sco_bridges + ((char*)c - (char*)sco_bridges) / sizeof(*sco_bridges);
+}
+
+static const char* sco_remote_bdaddr(struct connection* c)
+{
+  return c->role == ROLE_SCO_MASTER ? master : sco_bridge_of(c)->bdaddr;
+}
+
+/*
+ * Poll an SCO link for:
+ * - writability while it connects, unless it waits for the other link,
+ * - input while the other link is established.
+ */
+static void sco_update_events(struct connection* c)
+{
+  struct epoll_event ev = { .data.ptr = c };
+
+  if(c->fd < 0)
+  {
+    return;
+  }
+
+  if(c->state == STATE_CONNECTING)
+  {
+    ev.events = (c == sco_bridge_of(c)->pending) ? 0 : EPOLLOUT;
+  }
+  else
+  {
+    ev.events = (c->peer->state == STATE_CONNECTED) ? EPOLLIN : 0;
+  }
+
+  if(ev.events == c->events)
+  {
+    return;
+  }
+
+  if(epoll_ctl(efd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+  {
+    trace_printf("epoll_ctl EPOLL_CTL_MOD: %s\n", strerror(errno));
+  }
+
+  c->events = ev.events;
+}
+
+static void sco_close(struct sco_bridge* b)
+{
+  struct connection* legs[] = { &b->slave, &b->master };
+  struct jitter* j;
+  unsigned int i;
+
+  for(i=0; i<sizeof(legs)/sizeof(*legs); ++i)
+  {
+    if(legs[i]->fd >= 0)
+    {
+      close(legs[i]->fd);
+      legs[i]->fd = -1;
+    }
+    legs[i]->state = STATE_CLOSED;
+    legs[i]->events = 0;
+    wheel_del(&wheel, &legs[i]->connect);
+  }
+
+  b->pending = NULL;
+
+  for(i=0; i<DIR_MAX; ++i)
+  {
+    j = b->jitter + i;
+    if(j->stats.pushed)
+    {
+      trace_printf("sco %s %s: %llu bytes in, %llu bytes out, %llu lost\n", dir_name[i], b->bdaddr,
+          j->stats.pushed, j->stats.played, b->lost[i]);
+      trace_printf("sco %s %s: %llu underruns, %llu overruns, max delay: %u ms\n", dir_name[i], b->bdaddr,
+          j->stats.underruns, j->stats.overruns, j->stats.max / SCO_BYTES_PER_MS);
+    }
+    jitter_reset(j);
+    b->lost[i] = 0;
+  }
+}
+
+static void on_sco_accept(struct connection* l)
+{
+  struct sco_bridge* b = NULL;
+  struct connection* c;
+  bdaddr_t bdaddr_a;
+  char bdaddr_s[sizeof(slave)];
+  const char* src;
+  int fd_a;
+  int i;
+
+  if((fd_a = transport->sco_accept(l->fd, &bdaddr_a)) < 0)
+  {
+    trace_printf("accept error (SCO)\n");
+    return;
+  }
+
+  if(bacmp(&bdaddr_a, &bdaddr_m))
+  {
+    ba2str(&bdaddr_a, bdaddr_s);
+  }
+  else if(*slave)
+  {
+    /*
+     * As for L2CAP, the master is bridged to the last slave device that connected to the proxy.
+     */
+    strcpy(bdaddr_s, slave);
+  }
+  else
+  {
+    close(fd_a);
+    trace_printf("no slave device to connect the master to (SCO)\n");
+    return;
+  }
+
+  for(i=0; i<SCO_BRIDGES; ++i)
+  {
+    if(sco_bridges[i].slave.state == STATE_CLOSED && sco_bridges[i].master.state == STATE_CLOSED)
+    {
+      if(!b)
+      {
+        b = sco_bridges + i;
+      }
+    }
+    else if(!strcmp(sco_bridges[i].bdaddr, bdaddr_s))
+    {
+      close(fd_a);
+      trace_printf("%s already bridged (SCO)\n", bdaddr_s);
+      return;
+    }
+  }
+
+  if(!b)
+  {
+    close(fd_a);
+    trace_printf("no free SCO bridge for %s\n", bdaddr_s);
+    return;
+  }
+
+  strcpy(b->bdaddr, bdaddr_s);
+
+  c = bacmp(&bdaddr_a, &bdaddr_m) ? &b->slave : &b->master;
+
+  c->fd = fd_a;
+  c->state = STATE_CONNECTING;
+  b->pending = c;
+
+  if(ev_register(c, 0) < 0)
+  {
+    sco_close(b);
+    return;
+  }
+
+  /*
+   * An SCO link uses the ACL link of the L2CAP legs.
+   */
+  src = spreading ? adapter_bdaddr(device_adapter(b->bdaddr, c->peer == &b->master ? ROLE_MASTER : ROLE_SLAVE))
+      : local;
+
+  trace_printf("connecting with %s to %s (SCO)\n", src, sco_remote_bdaddr(c->peer));
+
+  if((c->peer->fd = transport->sco_connect(src, sco_remote_bdaddr(c->peer))) < 0)
+  {
+    trace_printf("can't connect to %s (SCO)\n", sco_remote_bdaddr(c->peer));
+    sco_close(b);
+    return;
+  }
+
+  c->peer->state = STATE_CONNECTING;
+
+  if(ev_register(c->peer, EPOLLOUT) < 0)
+  {
+    sco_close(b);
+    return;
+  }
+
+  start_timer(&c->peer->connect, get_time() + CONNECT_TIMEOUT);
+}
+
+/*
+ * An SCO link didn't connect in time: the bridge is torn down, and the accepted link with it.
+ */
+static void on_sco_connect_timer(struct wheel_timer* t, unsigned long long now)
+{
+  struct connection* c = (struct connection*)((char*)t - offsetof(struct connection, connect));
+
+  if(c->state == STATE_CONNECTING)
+  {
+    trace_printf("connection to %s timed out (SCO)\n", sco_remote_bdaddr(c));
+    sco_close(sco_bridge_of(c));
+  }
+}
+
+static void on_sco_connected(struct connection* c)
+{
+  struct sco_bridge* b = sco_bridge_of(c);
+
+  /*
+   * A failed connection stays writable: the bridge is closed, so that the loop doesn't spin on it.
+   */
+  if(!transport->is_connected(c->fd))
+  {
+    trace_printf("can't connect to %s (SCO)\n", sco_remote_bdaddr(c));
+    sco_close(b);
+    return;
+  }
+
+  trace_printf("connected to %s (SCO)\n", sco_remote_bdaddr(c));
+
+  wheel_del(&wheel, &c->connect);
+  c->state = STATE_CONNECTED;
+
+  if(b->pending == c->peer)
+  {
+    b->pending = NULL;
+    if(transport->sco_authorize(c->peer->fd) < 0)
+    {
+      sco_close(b);
+      return;
+    }
+  }
+
+  sco_update_events(c);
+  sco_update_events(c->peer);
+}
+
+/*
+ * Buffer the audio received from a link, and answer each packet with the audio of the other link.
+ */
+static void sco_relay(struct connection* c)
+{
+  struct sco_bridge* b = sco_bridge_of(c);
+  unsigned char buf[SCO_BUF_SIZE];
+  int len;
+  int i;
+
+  for(i=0; i<RELAY_BATCH; ++i)
+  {
+    if((len = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT)) <= 0)
+    {
+      if(len < 0 && errno == EAGAIN)
+      {
+        return;
+      }
+      trace_printf("connection closed by %s (SCO)\n", sco_remote_bdaddr(c));
+      sco_close(b);
+      return;
+    }
+
+    jitter_push(b->jitter + dir_to(c->peer), buf, len);
+
+    jitter_pull(b->jitter + dir_to(c), buf, len);
+
+    if(send(c->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    {
+      if(errno != EAGAIN)
+      {
+        trace_printf("send: %s\n", strerror(errno));
+        sco_close(b);
+        return;
+      }
+      ++b->lost[dir_to(c)];
+    }
+  }
+}
+
+static void sco_process(struct connection* c, uint32_t events)
+{
+  if(events & (EPOLLERR | EPOLLHUP))
+  {
+    if(c->role == ROLE_SCO_LISTEN)
+    {
+      trace_printf("poll error from listening socket (SCO)\n");
+      close(c->fd);
+      c->fd = -1;
+      c->state = STATE_CLOSED;
+    }
+    else
+    {
+      trace_printf("poll error from %s (SCO)\n", role_name[c->role]);
+      sco_close(sco_bridge_of(c));
+    }
+    return;
+  }
+
+  if(c->role == ROLE_SCO_LISTEN)
+  {
+    if(events & EPOLLIN)
+    {
+      on_sco_accept(c);
+    }
+    return;
+  }
+
+  if((events & EPOLLOUT) && c->state == STATE_CONNECTING)
+  {
+    on_sco_connected(c);
+  }
+
+  if((events & EPOLLIN) && c->state == STATE_CONNECTED)
+  {
+    sco_relay(c);
+  }
+}
+
+/*
+ * Preallocate the SCO bridges, and listen for SCO links.
+ */
+static int sco_start()
+{
+  struct sco_bridge* b;
+  unsigned int target = sco_delay * SCO_BYTES_PER_MS;
+  int i, dir;
+
+  for(i=0; i<SCO_BRIDGES; ++i)
+  {
+    b = sco_bridges + i;
+
+    init_connection(&b->slave, ROLE_SCO_SLAVE, 0, &b->master);
+    init_connection(&b->master, ROLE_SCO_MASTER, 0, &b->slave);
+    wheel_timer_init(&b->slave.connect, on_sco_connect_timer);
+    wheel_timer_init(&b->master.connect, on_sco_connect_timer);
+
+    /*
+     * Twice the target delay, so that a faster link doesn't lose audio until it gets that far ahead.
+     */
+    for(dir=0; dir<DIR_MAX; ++dir)
+    {
+      if(jitter_init(b->jitter + dir, 2 * target + SCO_BUF_SIZE, target) < 0)
+      {
+        return -1;
+      }
+    }
+  }
+
+  if((sco_listener.fd = transport->sco_listen(local)) < 0)
+  {
+    return -1;
+  }
+
+  sco_listener.state = STATE_CONNECTED;
+
+  if(ev_register(&sco_listener, EPOLLIN) < 0)
+  {
+    return -1;
+  }
+
+  printf("bridging SCO links, with a target delay of %d ms\n", sco_delay);
+
+  return 0;
+}
+
+static void sco_stop()
+{
+  int i, dir;
+
+  if(sco_delay < 0)
+  {
+    return;
+  }
+
+  for(i=0; i<SCO_BRIDGES; ++i)
+  {
+    sco_close(sco_bridges + i);
+
+    for(dir=0; dir<DIR_MAX; ++dir)
+    {
+      jitter_free(sco_bridges[i].jitter + dir);
+    }
+  }
+
+  if(sco_listener.fd >= 0)
+  {
+    close(sco_listener.fd);
+    sco_listener.fd = -1;
+  }
+}
+
+static void process(struct connection* c, uint32_t events)
+{
+  /*
+   * A previous event of the same batch may have closed this connection.
+   */
+  if(c->state == STATE_CLOSED)
+  {
+    return;
+  }
+
+  if(c->role == ROLE_HCI)
+  {
+    acl_process();
+    return;
+  }
+
+  if(c->role == ROLE_TIMER)
+  {
+    on_timer();
+    return;
+  }
+
+  if(c->role == ROLE_MAILBOX)
+  {
+    on_mailbox(c);
+    return;
+  }
+
+  if(c->role >= ROLE_SCO_LISTEN)
+  {
+    sco_process(c, events);
+    return;
+  }
+
+  if(events & (EPOLLERR | EPOLLHUP))
+  {
+    if(c->role == ROLE_LISTEN)
+    {
+      trace_printf("poll error from listening socket (psm: 0x%04x)\n", c->psm);
+      close_connection(c);
+    }
+    else if(c->state == STATE_CONNECTING)
+    {
+      retry_leg(c);
+    }
+    else
+    {
+      trace_printf("poll error from %s (psm: 0x%04x)\n", role_name[c->role], c->psm);
+      close_channel(c);
+    }
+    return;
+  }
+
+  if(events & EPOLLOUT)
+  {
+    if(c->state == STATE_CONNECTING)
+    {
+      on_connected(c);
+    }
+    else if(c->pollout)
+    {
+      drain_queue(c);
+      if(!c->pollout && c->peer->coalescer)
+      {
+        flush_reports(c->peer);
+      }
+    }
+  }
+
+  if(events & EPOLLIN)
+  {
+    if(c->role == ROLE_LISTEN)
+    {
+      on_accept(c);
+    }
+    else
+    {
+      relay(c);
+    }
+  }
+}
+
+/*
+ * Parse a comma-separated list of PSMs to pre-connect.
+ */
+static int set_preconnect(char* list)
+{
+  char* tok;
+  char* save;
+  int i;
+
+  for(tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+  {
+    if((i = psm_table_index(&psms, strtoul(tok, NULL, 0))) < 0)
+    {
+      fprintf(stderr, "psm %s isn't proxied\n", tok);
+      return -1;
+    }
+    psms.entries[i].preconnect = 1;
+  }
+  return 0;
+}
+
+/*
+ * Parse a comma-separated list of feature report IDs to cache.
+ */
+static void set_feature_reports(char* list)
+{
+  char* tok;
+  char* save;
+
+  for(tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+  {
+    feature_cache_add(strtoul(tok, NULL, 0));
+  }
+}
+
+static e_class event_class(struct connection* c)
+{
+  switch(c->role)
+  {
+    case ROLE_SLAVE:
+    case ROLE_MASTER:
+      return c->session->config->class;
+    case ROLE_TIMER:
+      return CLASS_INTERRUPT; // it forwards the coalesced input reports
+    case ROLE_SCO_SLAVE:
+    case ROLE_SCO_MASTER:
+      return CLASS_INTERRUPT; // each packet paces the audio written to its link
+    default:
+      return CLASS_CONTROL;
+  }
+}
+
+/*
+ * Serve the ready events by class.
+ */
+static void schedule(struct epoll_event* events, int nfds)
+{
+  unsigned long long packets;
+  struct epoll_event* ev;
+  unsigned int i;
+  int cls;
+
+  for(i=0; i<nfds; ++i)
+  {
+    cls = event_class(events[i].data.ptr);
+    sched.ready[cls][sched.count[cls]++] = events + i;
+  }
+
+  for(cls=0; cls<CLASS_MAX; ++cls)
+  {
+    if(!sched.count[cls])
+    {
+      sched.deficit[cls] = 0;
+      continue;
+    }
+
+    sched.deficit[cls] += sched_quantum[cls];
+
+    for(i=0; i<sched.count[cls] && sched.deficit[cls] > 0; ++i)
+    {
+      ev = sched.ready[cls][i];
+      packets = batch.stats.packets;
+      process(ev->data.ptr, ev->events);
+      packets = batch.stats.packets - packets;
+      sched.stats[cls].packets += packets;
+      sched.deficit[cls] -= packets ? packets : 1;
+    }
+
+    if(i < sched.count[cls])
+    {
+      sched.stats[cls].deferred += sched.count[cls] - i;
+    }
+    else
+    {
+      /*
+       * An idle class doesn't save credit.
+       */
+      sched.deficit[cls] = 0;
+    }
+
+    sched.count[cls] = 0;
+  }
+}
+
+static void print_latencies()
+{
+  char name[sizeof("latency SLAVE > MASTER (psm: 0x0000)")];
+  int psm, cls;
+
+  for(psm=0; psm<psms.count; ++psm)
+  {
+    int dir;
+
+    for(dir=0; dir<DIR_MAX; ++dir)
+    {
+      snprintf(name, sizeof(name), "latency %s (psm: 0x%04x)", dir_name[dir], psms.entries[psm].psm);
+      histogram_print(latencies[psm][dir], name);
+    }
+  }
+
+  for(cls=0; cls<CLASS_MAX; ++cls)
+  {
+    snprintf(name, sizeof(name), "service latency %s", class_name[cls]);
+    histogram_print(sched.service[cls], name);
+  }
+}
+
+/*
+ * Size the packet buffers from the configured MTUs.
+ */
+static void set_buf_size()
+{
+  unsigned int i;
+
+  buf_size = 0;
+
+  for(i=0; i<psms.count; ++i)
+  {
+    if(!psms.entries[i].mtu || psms.entries[i].mtu > RELAY_BUF_SIZE)
+    {
+      buf_size = RELAY_BUF_SIZE;
+      break;
+    }
+    if(psms.entries[i].mtu > buf_size)
+    {
+      buf_size = psms.entries[i].mtu;
+    }
+  }
+}
+
+/*
+ * Set up the state of the running loop.
+ * Each loop has its own batch buffers, epoll set, timer, ACL engine, sessions, histograms and statistics.
+ */
+static int loop_init()
+{
+  int i, psm;
+
+  if(pool_init(&pool, POOL_BUFFERS, buf_size) < 0)
+  {
+    return -1;
+  }
+
+  for(i=0; i<RELAY_BATCH; ++i)
+  {
+    batch.bufs[i] = pool_get(&pool);
+    batch.iovs[i].iov_base = batch.bufs[i];
+    batch.iovs[i].iov_len = pool.size;
+    batch.msgs[i].msg_hdr.msg_iov = batch.iovs + i;
+    batch.msgs[i].msg_hdr.msg_iovlen = 1;
+    batch.msgs[i].msg_hdr.msg_control = batch.ctrl[i];
+  }
+
+  if((efd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+  {
+    perror("epoll_create1");
+    return -1;
+  }
+
+  if((timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+  {
+    perror("timerfd_create");
+    return -1;
+  }
+  timer.state = STATE_CONNECTED;
+  ev_register(&timer, EPOLLIN);
+
+  if(is_bluetooth() && (hci.fd = acl_init()) >= 0)
+  {
+    hci.state = STATE_CONNECTED;
+    ev_register(&hci, EPOLLIN);
+  }
+
+  wheel_init(&wheel, get_time());
+
+  latencies = calloc(psms.count, sizeof(*latencies));
+  if(!latencies || hash_init(&sessions, SESSIONS_CAPACITY) < 0)
+  {
+    perror("calloc");
+    return -1;
+  }
+
+  for(i=0; i<CLASS_MAX; ++i)
+  {
+    if(posix_memalign((void**)&sched.service[i], __alignof__(*sched.service[i]), sizeof(*sched.service[i])))
+    {
+      fprintf(stderr, "can't allocate histograms\n");
+      return -1;
+    }
+    memset(sched.service[i], 0x00, sizeof(*sched.service[i]));
+  }
+
+  for(psm=0; psm<psms.count; ++psm)
+  {
+    for(i=0; i<DIR_MAX; ++i)
+    {
+      if(posix_memalign((void**)&latencies[psm][i], __alignof__(*latencies[psm][i]), sizeof(*latencies[psm][i])))
+      {
+        fprintf(stderr, "can't allocate histograms\n");
+        return -1;
+      }
+      memset(latencies[psm][i], 0x00, sizeof(*latencies[psm][i]));
+    }
+  }
+
+  metrics = metrics_register(latencies);
+
+  return 0;
+}
+
+/*
+ * Poll the legs that wait for free buffers again, once the pool has some.
+ */
+static void feed_starved()
+{
+  struct session* s;
+  unsigned int i;
+
+  if(!starving || pool.used == pool.capacity)
+  {
+    return;
+  }
+
+  starving = 0;
+
+  for(i=0; i<sessions.capacity; ++i)
+  {
+    if(!(s = hash_at(&sessions, i)))
+    {
+      continue;
+    }
+    if(s->slave.starved)
+    {
+      s->slave.starved = 0;
+      update_events(&s->slave);
+    }
+    if(s->master.starved)
+    {
+      s->master.starved = 0;
+      update_events(&s->master);
+    }
+  }
+}
+
+static void loop_run()
+{
+  struct epoll_event events[MAX_EVENTS];
+  int printed = print_latency;
+  int nfds;
+
+  while(!done)
+  {
+    if(print_latency != printed)
+    {
+      printed = print_latency;
+      print_latencies();
+      if(!self)
+      {
+        adapter_print_stats();
+      }
+    }
+
+    if(toggle_bypass && !self)
+    {
+      toggle_bypass = 0;
+      feature_cache_toggle();
+    }
+
+    nfds = epoll_wait(efd, events, MAX_EVENTS, -1);
+
+    if(nfds < 0)
+    {
+      if(errno != EINTR)
+      {
+        trace_printf("epoll_wait: %s\n", strerror(errno));
+        break;
+      }
+      continue;
+    }
+
+    schedule(events, nfds);
+
+    feed_starved();
+
+    flush_released();
+  }
+}
+
+/*
+ * Close the sessions of the running loop, and print its statistics.
+ */
+static void loop_close()
+{
+  int i, psm;
+
+  print_latencies();
+
+  /*
+   * Closing a session removes it from the table.
+   */
+  while(sessions.count)
+  {
+    struct session* s;
+    unsigned int j;
+
+    for(j=0; !(s = hash_at(&sessions, j)); ++j);
+
+    close_channel(&s->slave);
+  }
+
+  flush_released();
+
+  hash_free(&sessions);
+
+  /*
+   * In sharded mode, the main thread doesn't relay.
+   */
+  if(self || !nb_shards)
+  {
+    printf("relay: %llu packets in %llu reads\n", batch.stats.packets, batch.stats.reads);
+  }
+
+  for(i=0; i<CLASS_MAX; ++i)
+  {
+    if(sched.stats[i].packets || sched.stats[i].deferred)
+    {
+      printf("scheduler: %s: %llu packets, %llu events deferred\n", class_name[i], sched.stats[i].packets,
+          sched.stats[i].deferred);
+    }
+    free(sched.service[i]);
+  }
+
+  if(preconnects.started)
+  {
+    printf("pre-connections: %llu started, %llu claimed, %llu expired\n",
+        preconnects.started, preconnects.claimed, preconnects.expired);
+  }
+
+  if(wheel.stats.added)
+  {
+    printf("timers: %llu started, %llu expired, %llu cancelled, %llu cascaded\n", wheel.stats.added,
+        wheel.stats.expired, wheel.stats.cancelled, wheel.stats.cascaded);
+  }
+
+  for(psm=0; psm<psms.count; ++psm)
+  {
+    for(i=0; i<DIR_MAX; ++i)
+    {
+      free(latencies[psm][i]);
+    }
+  }
+
+  free(latencies);
+
+  for(i=0; i<RELAY_BATCH; ++i)
+  {
+    pool_put(batch.bufs[i]);
+  }
+
+  pool_print_stats(&pool, "pool");
+  pool_free(&pool);
+
+  if(hci.fd >= 0)
+  {
+    acl_print_stats();
+    acl_cleanup();
+    hci.fd = -1;
+  }
+
+  close(timer.fd);
+  close(efd);
+}
+
+/*
+ * Open the capture files and the caches of the running loop.
+ * Each loop of the sharded mode has its own, so that the relay path doesn't take any lock:
+ * the capture files of loop <n> are <prefix>.loop<n>.0.pcapng, <prefix>.loop<n>.1.pcapng, etc.
+ */
+static int loop_open_files()
+{
+  char prefix[capture_prefix ? strlen(capture_prefix) + sizeof(".loop4294967295") : 1];
+
+  if(capturing)
+  {
+    if(self)
+    {
+      snprintf(prefix, sizeof(prefix), "%s.loop%u", capture_prefix, (unsigned int)(self - shards));
+    }
+    else
+    {
+      snprintf(prefix, sizeof(prefix), "%s", capture_prefix);
+    }
+    if(capture_open(prefix, capture_size * 1024 * 1024, capture_files) < 0)
+    {
+      return -1;
+    }
+  }
+
+  if(sdp_caching && sdp_cache_open(sdp_path) < 0)
+  {
+    return -1;
+  }
+
+  return feature_cache_open();
+}
+
+static void loop_close_files()
+{
+  capture_close();
+  sdp_cache_close();
+  feature_cache_close();
+}
+
+static void* shard_run(void* arg)
+{
+  struct shard* sh = arg;
+  cpu_set_t cpus;
+
+  if(sh->cpu >= 0)
+  {
+    CPU_ZERO(&cpus);
+    CPU_SET(sh->cpu, &cpus);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+    {
+      fprintf(stderr, "can't pin loop %u to cpu %d\n", (unsigned int)(sh - shards), sh->cpu);
+    }
+  }
+
+  self = sh;
+
+  if(loop_init() < 0 || loop_open_files() < 0 || ev_register(&sh->mailbox, EPOLLIN) < 0)
+  {
+    fprintf(stderr, "can't start loop %u\n", (unsigned int)(sh - shards));
+    kill(getpid(), SIGINT);
+    return NULL;
+  }
+
+  loop_run();
+
+  printf("loop %u (adapter %s):\n", (unsigned int)(sh - shards), adapter_bdaddr(sh - shards));
+
+  loop_close();
+
+  loop_close_files();
+
+  return NULL;
+}
+
+/*
+ * Start a loop per adapter.
+ */
+static int shard_start()
+{
+  sigset_t mask, old;
+  unsigned int i;
+
+  /*
+   * Signals are handled by the main thread only.
+   */
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+  for(i=0; i<nb_shards; ++i)
+  {
+    struct shard* sh = shards + i;
+
+    if(ring_init(&sh->ring, SHARD_RING_SIZE, sizeof(struct shard_msg)) < 0)
+    {
+      return -1;
+    }
+
+    init_connection(&sh->mailbox, ROLE_MAILBOX, 0, NULL);
+
+    if((sh->mailbox.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+      perror("eventfd");
+      return -1;
+    }
+    sh->mailbox.state = STATE_CONNECTED;
+
+    if(pthread_create(&sh->thread, NULL, shard_run, sh))
+    {
+      fprintf(stderr, "can't create loop %u\n", i);
+      return -1;
+    }
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  printf("sharded mode: %u loops\n", nb_shards);
+
+  return 0;
+}
+
+/*
+ * Stop the loops one after the other, so that their statistics don't interleave.
+ */
+static void shard_stop()
+{
+  uint64_t one = 1;
+  unsigned int i;
+
+  for(i=0; i<nb_shards; ++i)
+  {
+    struct shard* sh = shards + i;
+
+    if(write(sh->mailbox.fd, &one, sizeof(one)) < 0)
+    {
+      perror("write eventfd");
+    }
+
+    pthread_join(sh->thread, NULL);
+
+    ring_free(&sh->ring);
+    close(sh->mailbox.fd);
+  }
+}
+
+/*
+ * Parse the comma-separated list of the cpus of the loops.
+ */
+static void set_shard_cpus(char* list)
+{
+  char* tok;
+  char* save;
+  int i;
+
+  for(i=0; i<ADAPTERS_MAX; ++i)
+  {
+    shards[i].cpu = -1;
+  }
+
+  for(i=0, tok = strtok_r(list, ",", &save); tok && i<ADAPTERS_MAX; ++i, tok = strtok_r(NULL, ",", &save))
+  {
+    shards[i].cpu = strtol(tok, NULL, 0);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t device_class = 0x508;
+  const char* replay_path = NULL;
+  int replay_fast = 0;
+  const char* config_path = NULL;
+  char* psm_list = NULL;
+  char* preconnect_list = NULL;
+  char* adapter_list = NULL;
+  char* shard_cpus = NULL;
+  const char* metrics_path = NULL;
+  char bdaddr[sizeof("00:00:00:00:00:00")];
+  int slave_fd, master_fd;
+  int i, psm, opt;
+
+  /*
+   * Set highest priority & scheduler policy.
+   */
+  struct sched_param p =
+  { .sched_priority = sched_get_priority_max(SCHED_FIFO) };
+
+  sched_setscheduler(0, SCHED_FIFO, &p);
+
+  setlinebuf(stdout);
+
+  (void) signal(SIGINT, terminate);
+  (void) signal(SIGUSR1, request_latency);
+  (void) signal(SIGUSR2, request_bypass);
+
+  /* Check args */
+  while ((opt = getopt(argc, argv, "r:pc:dw:W:R:Fus:S:f:C:P:a:A:t:M:I:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'r':
+        hid_rate = strtoul(optarg, NULL, 0);
+        break;
+      case 'p':
+        pipelined = 1;
+        break;
+      case 'c':
+        pipelined = 1;
+        sscanf(optarg, "%d,%d", &pipes[DIR_SLAVE_TO_MASTER].cpu, &pipes[DIR_MASTER_TO_SLAVE].cpu);
+        break;
+      case 'd':
+        debug = 1;
+        break;
+      case 'w':
+        capture_prefix = optarg;
+        break;
+      case 'W':
+        sscanf(optarg, "%u,%u", &capture_size, &capture_files);
+        break;
+      case 'R':
+        replay_path = optarg;
+        break;
+      case 'F':
+        replay_fast = 1;
+        break;
+      case 'u':
+        transport = &transport_unix;
+        break;
+      case 'f':
+        set_feature_reports(optarg);
+        break;
+      case 'S':
+        sdp_path = optarg;
+        break;
+      case 's':
+        preconnect_list = optarg;
+        break;
+      case 'C':
+        config_path = optarg;
+        break;
+      case 'P':
+        psm_list = optarg;
+        break;
+      case 'A':
+        adapter_list = optarg;
+        break;
+      case 'M':
+        metrics_path = optarg;
+        break;
+      case 'I':
+        idle_timeout = strtoull(optarg, NULL, 0) * 1000000000ULL;
+        break;
+      case 't':
+        shard_cpus = optarg;
+        set_shard_cpus(shard_cpus);
+        break;
+      case 'a':
+        sco_delay = strtol(optarg, NULL, 0);
+        if(sco_delay < 0 || sco_delay > SCO_MAX_DELAY)
+        {
+          fprintf(stderr, "the SCO target delay is between 0 and %d ms\n", SCO_MAX_DELAY);
+          return 1;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  if (optind < argc)
+    master = argv[optind++];
+
+  if (optind < argc)
+    local = argv[optind++];
+
+  if (optind < argc)
+    device_class = strtol(argv[optind++], NULL, 0);
+
+  if ((!master && !replay_path) || (master && bachk(master) == -1) || (local && bachk(local) == -1)) {
+    printf("usage: %s [-r hid-report-rate] [-p] [-c cpu,cpu] [-d] [-w capture-prefix] [-W size-in-MB,files] [-u] [-s psm,psm] [-S sdp-cache] [-f report-id,report-id] [-C psm-config] [-P psm,psm] [-a sco-delay-ms] [-A adapter,adapter] [-t cpu,cpu] [-M metrics-socket] [-I idle-timeout-s] <ps3-mac-address> <dongle-mac-address> <device-class>\n", *argv);
+    printf("       %s -R capture [-F] [-r hid-report-rate] [-p] [-c cpu,cpu] [-d] [-w capture-prefix] [-W size-in-MB,files] [-C psm-config] [-P psm,psm] [-M metrics-socket] [<ps3-mac-address>]\n", *argv);
+    return 1;
+  }
+
+  if(psm_table_init(&psms, default_psms, sizeof(default_psms) / sizeof(*default_psms)) < 0
+      || (config_path && psm_table_load(&psms, config_path) < 0)
+      || (psm_list && psm_table_select(&psms, psm_list) < 0)
+      || (preconnect_list && set_preconnect(preconnect_list) < 0))
+  {
+    return 1;
+  }
+
+  if(config_path || psm_list)
+  {
+    psm_table_print(&psms);
+  }
+
+  set_buf_size();
+
+  if(replay_path)
+  {
+    if(replay_open(replay_path, master) < 0)
+    {
+      return 1;
+    }
+    replaying = 1;
+    transport = &transport_unix;
+  }
+  else
+  {
+    str2ba(master, &bdaddr_m);
+  }
+
+  if(adapter_list)
+  {
+    if(adapter_add_list(adapter_list, is_bluetooth()) < 0)
+    {
+      return 1;
+    }
+    spreading = 1;
+  }
+  else if(is_bluetooth())
+  {
+    spreading = (adapter_add_all() > 1 && !local);
+  }
+
+  if(local)
+  {
+    local_adapter = adapter_find_str(local);
+  }
+  else if(is_bluetooth() && (i = get_device_id(NULL)) >= 0 && bt_get_device_bdaddr(i, bdaddr) == 0)
+  {
+    local_adapter = adapter_find_str(bdaddr);
+  }
+
+  if(spreading)
+  {
+    printf("spreading the legs over %u adapters\n", adapter_count());
+  }
+
+  if(shard_cpus)
+  {
+    if(pipelined || replaying)
+    {
+      fprintf(stderr, "the sharded mode can't be combined with the pipelined mode or a replay\n");
+      return 1;
+    }
+    if(!adapter_count())
+    {
+      fprintf(stderr, "no adapter to run the loops on (see -A)\n");
+      return 1;
+    }
+  }
+
+  if(is_bluetooth())
+  {
+    if(!spreading)
+    {
+      if(bt_write_device_class(local, device_class) < 0)
+      {
+        printf("failed to set device class\n");
+        return 1;
+      }
+    }
+    else
+    {
+      for(i=0; i<adapter_count(); ++i)
+      {
+        strcpy(bdaddr, adapter_bdaddr(i));
+        if(bt_write_device_class(bdaddr, device_class) < 0)
+        {
+          printf("failed to set device class of %s\n", bdaddr);
+          return 1;
+        }
+      }
+    }
+  }
+
+  if(metrics_path)
+  {
+    if(metrics_start(metrics_path, &psms) < 0)
+    {
+      return 1;
+    }
+  }
+
+  if(loop_init() < 0)
+  {
+    return 1;
+  }
+
+  if(trace_start(TRACE_RECORDS) < 0)
+  {
+    return 1;
+  }
+
+  capturing = (capture_prefix != NULL);
+  sdp_caching = (sdp_path && !replaying);
+
+  /*
+   * In sharded mode, the main thread doesn't relay.
+   */
+  if(!shard_cpus && loop_open_files() < 0)
+  {
+    return 1;
+  }
+
+  if(pipelined && pipe_start() < 0)
+  {
+    return 1;
+  }
+
+  if(shard_cpus)
+  {
+    nb_shards = adapter_count();
+    if(shard_start() < 0)
+    {
+      return 1;
+    }
+  }
+
+  if(!(channels = calloc(psms.count, sizeof(*channels))))
+  {
+    perror("calloc");
+    return 1;
+  }
+
+  for(psm=0; psm<psms.count; ++psm)
+  {
+    struct channel* ch = channels + psm;
+
+    init_connection(&ch->listen, ROLE_LISTEN, psms.entries[psm].psm, NULL);
+
+    if(replaying)
+    {
+      switch(replay_add_channel(psms.entries[psm].psm, &slave_fd, &master_fd))
+      {
+        case -1:
+          return 1;
+        case 1:
+          if(attach_session(psm, slave_fd, master_fd) < 0)
+          {
+            return 1;
+          }
+          break;
+      }
+      continue;
+    }
+
+    ch->listen.fd = transport->listen(local, psms.entries[psm].psm, psms.entries[psm].mtu);
+    if(ch->listen.fd >= 0)
+    {
+      ch->listen.state = STATE_CONNECTED;
+      if(ev_register(&ch->listen, EPOLLIN) < 0)
+      {
+        close_connection(&ch->listen);
+      }
+    }
+  }
+
+  if(sco_delay >= 0 && !replaying && sco_start() < 0)
+  {
+    return 1;
+  }
+
+  if(replaying && replay_start(replay_fast) < 0)
+  {
+    return 1;
+  }
+
+  loop_run();
+
+  metrics_stop();
+
+  if(pipelined)
+  {
+    pipe_stop();
+    pipelined = 0;
+  }
+
+  shard_stop();
+
+  trace_stop();
+
+  loop_close();
+
+  loop_close_files();
+
+  sco_stop();
+
+  for(psm=0; psm<psms.count; ++psm)
+  {
+    close_connection(&channels[psm].listen);
+  }
+
+  free(channels);
+
+  psm_table_free(&psms);
+
+  replay_stop();
+
+  adapter_print_stats();
+
+  metrics_free();
+
+  if(is_bluetooth())
+  {
+    l2cap_print_stats();
+  }
+
+  return 0;
+}
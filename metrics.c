@@ -0,0 +1,449 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "metrics.h"
+
+/*
+ * The metrics are served in the Prometheus text format, on a unix socket.
+ * A path starting with '@' is in the abstract namespace.
+ *
+ * A client that sends an HTTP GET request gets an HTTP response,
+ * and any other client gets the text alone, once it sent its request or after REQUEST_TIMEOUT.
+ * The serving thread runs with the default scheduling policy, at a lower priority,
+ * and only reads the counters of the relaying threads.
+ */
+
+#define REQUEST_TIMEOUT 100 // ms
+
+#define POLL_PERIOD 100 // ms
+
+#define REQUEST_SIZE 1024
+
+static const char* dir_label[METRICS_DIRS] =
+{
+  "slave_to_master",
+  "master_to_slave",
+};
+
+/*
+ * The upper bounds of the latency buckets, in ns.
+ */
+static const unsigned long long latency_bounds[] =
+{
+  50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000,
+};
+
+#define NB_BOUNDS (sizeof(latency_bounds) / sizeof(*latency_bounds))
+
+static struct
+{
+  int fd;
+  char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+  unsigned short* psms;
+  unsigned int nb_psms;
+  struct metrics* blocks; // pushed by the registering threads
+  pthread_t thread;
+  volatile int done;
+  unsigned long long scrapes;
+} registry = { .fd = -1 };
+
+/*
+ * Register the calling thread.
+ *
+ * \param latencies  the latency histograms the thread writes, or NULL
+ *
+ * \return the metrics of the thread, NULL if the metrics aren't served
+ */
+struct metrics* metrics_register(struct histogram* (*latencies)[METRICS_DIRS])
+{
+  struct metrics* m;
+  size_t size = sizeof(*m) + registry.nb_psms * sizeof(*m->psms);
+
+  if(registry.fd < 0)
+  {
+    return NULL;
+  }
+
+  if(posix_memalign((void**)&m, __alignof__(struct metrics_psm), size))
+  {
+    fprintf(stderr, "can't allocate metrics\n");
+    return NULL;
+  }
+
+  memset(m, 0x00, size);
+  m->latencies = latencies;
+
+  m->next = __atomic_load_n(&registry.blocks, __ATOMIC_RELAXED);
+  while(!__atomic_compare_exchange_n(&registry.blocks, &m->next, m, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  return m;
+}
+
+static void print_header(FILE* out, const char* name, const char* help, const char* type)
+{
+  fprintf(out, "# HELP l2cap_proxy_%s %s\n# TYPE l2cap_proxy_%s %s\n", name, help, name, type);
+}
+
+/*
+ * Sum a field of the metrics of each PSM, or of each PSM and direction, over all the blocks.
+ * The gauges are summed as unsigned values: the sum wraps back to the signed total.
+ */
+static unsigned long long sum(struct metrics* head, unsigned int psm, int dir, size_t offset)
+{
+  unsigned long long total = 0;
+  struct metrics* m;
+  char* base;
+
+  for(m = head; m; m = m->next)
+  {
+    base = (dir < 0) ? (char*)(m->psms + psm) : (char*)(m->psms[psm].dir + dir);
+    total += __atomic_load_n((unsigned long long*)(base + offset), __ATOMIC_RELAXED);
+  }
+
+  return total;
+}
+
+static void print_dir_metric(FILE* out, struct metrics* head, const char* name, size_t offset)
+{
+  unsigned int psm;
+  int dir;
+
+  for(psm=0; psm<registry.nb_psms; ++psm)
+  {
+    for(dir=0; dir<METRICS_DIRS; ++dir)
+    {
+      fprintf(out, "l2cap_proxy_%s{psm=\"0x%04x\",direction=\"%s\"} %lld\n", name, registry.psms[psm], dir_label[dir],
+          (long long)sum(head, psm, dir, offset));
+    }
+  }
+}
+
+static void print_psm_metric(FILE* out, struct metrics* head, const char* name, size_t offset)
+{
+  unsigned int psm;
+
+  for(psm=0; psm<registry.nb_psms; ++psm)
+  {
+    fprintf(out, "l2cap_proxy_%s{psm=\"0x%04x\"} %lld\n", name, registry.psms[psm], (long long)sum(head, psm, -1, offset));
+  }
+}
+
+static void print_latencies(FILE* out, struct metrics* head)
+{
+  unsigned long long buckets[NB_BOUNDS];
+  unsigned long long count, ns, n, value;
+  struct histogram* h;
+  struct metrics* m;
+  unsigned int psm, i, b;
+  int dir;
+
+  for(psm=0; psm<registry.nb_psms; ++psm)
+  {
+    for(dir=0; dir<METRICS_DIRS; ++dir)
+    {
+      memset(buckets, 0x00, sizeof(buckets));
+      count = 0;
+      ns = 0;
+
+      for(m = head; m; m = m->next)
+      {
+        if(!m->latencies || !(h = m->latencies[psm][dir]))
+        {
+          continue;
+        }
+        for(i=0; i<HISTOGRAM_BUCKETS; ++i)
+        {
+          if(!(n = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED)))
+          {
+            continue;
+          }
+          count += n;
+          value = histogram_bucket_max(i);
+          for(b=0; b<NB_BOUNDS && value > latency_bounds[b]; ++b);
+          if(b < NB_BOUNDS)
+          {
+            buckets[b] += n;
+          }
+        }
+        ns += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+      }
+
+      for(b=0, n=0; b<NB_BOUNDS; ++b)
+      {
+        n += buckets[b];
+        fprintf(out, "l2cap_proxy_latency_seconds_bucket{psm=\"0x%04x\",direction=\"%s\",le=\"%g\"} %llu\n",
+            registry.psms[psm], dir_label[dir], latency_bounds[b] / 1e9, n);
+      }
+      fprintf(out, "l2cap_proxy_latency_seconds_bucket{psm=\"0x%04x\",direction=\"%s\",le=\"+Inf\"} %llu\n",
+          registry.psms[psm], dir_label[dir], count);
+      fprintf(out, "l2cap_proxy_latency_seconds_sum{psm=\"0x%04x\",direction=\"%s\"} %.9f\n",
+          registry.psms[psm], dir_label[dir], ns / 1e9);
+      fprintf(out, "l2cap_proxy_latency_seconds_count{psm=\"0x%04x\",direction=\"%s\"} %llu\n",
+          registry.psms[psm], dir_label[dir], count);
+    }
+  }
+}
+
+/*
+ * Write the metrics in the Prometheus text format.
+ */
+static void print_metrics(FILE* out)
+{
+  struct metrics* head = __atomic_load_n(&registry.blocks, __ATOMIC_ACQUIRE);
+
+  print_header(out, "packets_total", "Packets written to the legs.", "counter");
+  print_dir_metric(out, head, "packets_total", offsetof(struct metrics_dir, packets));
+
+  print_header(out, "bytes_total", "Bytes written to the legs.", "counter");
+  print_dir_metric(out, head, "bytes_total", offsetof(struct metrics_dir, bytes));
+
+  print_header(out, "drops_total", "Packets that were not relayed.", "counter");
+  print_dir_metric(out, head, "drops_total", offsetof(struct metrics_dir, drops));
+
+  print_header(out, "send_errors_total", "Write errors.", "counter");
+  print_dir_metric(out, head, "send_errors_total", offsetof(struct metrics_dir, send_errors));
+
+  print_header(out, "queue_depth", "Packets waiting in the send queues.", "gauge");
+  print_dir_metric(out, head, "queue_depth", offsetof(struct metrics_dir, queued));
+
+  print_header(out, "connects_total", "Legs accepted or connected.", "counter");
+  print_psm_metric(out, head, "connects_total", offsetof(struct metrics_psm, connects));
+
+  print_header(out, "accept_rejects_total", "Accepted legs that were closed at once.", "counter");
+  print_psm_metric(out, head, "accept_rejects_total", offsetof(struct metrics_psm, rejects));
+
+  print_header(out, "legs", "Open legs.", "gauge");
+  print_psm_metric(out, head, "legs", offsetof(struct metrics_psm, legs));
+
+  print_header(out, "latency_seconds", "Time spent in the proxy by the written packets.", "histogram");
+  print_latencies(out, head);
+
+  print_header(out, "scrapes_total", "Metrics requests.", "counter");
+  fprintf(out, "l2cap_proxy_scrapes_total %llu\n", ++registry.scrapes);
+}
+
+static void serve(int client)
+{
+  struct timeval timeout = { 0, REQUEST_TIMEOUT * 1000 };
+  char req[REQUEST_SIZE];
+  char* body = NULL;
+  size_t size = 0;
+  FILE* out;
+  int len;
+
+  if(setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+  {
+    perror("setsockopt SO_RCVTIMEO");
+  }
+
+  len = recv(client, req, sizeof(req), 0);
+
+  if(!(out = open_memstream(&body, &size)))
+  {
+    perror("open_memstream");
+    return;
+  }
+
+  print_metrics(out);
+
+  fclose(out);
+
+  if(len >= 4 && !strncmp(req, "GET ", 4))
+  {
+    dprintf(client, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", size);
+  }
+
+  if(send(client, body, size, MSG_NOSIGNAL) < 0)
+  {
+    perror("send");
+  }
+
+  free(body);
+}
+
+static void* run(void* arg)
+{
+  struct pollfd pfd = { .fd = registry.fd, .events = POLLIN };
+  int client;
+
+  /*
+   * On Linux, this only lowers the priority of the calling thread.
+   */
+  if(setpriority(PRIO_PROCESS, 0, 10) < 0)
+  {
+    perror("setpriority");
+  }
+
+  while(!registry.done)
+  {
+    if(poll(&pfd, 1, POLL_PERIOD) <= 0)
+    {
+      continue;
+    }
+
+    if((client = accept4(registry.fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+    {
+      perror("accept");
+      continue;
+    }
+
+    serve(client);
+
+    close(client);
+  }
+
+  return NULL;
+}
+
+/*
+ * Start serving the metrics.
+ * The serving thread runs with the default scheduling policy, whatever the policy of the calling thread.
+ *
+ * \param path  the path of the unix socket
+ * \param psms  the proxied PSMs, the metrics are indexed as the table
+ *
+ * \return 0 if successful, -1 otherwise
+ */
+int metrics_start(const char* path, const struct psm_table* psms)
+{
+  struct sched_param param = { .sched_priority = 0 };
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  socklen_t len;
+  pthread_attr_t attr;
+  sigset_t mask, old;
+  unsigned int i;
+  int ret = 0;
+
+  if(strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "metrics socket path is too long: %s\n", path);
+    return -1;
+  }
+
+  strcpy(addr.sun_path, path);
+  len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+  if(path[0] == '@')
+  {
+    addr.sun_path[0] = '\0';
+  }
+  else
+  {
+    unlink(path);
+    ++len;
+  }
+
+  if(!(registry.psms = malloc(psms->count * sizeof(*registry.psms))))
+  {
+    perror("malloc");
+    return -1;
+  }
+
+  for(i=0; i<psms->count; ++i)
+  {
+    registry.psms[i] = psms->entries[i].psm;
+  }
+  registry.nb_psms = psms->count;
+
+  if((registry.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+  {
+    perror("socket");
+    return -1;
+  }
+
+  if(bind(registry.fd, (struct sockaddr *) &addr, len) < 0 || listen(registry.fd, 4) < 0)
+  {
+    perror(path);
+    close(registry.fd);
+    registry.fd = -1;
+    return -1;
+  }
+
+  strcpy(registry.path, path);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+  pthread_attr_setschedparam(&attr, &param);
+
+  /*
+   * Signals are handled by the calling thread.
+   */
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+  if(pthread_create(&registry.thread, &attr, run, NULL))
+  {
+    fprintf(stderr, "can't create the metrics thread\n");
+    close(registry.fd);
+    registry.fd = -1;
+    ret = -1;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy(&attr);
+
+  if(!ret)
+  {
+    printf("serving metrics on %s\n", path);
+  }
+
+  return ret;
+}
+
+/*
+ * Stop serving the metrics.
+ * The threads can still update their metrics until metrics_free().
+ */
+void metrics_stop()
+{
+  if(registry.fd < 0 || registry.done)
+  {
+    return;
+  }
+
+  registry.done = 1;
+
+  pthread_join(registry.thread, NULL);
+
+  close(registry.fd);
+
+  if(registry.path[0] != '@')
+  {
+    unlink(registry.path);
+  }
+
+  printf("metrics: %llu scrapes\n", registry.scrapes);
+}
+
+void metrics_free()
+{
+  struct metrics* m;
+
+  metrics_stop();
+
+  while((m = registry.blocks))
+  {
+    registry.blocks = m->next;
+    free(m);
+  }
+
+  free(registry.psms);
+  registry.psms = NULL;
+  registry.fd = -1;
+}
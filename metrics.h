@@ -0,0 +1,62 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include "histogram.h"
+#include "psm_config.h"
+
+/*
+ * The directions, in the order of the e_dir enum of the proxy.
+ */
+#define METRICS_DIRS 2
+
+/*
+ * The metrics of a PSM and direction.
+ */
+struct metrics_dir
+{
+  unsigned long long packets;     // written to the legs
+  unsigned long long bytes;
+  unsigned long long drops;       // filtered, or dropped by a full queue or ring
+  unsigned long long send_errors;
+  long long queued;               // packets waiting in the send queues (gauge)
+};
+
+struct metrics_psm
+{
+  struct metrics_dir dir[METRICS_DIRS];
+  unsigned long long connects;    // legs accepted or connected
+  unsigned long long rejects;     // accepted legs that were closed at once
+  long long legs;                 // open legs (gauge)
+} __attribute__((aligned(64)));
+
+/*
+ * The metrics updated by a thread.
+ *
+ * Each updating thread has its own block, so that a counter has a single writer:
+ * it is updated with relaxed atomic loads and stores, without locked instructions,
+ * and the serving thread sums the blocks. A gauge is the sum of the changes made by all the threads.
+ */
+struct metrics
+{
+  struct metrics* next;
+  struct histogram* (*latencies)[METRICS_DIRS]; // the latency histograms written by the thread, per PSM, or NULL
+  struct metrics_psm psms[];
+};
+
+#define METRICS_ADD(VAR, VALUE) \
+  __atomic_store_n(&(VAR), __atomic_load_n(&(VAR), __ATOMIC_RELAXED) + (VALUE), __ATOMIC_RELAXED)
+
+int metrics_start(const char* path, const struct psm_table* psms);
+
+struct metrics* metrics_register(struct histogram* (*latencies)[METRICS_DIRS]);
+
+void metrics_stop();
+
+void metrics_free();
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "pool.h"
+
+/*
+ * Reserve the buffers of a pool, and lock them in memory, so that getting a buffer never faults nor allocates.
+ * A pool that can't be locked (see ulimit -l) still works.
+ *
+ * \param capacity  the number of buffers
+ * \param size      the size of a buffer, rounded up to a cache line
+ *
+ * \return 0 if successful, -1 otherwise
+ */
+int pool_init(struct pool* p, unsigned int capacity, unsigned int size)
+{
+  struct pool_buf* b;
+  unsigned int i;
+
+  memset(p, 0x00, sizeof(*p));
+
+  p->size = (size + __alignof__(struct pool_buf) - 1) & ~(__alignof__(struct pool_buf) - 1);
+  p->stride = sizeof(struct pool_buf) + p->size;
+  p->capacity = capacity;
+
+  if(posix_memalign((void**)&p->mem, __alignof__(struct pool_buf), capacity * p->stride))
+  {
+    fprintf(stderr, "can't allocate a pool of %u buffers\n", capacity);
+    p->mem = NULL;
+    return -1;
+  }
+
+  /*
+   * Touch all the pages before locking them.
+   */
+  memset(p->mem, 0x00, capacity * p->stride);
+
+  if(mlock(p->mem, capacity * p->stride) < 0)
+  {
+    perror("mlock");
+  }
+  else
+  {
+    p->locked = 1;
+  }
+
+  for(i=0; i<capacity; ++i)
+  {
+    b = (struct pool_buf*)(p->mem + i * p->stride);
+    b->pool = p;
+    b->next = i + 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Get a buffer, with a single reference.
+ *
+ * \return the buffer, NULL if the pool is exhausted
+ */
+unsigned char* pool_get(struct pool* p)
+{
+  struct pool_buf* b;
+
+  if(p->free == p->capacity)
+  {
+    ++p->stats.exhausted;
+    return NULL;
+  }
+
+  b = (struct pool_buf*)(p->mem + p->free * p->stride);
+  p->free = b->next;
+  b->refs = 1;
+
+  ++p->stats.gets;
+  if(++p->used > p->stats.max_used)
+  {
+    p->stats.max_used = p->used;
+  }
+
+  return b->data;
+}
+
+/*
+ * Drop a reference to a buffer: the last one gives it back to its pool.
+ */
+void pool_put(unsigned char* buf)
+{
+  struct pool_buf* b = pool_header(buf);
+  struct pool* p = b->pool;
+
+  if(--b->refs)
+  {
+    return;
+  }
+
+  b->next = p->free;
+  p->free = ((unsigned char*)b - p->mem) / p->stride;
+  --p->used;
+}
+
+void pool_print_stats(const struct pool* p, const char* name)
+{
+  if(!p->stats.gets)
+  {
+    return;
+  }
+
+  printf("%s: %u buffers of %u bytes%s, %llu gets, max used: %u, %llu exhausted\n", name, p->capacity, p->size,
+      p->locked ? " (locked)" : "", p->stats.gets, p->stats.max_used, p->stats.exhausted);
+}
+
+void pool_free(struct pool* p)
+{
+  if(!p->mem)
+  {
+    return;
+  }
+
+  if(p->locked)
+  {
+    munlock(p->mem, p->capacity * p->stride);
+  }
+
+  free(p->mem);
+  p->mem = NULL;
+}
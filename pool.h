@@ -0,0 +1,78 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+
+/*
+ * A fixed-capacity pool of packet buffers, reserved and locked in memory at startup.
+ *
+ * Each buffer starts on a cache line, after a header that holds its reference count.
+ * A pool and its buffers belong to a single thread: the counts aren't atomic.
+ */
+struct pool_buf
+{
+  struct pool* pool;
+  unsigned int refs;
+  unsigned int next; // the next free buffer
+  unsigned char data[] __attribute__((aligned(64)));
+};
+
+struct pool
+{
+  unsigned char* mem;
+  size_t stride;
+  unsigned int size;     // the size of a buffer
+  unsigned int capacity;
+  unsigned int free;     // the first free buffer, capacity if none
+  unsigned int used;
+  int locked;            // mlock succeeded
+  struct
+  {
+    unsigned long long gets;
+    unsigned long long exhausted;
+    unsigned int max_used;
+  } stats;
+};
+
+int pool_init(struct pool* p, unsigned int capacity, unsigned int size);
+
+unsigned char* pool_get(struct pool* p);
+
+void pool_put(unsigned char* buf);
+
+static inline struct pool_buf* pool_header(unsigned char* buf)
+{
+  return (struct pool_buf*)(buf - offsetof(struct pool_buf, data));
+}
+
+/*
+ * Share a buffer: each reference is dropped with pool_put().
+ */
+static inline void pool_ref(unsigned char* buf)
+{
+  ++pool_header(buf)->refs;
+}
+
+static inline unsigned int pool_refs(unsigned char* buf)
+{
+  return pool_header(buf)->refs;
+}
+
+/*
+ * Tell if a buffer was taken from a pool.
+ */
+static inline int pool_owns(const struct pool* p, const unsigned char* buf)
+{
+  return p->mem && buf >= p->mem && buf < p->mem + p->capacity * p->stride;
+}
+
+void pool_print_stats(const struct pool* p, const char* name);
+
+void pool_free(struct pool* p);
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "psm_config.h"
+
+/*
+ * The configuration file has a line per PSM: the PSM, then its options.
+ * Empty lines and the text after a '#' are ignored.
+ *
+ *   # psm  options
+ *   0x0001
+ *   0x0011 priority=6
+ *   0x0013 overflow=drop coalesce priority=6 mtu=1024
+ *
+ * overflow=block|drop   what to do when a leg can't take more packets (default: block)
+ * relay=both|master|slave  the directions to relay, packets to the other leg are dropped (default: both)
+ * priority=<0-6>        the SO_PRIORITY of the legs, used by the kernel to schedule the outgoing packets
+ * class=interrupt|control|bulk  the order in which the proxy serves the ready legs (default: bulk)
+ * mtu=<bytes>           the MTU of the L2CAP sockets
+ * coalesce              coalesce the HID input reports from the devices (see -r)
+ * preconnect            connect to the master as soon as a device connects to any PSM (see -s)
+ */
+
+#define LINE_SIZE 256
+
+const char* class_name[CLASS_MAX] =
+{
+  [CLASS_INTERRUPT] = "interrupt",
+  [CLASS_CONTROL] = "control",
+  [CLASS_BULK] = "bulk",
+};
+
+static const struct psm_config default_config =
+{
+  .overflow = OVERFLOW_BLOCK,
+  .relay = RELAY_BOTH,
+  .priority = -1,
+  .class = CLASS_BULK,
+};
+
+static int parse_class(const char* str, e_class* class)
+{
+  int i;
+
+  for(i = 0; i < CLASS_MAX; ++i)
+  {
+    if(!strcmp(str, class_name[i]))
+    {
+      *class = i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int psm_table_init(struct psm_table* t, const struct psm_config* defaults, unsigned int count)
+{
+  if(!(t->entries = malloc(count * sizeof(*t->entries))))
+  {
+    perror("malloc");
+    return -1;
+  }
+
+  memcpy(t->entries, defaults, count * sizeof(*t->entries));
+  t->count = count;
+
+  return 0;
+}
+
+int psm_table_index(const struct psm_table* t, unsigned short psm)
+{
+  unsigned int i;
+
+  for(i = 0; i < t->count; ++i)
+  {
+    if(t->entries[i].psm == psm)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static struct psm_config* add(struct psm_table* t, unsigned short psm)
+{
+  struct psm_config* entries;
+  int i;
+
+  if((i = psm_table_index(t, psm)) >= 0)
+  {
+    return t->entries + i;
+  }
+
+  if(!(entries = realloc(t->entries, (t->count + 1) * sizeof(*entries))))
+  {
+    perror("realloc");
+    return NULL;
+  }
+
+  t->entries = entries;
+  t->entries[t->count] = default_config;
+  t->entries[t->count].psm = psm;
+
+  return t->entries + t->count++;
+}
+
+static int parse_psm(const char* str, unsigned short* psm)
+{
+  char* end;
+  unsigned long val = strtoul(str, &end, 0);
+
+  /*
+   * A valid PSM is odd, and the least significant bit of its most significant byte is 0.
+   */
+  if(*end || !val || val > 0xffff || !(val & 0x0001) || (val & 0x0100))
+  {
+    return -1;
+  }
+
+  *psm = val;
+
+  return 0;
+}
+
+static int parse_option(struct psm_config* c, char* opt)
+{
+  char* val = strchr(opt, '=');
+  char* end;
+  long num;
+
+  if(val)
+  {
+    *val++ = '\0';
+  }
+
+  if(!strcmp(opt, "coalesce") && !val)
+  {
+    c->coalesce = 1;
+  }
+  else if(!strcmp(opt, "preconnect") && !val)
+  {
+    c->preconnect = 1;
+  }
+  else if(!strcmp(opt, "overflow") && val && !strcmp(val, "block"))
+  {
+    c->overflow = OVERFLOW_BLOCK;
+  }
+  else if(!strcmp(opt, "overflow") && val && !strcmp(val, "drop"))
+  {
+    c->overflow = OVERFLOW_DROP_OLDEST;
+  }
+  else if(!strcmp(opt, "relay") && val && !strcmp(val, "both"))
+  {
+    c->relay = RELAY_BOTH;
+  }
+  else if(!strcmp(opt, "relay") && val && !strcmp(val, "master"))
+  {
+    c->relay = RELAY_TO_MASTER;
+  }
+  else if(!strcmp(opt, "relay") && val && !strcmp(val, "slave"))
+  {
+    c->relay = RELAY_TO_SLAVE;
+  }
+  else if(!strcmp(opt, "priority") && val && (num = strtol(val, &end, 0)) >= 0 && num <= 6 && !*end)
+  {
+    c->priority = num;
+  }
+  else if(!strcmp(opt, "class") && val)
+  {
+    return parse_class(val, &c->class);
+  }
+  else if(!strcmp(opt, "mtu") && val && (num = strtol(val, &end, 0)) >= PSM_MTU_MIN && num <= PSM_MTU_MAX
+      && !*end)
+  {
+    c->mtu = num;
+  }
+  else
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Replace the PSMs of a table with the ones of a configuration file.
+ */
+int psm_table_load(struct psm_table* t, const char* path)
+{
+  char line[LINE_SIZE];
+  struct psm_config* c;
+  unsigned short psm;
+  char* tok;
+  char* save;
+  int nb = 0;
+  FILE* file;
+
+  if(!(file = fopen(path, "r")))
+  {
+    perror(path);
+    return -1;
+  }
+
+  t->count = 0;
+
+  while(fgets(line, sizeof(line), file))
+  {
+    ++nb;
+
+    if((tok = strchr(line, '#')))
+    {
+      *tok = '\0';
+    }
+
+    if(!(tok = strtok_r(line, " \t\r\n", &save)))
+    {
+      continue;
+    }
+
+    if(parse_psm(tok, &psm) < 0)
+    {
+      fprintf(stderr, "%s:%d: invalid psm: %s\n", path, nb, tok);
+      fclose(file);
+      return -1;
+    }
+
+    if(!(c = add(t, psm)))
+    {
+      fclose(file);
+      return -1;
+    }
+
+    while((tok = strtok_r(NULL, " \t\r\n", &save)))
+    {
+      if(parse_option(c, tok) < 0)
+      {
+        fprintf(stderr, "%s:%d: invalid option: %s\n", path, nb, tok);
+        fclose(file);
+        return -1;
+      }
+    }
+  }
+
+  fclose(file);
+
+  if(!t->count)
+  {
+    fprintf(stderr, "%s: no psm\n", path);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Only keep the PSMs of a comma-separated list, in that order.
+ * The PSMs that aren't in the table get the default options.
+ */
+int psm_table_select(struct psm_table* t, char* list)
+{
+  struct psm_config* entries;
+  unsigned int count = 0;
+  unsigned short psm;
+  char* tok;
+  char* save;
+  int i;
+
+  for(tok = list; *tok; ++tok)
+  {
+    count += (*tok == ',');
+  }
+
+  if(!(entries = calloc(count + 1, sizeof(*entries))))
+  {
+    perror("calloc");
+    return -1;
+  }
+
+  count = 0;
+
+  for(tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+  {
+    if(parse_psm(tok, &psm) < 0)
+    {
+      fprintf(stderr, "invalid psm: %s\n", tok);
+      free(entries);
+      return -1;
+    }
+    if((i = psm_table_index(t, psm)) >= 0)
+    {
+      entries[count] = t->entries[i];
+    }
+    else
+    {
+      entries[count] = default_config;
+      entries[count].psm = psm;
+    }
+    ++count;
+  }
+
+  free(t->entries);
+  t->entries = entries;
+  t->count = count;
+
+  return 0;
+}
+
+void psm_table_print(const struct psm_table* t)
+{
+  const struct psm_config* c;
+  unsigned int i;
+
+  for(i = 0; i < t->count; ++i)
+  {
+    c = t->entries + i;
+    printf("psm 0x%04x: class=%s overflow=%s relay=%s", c->psm, class_name[c->class],
+        c->overflow == OVERFLOW_BLOCK ? "block" : "drop",
+        c->relay == RELAY_BOTH ? "both" : (c->relay == RELAY_TO_MASTER ? "master" : "slave"));
+    if(c->priority >= 0)
+    {
+      printf(" priority=%d", c->priority);
+    }
+    if(c->mtu)
+    {
+      printf(" mtu=%u", c->mtu);
+    }
+    printf("%s%s\n", c->coalesce ? " coalesce" : "", c->preconnect ? " preconnect" : "");
+  }
+}
+
+void psm_table_free(struct psm_table* t)
+{
+  free(t->entries);
+  t->entries = NULL;
+  t->count = 0;
+}
@@ -0,0 +1,77 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef PSM_CONFIG_H_
+#define PSM_CONFIG_H_
+
+typedef enum
+{
+  OVERFLOW_BLOCK,       // stop reading the other leg until the queue drains
+  OVERFLOW_DROP_OLDEST, // drop the oldest queued packet
+} e_overflow;
+
+/*
+ * The scheduling classes of the loop, from the first served to the last one.
+ */
+typedef enum
+{
+  CLASS_INTERRUPT, // input reports
+  CLASS_CONTROL,   // service discovery, control channels
+  CLASS_BULK,      // everything else
+  CLASS_MAX,
+} e_class;
+
+extern const char* class_name[CLASS_MAX];
+
+/*
+ * The relayed directions.
+ */
+#define RELAY_TO_MASTER 0x01
+#define RELAY_TO_SLAVE  0x02
+#define RELAY_BOTH      (RELAY_TO_MASTER | RELAY_TO_SLAVE)
+
+/*
+ * The range of the configured MTUs. A packet never exceeds the relay buffers, which are this large at most.
+ */
+#define PSM_MTU_MIN 48
+#define PSM_MTU_MAX 4096
+
+/*
+ * How the proxy handles a PSM.
+ */
+struct psm_config
+{
+  unsigned short psm;
+  unsigned short mtu;   // the MTU of the L2CAP sockets, 0 for the default one
+  e_overflow overflow;
+  int relay;            // RELAY_* flags, the packets of the other directions are dropped
+  int priority;         // the SO_PRIORITY of the sockets, -1 to leave it unchanged
+  e_class class;
+  int coalesce;         // coalesce the HID input reports from the device
+  int preconnect;       // connect to the master as soon as a device connects to any PSM
+};
+
+/*
+ * The PSMs to proxy, in a flat array indexed by channel.
+ */
+struct psm_table
+{
+  struct psm_config* entries;
+  unsigned int count;
+};
+
+int psm_table_init(struct psm_table* t, const struct psm_config* defaults, unsigned int count);
+
+int psm_table_load(struct psm_table* t, const char* path);
+
+int psm_table_select(struct psm_table* t, char* list);
+
+int psm_table_index(const struct psm_table* t, unsigned short psm);
+
+void psm_table_print(const struct psm_table* t);
+
+void psm_table_free(struct psm_table* t);
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <string.h>
+#include "queue.h"
+
+/*
+ * Append a packet, with its reception time.
+ * A buffer of the pool is shared, and any other buffer is copied to a buffer of the pool.
+ *
+ * \return 0 if successful, -1 if the queue is full, if the pool is exhausted or if the packet doesn't fit
+ */
+int queue_push(struct queue* q, struct pool* p, const unsigned char* buf, int len, unsigned long long ts)
+{
+  unsigned int index;
+  unsigned char* copy;
+
+  if(queue_full(q))
+  {
+    return -1;
+  }
+
+  if(pool_owns(p, buf))
+  {
+    copy = (unsigned char*) buf;
+    pool_ref(copy);
+  }
+  else
+  {
+    if(len > p->size || !(copy = pool_get(p)))
+    {
+      return -1;
+    }
+    memcpy(copy, buf, len);
+  }
+
+  index = (q->head + q->count) % QUEUE_SIZE;
+  q->items[index].buf = copy;
+  q->items[index].len = len;
+  q->items[index].ts = ts;
+
+  ++q->count;
+  ++q->stats.queued;
+  if(q->count > q->stats.max_depth)
+  {
+    q->stats.max_depth = q->count;
+  }
+
+  return 0;
+}
+
+/*
+ * Get the oldest packet.
+ *
+ * \return 1 if the queue is not empty, 0 otherwise
+ */
+int queue_peek(struct queue* q, unsigned char** buf, int* len, unsigned long long* ts)
+{
+  if(queue_empty(q))
+  {
+    return 0;
+  }
+
+  *buf = q->items[q->head].buf;
+  *len = q->items[q->head].len;
+  *ts = q->items[q->head].ts;
+
+  return 1;
+}
+
+/*
+ * Remove the oldest packet.
+ */
+void queue_pop(struct queue* q)
+{
+  if(queue_empty(q))
+  {
+    return;
+  }
+
+  pool_put(q->items[q->head].buf);
+  q->head = (q->head + 1) % QUEUE_SIZE;
+  --q->count;
+}
+
+void queue_clear(struct queue* q)
+{
+  while(!queue_empty(q))
+  {
+    queue_pop(q);
+  }
+}
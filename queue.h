@@ -0,0 +1,52 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef QUEUE_H_
+#define QUEUE_H_
+
+#include "pool.h"
+
+#define QUEUE_SIZE 32
+
+/*
+ * A bounded FIFO of outbound packets, held in pool buffers.
+ */
+struct queue
+{
+  struct
+  {
+    unsigned char* buf;
+    int len;
+    unsigned long long ts;
+  } items[QUEUE_SIZE];
+  unsigned int head;
+  unsigned int count;
+  struct
+  {
+    unsigned long long queued;
+    unsigned long long overflows;
+    unsigned int max_depth;
+  } stats;
+};
+
+static inline int queue_empty(const struct queue* q)
+{
+  return q->count == 0;
+}
+
+static inline int queue_full(const struct queue* q)
+{
+  return q->count == QUEUE_SIZE;
+}
+
+int queue_push(struct queue* q, struct pool* p, const unsigned char* buf, int len, unsigned long long ts);
+
+int queue_peek(struct queue* q, unsigned char** buf, int* len, unsigned long long* ts);
+
+void queue_pop(struct queue* q);
+
+void queue_clear(struct queue* q);
+
+#endif
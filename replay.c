@@ -0,0 +1,912 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <bluetooth/bluetooth.h>
+#include "replay.h"
+
+/*
+ * Replay the L2CAP frames of a capture through the proxy, in place of the bluetooth devices.
+ *
+ * The capture can be a btsnoop file (H1 or H4) or an hcidump file (hcidump -w).
+ * The frames received by the capturing host are extracted, and their PSM is resolved
+ * by following the L2CAP connection requests and responses.
+ *
+ * Each leg of a channel is a SOCK_SEQPACKET socket pair.
+ * A feeder thread writes the frames to the far ends of the input legs,
+ * with the recorded timing or as fast as possible.
+ * A sink thread reads the far ends of the output legs and counts the forwarded frames.
+ * Once all frames are fed and the proxy is idle, the sink thread sends SIGINT to the thread that started the replay.
+ */
+
+#define REPLAY_MAX_LINKS 8
+#define REPLAY_MAX_PENDING 8
+#define REPLAY_MAX_CIDS 16
+#define REPLAY_MAX_CHANNELS 16
+#define REPLAY_MAX_FRAME 4096
+
+#define REPLAY_POLL_PERIOD 100 // ms
+#define REPLAY_IDLE_TIMEOUT 1000000000ULL // ns
+
+#define BTSNOOP_H1 1001
+#define BTSNOOP_H4 1002
+
+#define H4_COMMAND 0x01
+#define H4_ACL 0x02
+#define H4_EVENT 0x04
+
+#define EVT_CONN_COMPLETE 0x03
+
+#define ACL_CONTINUATION 0x01
+
+#define L2CAP_SIGNALING_CID 0x0001
+#define L2CAP_CONN_REQ 0x02
+#define L2CAP_CONN_RSP 0x03
+
+/*
+ * Microseconds between 0000-01-01 and 1970-01-01.
+ */
+#define BTSNOOP_EPOCH 0x00dcddb30f2f8000ULL
+
+typedef enum
+{
+  DIR_SLAVE_TO_MASTER,
+  DIR_MASTER_TO_SLAVE,
+  DIR_MAX
+} e_dir;
+
+static const char* dir_name[] =
+{
+  [DIR_SLAVE_TO_MASTER] = "SLAVE > MASTER",
+  [DIR_MASTER_TO_SLAVE] = "MASTER > SLAVE",
+};
+
+struct frame
+{
+  unsigned long long ts; // ns since the first frame
+  unsigned short psm;
+  unsigned short len;
+  e_dir dir;
+  unsigned char* data;
+};
+
+struct reassembly
+{
+  unsigned char buf[REPLAY_MAX_FRAME];
+  unsigned int len;
+  unsigned int expected;
+};
+
+/*
+ * An ACL link of the capture.
+ * The channels are identified by the cid of the frames received by the capturing host.
+ */
+struct link
+{
+  unsigned short handle;
+  int master; // 1: link to the master, 0: link to the slave, -1: unknown
+  struct
+  {
+    unsigned char ident;
+    unsigned char received;
+    unsigned short psm;
+    unsigned short scid;
+  } pending[REPLAY_MAX_PENDING];
+  unsigned int nb_pending;
+  struct
+  {
+    unsigned short cid;
+    unsigned short psm;
+    e_dir dir;
+  } cids[REPLAY_MAX_CIDS];
+  unsigned int nb_cids;
+  struct reassembly reassembly[2]; // 0: sent, 1: received
+};
+
+struct channel
+{
+  unsigned short psm;
+  int fds[DIR_MAX]; // far end of the input leg of each direction
+  struct
+  {
+    unsigned long long sent;
+    unsigned long long received;
+    unsigned long long bytes;
+    unsigned long long errors;
+  } stats[DIR_MAX];
+};
+
+static struct
+{
+  struct frame* frames;
+  unsigned int nb_frames;
+  unsigned int size;
+  unsigned long long skipped;
+
+  struct link* links;
+  unsigned int nb_links;
+  bdaddr_t master;
+  int has_master;
+
+  struct channel channels[REPLAY_MAX_CHANNELS];
+  unsigned int nb_channels;
+
+  int fast;
+  int efd;
+  pthread_t main;
+  pthread_t feeder;
+  pthread_t sink;
+  int started;
+  volatile int fed;
+  volatile int stop;
+  unsigned long long start;
+  unsigned long long end;
+} replay = { .efd = -1 };
+
+static unsigned long long get_time()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned short get_le16(const unsigned char* p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static inline unsigned int get_le32(const unsigned char* p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static inline unsigned int get_be32(const unsigned char* p)
+{
+  return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline unsigned long long get_be64(const unsigned char* p)
+{
+  return ((unsigned long long)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static struct link* get_link(unsigned short handle)
+{
+  struct link* l;
+  unsigned int i;
+
+  for(i=0; i<replay.nb_links; ++i)
+  {
+    if(replay.links[i].handle == handle)
+    {
+      return replay.links + i;
+    }
+  }
+
+  if(replay.nb_links == REPLAY_MAX_LINKS)
+  {
+    return NULL;
+  }
+
+  l = replay.links + replay.nb_links++;
+  memset(l, 0x00, sizeof(*l));
+  l->handle = handle;
+  l->master = -1;
+
+  return l;
+}
+
+static int add_frame(unsigned long long ts, unsigned short psm, e_dir dir, const unsigned char* buf, unsigned int len)
+{
+  struct frame* frames;
+  struct frame* f;
+
+  if(replay.nb_frames == replay.size)
+  {
+    replay.size = replay.size ? 2 * replay.size : 1024;
+    if(!(frames = realloc(replay.frames, replay.size * sizeof(*frames))))
+    {
+      perror("realloc");
+      return -1;
+    }
+    replay.frames = frames;
+  }
+
+  f = replay.frames + replay.nb_frames;
+
+  if(!(f->data = malloc(len)))
+  {
+    perror("malloc");
+    return -1;
+  }
+
+  memcpy(f->data, buf, len);
+  f->ts = ts;
+  f->psm = psm;
+  f->len = len;
+  f->dir = dir;
+
+  ++replay.nb_frames;
+
+  return 0;
+}
+
+static void on_signaling(struct link* l, int received, const unsigned char* buf, unsigned int len)
+{
+  unsigned short clen, dcid, scid, result;
+  unsigned char code, ident;
+  unsigned int i;
+  int master;
+
+  while(len >= 4)
+  {
+    code = buf[0];
+    ident = buf[1];
+    clen = get_le16(buf + 2);
+
+    if(clen > len - 4)
+    {
+      return;
+    }
+
+    if(code == L2CAP_CONN_REQ && clen >= 4 && l->nb_pending < REPLAY_MAX_PENDING)
+    {
+      l->pending[l->nb_pending].ident = ident;
+      l->pending[l->nb_pending].received = received;
+      l->pending[l->nb_pending].psm = get_le16(buf + 4);
+      l->pending[l->nb_pending].scid = get_le16(buf + 6);
+      ++l->nb_pending;
+    }
+    else if(code == L2CAP_CONN_RSP && clen >= 6)
+    {
+      dcid = get_le16(buf + 4);
+      scid = get_le16(buf + 6);
+      result = get_le16(buf + 8);
+
+      for(i=0; i<l->nb_pending; ++i)
+      {
+        if(l->pending[i].ident == ident && l->pending[i].received != received && l->pending[i].scid == scid)
+        {
+          break;
+        }
+      }
+
+      if(i < l->nb_pending && result != 0x0001) // not a pending response
+      {
+        if(!result && l->nb_cids < REPLAY_MAX_CIDS)
+        {
+          /*
+           * Unless the remote device is known, assume the proxy connects to the master,
+           * and the slave connects to the proxy.
+           */
+          master = (l->master >= 0) ? l->master : !l->pending[i].received;
+          l->cids[l->nb_cids].cid = l->pending[i].received ? dcid : scid;
+          l->cids[l->nb_cids].psm = l->pending[i].psm;
+          l->cids[l->nb_cids].dir = master ? DIR_MASTER_TO_SLAVE : DIR_SLAVE_TO_MASTER;
+          ++l->nb_cids;
+        }
+        l->pending[i] = l->pending[--l->nb_pending];
+      }
+    }
+
+    buf += 4 + clen;
+    len -= 4 + clen;
+  }
+}
+
+static int on_l2cap(struct link* l, int received, unsigned long long ts, const unsigned char* buf, unsigned int len)
+{
+  unsigned short cid = get_le16(buf + 2);
+  unsigned int i;
+
+  if(cid == L2CAP_SIGNALING_CID)
+  {
+    on_signaling(l, received, buf + 4, len - 4);
+    return 0;
+  }
+
+  if(!received)
+  {
+    return 0;
+  }
+
+  for(i=0; i<l->nb_cids; ++i)
+  {
+    if(l->cids[i].cid == cid)
+    {
+      return add_frame(ts, l->cids[i].psm, l->cids[i].dir, buf + 4, len - 4);
+    }
+  }
+
+  ++replay.skipped;
+
+  return 0;
+}
+
+static int on_acl(int received, unsigned long long ts, const unsigned char* buf, unsigned int len)
+{
+  unsigned short handle, dlen;
+  struct reassembly* r;
+  struct link* l;
+  unsigned int expected;
+
+  if(len < 4)
+  {
+    return 0;
+  }
+
+  handle = get_le16(buf) & 0x0fff;
+  dlen = get_le16(buf + 2);
+
+  if(dlen > len - 4 || !(l = get_link(handle)))
+  {
+    return 0;
+  }
+
+  r = l->reassembly + received;
+
+  if(((get_le16(buf) >> 12) & 0x03) != ACL_CONTINUATION)
+  {
+    if(dlen < 4)
+    {
+      return 0;
+    }
+    expected = get_le16(buf + 4) + 4;
+    if(expected > REPLAY_MAX_FRAME)
+    {
+      r->expected = 0;
+      ++replay.skipped;
+      return 0;
+    }
+    r->expected = expected;
+    r->len = 0;
+  }
+
+  if(!r->expected || r->len + dlen > r->expected)
+  {
+    r->expected = 0;
+    return 0;
+  }
+
+  memcpy(r->buf + r->len, buf + 4, dlen);
+  r->len += dlen;
+
+  if(r->len < r->expected)
+  {
+    return 0;
+  }
+
+  r->expected = 0;
+
+  return on_l2cap(l, received, ts, r->buf, r->len);
+}
+
+static void on_event(const unsigned char* buf, unsigned int len)
+{
+  struct link* l;
+
+  /*
+   * Connection complete: a new ACL link (or a reused handle).
+   */
+  if(len < 2 + 11 || buf[0] != EVT_CONN_COMPLETE || buf[2] || buf[11] != 0x01)
+  {
+    return;
+  }
+
+  if((l = get_link(get_le16(buf + 3) & 0x0fff)))
+  {
+    l->nb_pending = 0;
+    l->nb_cids = 0;
+    l->reassembly[0].expected = l->reassembly[1].expected = 0;
+    l->master = replay.has_master ? !memcmp(buf + 5, &replay.master, sizeof(replay.master)) : -1;
+  }
+}
+
+static int on_packet(unsigned char type, int received, unsigned long long ts, const unsigned char* buf, unsigned int len)
+{
+  switch(type)
+  {
+    case H4_ACL:
+      return on_acl(received, ts, buf, len);
+    case H4_EVENT:
+      on_event(buf, len);
+      break;
+  }
+  return 0;
+}
+
+static int parse_btsnoop(const unsigned char* buf, size_t size)
+{
+  unsigned int datalink, len, flags;
+  unsigned long long ts;
+  size_t offset = 16;
+  unsigned char type;
+
+  datalink = get_be32(buf + 12);
+
+  if(datalink != BTSNOOP_H1 && datalink != BTSNOOP_H4)
+  {
+    fprintf(stderr, "unsupported btsnoop datalink: %u\n", datalink);
+    return -1;
+  }
+
+  while(offset + 24 <= size)
+  {
+    len = get_be32(buf + offset + 4);
+    flags = get_be32(buf + offset + 8);
+    ts = (get_be64(buf + offset + 16) - BTSNOOP_EPOCH) * 1000;
+    offset += 24;
+
+    if(len > size - offset)
+    {
+      break;
+    }
+
+    if(datalink == BTSNOOP_H4)
+    {
+      if(len && on_packet(buf[offset], flags & 0x01, ts, buf + offset + 1, len - 1) < 0)
+      {
+        return -1;
+      }
+    }
+    else
+    {
+      type = (flags & 0x02) ? ((flags & 0x01) ? H4_EVENT : H4_COMMAND) : H4_ACL;
+      if(on_packet(type, flags & 0x01, ts, buf + offset, len) < 0)
+      {
+        return -1;
+      }
+    }
+
+    offset += len;
+  }
+
+  return 0;
+}
+
+static int parse_hcidump(const unsigned char* buf, size_t size)
+{
+  unsigned long long ts;
+  size_t offset = 0;
+  unsigned int len;
+  int received;
+
+  while(offset + 12 <= size)
+  {
+    len = get_le16(buf + offset);
+    received = !!buf[offset + 2];
+    ts = get_le32(buf + offset + 4) * 1000000000ULL + get_le32(buf + offset + 8) * 1000ULL;
+    offset += 12;
+
+    if(len > size - offset)
+    {
+      break;
+    }
+
+    if(len && on_packet(buf[offset], received, ts, buf + offset + 1, len - 1) < 0)
+    {
+      return -1;
+    }
+
+    offset += len;
+  }
+
+  return 0;
+}
+
+/*
+ * Load the frames of a capture.
+ *
+ * \param master  the bdaddr of the master (optional), used to tell the links apart
+ *
+ * \return the number of frames, or -1 in case of error
+ */
+int replay_open(const char* path, const char* master)
+{
+  unsigned char* buf;
+  unsigned int i;
+  long size;
+  FILE* fp;
+  int ret;
+
+  if(master)
+  {
+    str2ba(master, &replay.master);
+    replay.has_master = 1;
+  }
+
+  if(!(fp = fopen(path, "rb")))
+  {
+    perror("fopen");
+    return -1;
+  }
+
+  if(fseek(fp, 0, SEEK_END) < 0 || (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) < 0)
+  {
+    perror("fseek");
+    fclose(fp);
+    return -1;
+  }
+
+  if(!(buf = malloc(size ? size : 1)) || !(replay.links = calloc(REPLAY_MAX_LINKS, sizeof(*replay.links))))
+  {
+    perror("malloc");
+    free(buf);
+    fclose(fp);
+    return -1;
+  }
+
+  if(fread(buf, 1, size, fp) != size)
+  {
+    perror("fread");
+    ret = -1;
+  }
+  else if(size >= 16 && !memcmp(buf, "btsnoop\0", 8))
+  {
+    ret = parse_btsnoop(buf, size);
+  }
+  else
+  {
+    ret = parse_hcidump(buf, size);
+  }
+
+  free(buf);
+  fclose(fp);
+  free(replay.links);
+  replay.links = NULL;
+  replay.nb_links = 0;
+
+  if(ret < 0)
+  {
+    return -1;
+  }
+
+  for(i=replay.nb_frames; i>0; --i)
+  {
+    replay.frames[i-1].ts -= replay.frames[0].ts;
+  }
+
+  printf("replay: %u frames loaded from %s (%llu skipped)\n", replay.nb_frames, path, replay.skipped);
+
+  return replay.nb_frames;
+}
+
+static struct channel* get_channel(unsigned short psm)
+{
+  unsigned int i;
+
+  for(i=0; i<replay.nb_channels; ++i)
+  {
+    if(replay.channels[i].psm == psm)
+    {
+      return replay.channels + i;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Create the legs of a channel, if the capture holds frames for its PSM.
+ * The proxy ends of the legs are non-blocking.
+ *
+ * \return 1 if the legs were created, 0 if there's no frame for this PSM, -1 in case of error
+ */
+int replay_add_channel(unsigned short psm, int* slave_fd, int* master_fd)
+{
+  struct channel* ch;
+  int s[2], m[2];
+  unsigned int i;
+
+  for(i=0; i<replay.nb_frames && replay.frames[i].psm != psm; ++i);
+
+  if(i == replay.nb_frames)
+  {
+    return 0;
+  }
+
+  if(replay.nb_channels == REPLAY_MAX_CHANNELS)
+  {
+    fprintf(stderr, "too many replayed channels\n");
+    return -1;
+  }
+
+  if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, s) < 0)
+  {
+    perror("socketpair");
+    return -1;
+  }
+
+  if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, m) < 0)
+  {
+    perror("socketpair");
+    close(s[0]);
+    close(s[1]);
+    return -1;
+  }
+
+  if(fcntl(s[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(m[0], F_SETFL, O_NONBLOCK) < 0)
+  {
+    perror("fcntl");
+    close(s[0]);
+    close(s[1]);
+    close(m[0]);
+    close(m[1]);
+    return -1;
+  }
+
+  ch = replay.channels + replay.nb_channels++;
+  memset(ch, 0x00, sizeof(*ch));
+  ch->psm = psm;
+  ch->fds[DIR_SLAVE_TO_MASTER] = s[1];
+  ch->fds[DIR_MASTER_TO_SLAVE] = m[1];
+
+  *slave_fd = s[0];
+  *master_fd = m[0];
+
+  return 1;
+}
+
+static void* feed(void* arg)
+{
+  unsigned long long deadline, now;
+  struct timespec ts;
+  struct channel* ch;
+  struct frame* f;
+  unsigned int i;
+
+  replay.start = get_time();
+
+  for(i=0; i<replay.nb_frames && !replay.stop; ++i)
+  {
+    f = replay.frames + i;
+
+    if(!(ch = get_channel(f->psm)))
+    {
+      continue;
+    }
+
+    /*
+     * Sleep by steps, so that the replay can be stopped at any time.
+     */
+    deadline = replay.start + f->ts;
+    while(!replay.fast && !replay.stop && (now = get_time()) < deadline)
+    {
+      now = (deadline - now > REPLAY_POLL_PERIOD * 1000000ULL) ? now + REPLAY_POLL_PERIOD * 1000000ULL : deadline;
+      ts.tv_sec = now / 1000000000ULL;
+      ts.tv_nsec = now % 1000000000ULL;
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+
+    if(send(ch->fds[f->dir], f->data, f->len, MSG_NOSIGNAL) != f->len)
+    {
+      ++ch->stats[f->dir].errors;
+      continue;
+    }
+
+    ++ch->stats[f->dir].sent;
+  }
+
+  __atomic_store_n(&replay.fed, 1, __ATOMIC_RELEASE);
+
+  return NULL;
+}
+
+static int all_received()
+{
+  unsigned int i;
+  int dir;
+
+  for(i=0; i<replay.nb_channels; ++i)
+  {
+    for(dir=0; dir<DIR_MAX; ++dir)
+    {
+      if(replay.channels[i].stats[dir].received < replay.channels[i].stats[dir].sent)
+      {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+static void* sink(void* arg)
+{
+  struct epoll_event events[REPLAY_MAX_CHANNELS * DIR_MAX];
+  unsigned char buf[REPLAY_MAX_FRAME];
+  unsigned long long now, last = get_time();
+  struct channel* ch;
+  int i, nfds, dir, fd;
+  ssize_t len;
+
+  while(!replay.stop)
+  {
+    nfds = epoll_wait(replay.efd, events, sizeof(events) / sizeof(*events), REPLAY_POLL_PERIOD);
+
+    now = get_time();
+
+    for(i=0; i<nfds; ++i)
+    {
+      ch = replay.channels + events[i].data.u32 / DIR_MAX;
+      /*
+       * The frames of a direction come out of the input leg of the other direction.
+       */
+      fd = ch->fds[events[i].data.u32 % DIR_MAX];
+      dir = DIR_MAX - 1 - events[i].data.u32 % DIR_MAX;
+
+      while((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+      {
+        ++ch->stats[dir].received;
+        ch->stats[dir].bytes += len;
+        last = now;
+      }
+
+      if(!len || (len < 0 && errno != EAGAIN))
+      {
+        epoll_ctl(replay.efd, EPOLL_CTL_DEL, fd, NULL);
+      }
+    }
+
+    if(__atomic_load_n(&replay.fed, __ATOMIC_ACQUIRE) && (all_received() || now - last > REPLAY_IDLE_TIMEOUT))
+    {
+      break;
+    }
+  }
+
+  replay.end = last;
+
+  if(!replay.stop)
+  {
+    pthread_kill(replay.main, SIGINT);
+  }
+
+  return NULL;
+}
+
+/*
+ * Start feeding the frames.
+ * The calling thread gets SIGINT once the replay is over.
+ *
+ * \param fast  0: keep the recorded timing, 1: feed the frames as fast as possible
+ *
+ * \return 0 if successful, -1 otherwise
+ */
+int replay_start(int fast)
+{
+  struct epoll_event ev = { .events = EPOLLIN };
+  sigset_t mask, old;
+  unsigned int i;
+  int dir, ret = 0;
+
+  replay.fast = fast;
+  replay.main = pthread_self();
+
+  if((replay.efd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+  {
+    perror("epoll_create1");
+    return -1;
+  }
+
+  for(i=0; i<replay.nb_channels; ++i)
+  {
+    for(dir=0; dir<DIR_MAX; ++dir)
+    {
+      ev.data.u32 = i * DIR_MAX + dir;
+      if(epoll_ctl(replay.efd, EPOLL_CTL_ADD, replay.channels[i].fds[dir], &ev) < 0)
+      {
+        perror("epoll_ctl EPOLL_CTL_ADD");
+        return -1;
+      }
+    }
+  }
+
+  /*
+   * Signals are handled by the calling thread.
+   */
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+  if(pthread_create(&replay.sink, NULL, sink, NULL))
+  {
+    fprintf(stderr, "can't create the replay sink thread\n");
+    ret = -1;
+  }
+  else if(pthread_create(&replay.feeder, NULL, feed, NULL))
+  {
+    fprintf(stderr, "can't create the replay feeder thread\n");
+    replay.stop = 1;
+    pthread_join(replay.sink, NULL);
+    ret = -1;
+  }
+  else
+  {
+    replay.started = 1;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  return ret;
+}
+
+/*
+ * Stop the replay, and print its report.
+ * The proxy ends of the legs should be closed before.
+ */
+void replay_stop()
+{
+  unsigned long long received = 0, bytes = 0;
+  struct channel* ch;
+  double elapsed;
+  unsigned int i;
+  int dir;
+
+  if(replay.started)
+  {
+    replay.stop = 1;
+    pthread_join(replay.feeder, NULL);
+    pthread_join(replay.sink, NULL);
+    replay.started = 0;
+
+    elapsed = (replay.end > replay.start) ? (replay.end - replay.start) / 1e9 : 0;
+
+    for(i=0; i<replay.nb_channels; ++i)
+    {
+      ch = replay.channels + i;
+      for(dir=0; dir<DIR_MAX; ++dir)
+      {
+        if(!ch->stats[dir].sent)
+        {
+          continue;
+        }
+        printf("replay %s (psm: 0x%04x): %llu sent, %llu received, %llu dropped or coalesced, %llu write errors\n",
+            dir_name[dir], ch->psm, ch->stats[dir].sent, ch->stats[dir].received,
+            ch->stats[dir].sent - ch->stats[dir].received, ch->stats[dir].errors);
+        received += ch->stats[dir].received;
+        bytes += ch->stats[dir].bytes;
+      }
+    }
+
+    printf("replay: %llu frames (%llu bytes) in %.3f s", received, bytes, elapsed);
+    if(elapsed > 0)
+    {
+      printf(" (%.0f frames/s, %.1f kB/s)", received / elapsed, bytes / elapsed / 1000);
+    }
+    printf("\n");
+  }
+
+  for(i=0; i<replay.nb_channels; ++i)
+  {
+    for(dir=0; dir<DIR_MAX; ++dir)
+    {
+      close(replay.channels[i].fds[dir]);
+    }
+  }
+  replay.nb_channels = 0;
+
+  if(replay.efd >= 0)
+  {
+    close(replay.efd);
+    replay.efd = -1;
+  }
+
+  for(i=0; i<replay.nb_frames; ++i)
+  {
+    free(replay.frames[i].data);
+  }
+  free(replay.frames);
+  replay.frames = NULL;
+  replay.nb_frames = replay.size = 0;
+}
@@ -0,0 +1,17 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+int replay_open(const char* path, const char* master);
+
+int replay_add_channel(unsigned short psm, int* slave_fd, int* master_fd);
+
+int replay_start(int fast);
+
+void replay_stop();
+
+#endif
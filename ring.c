@@ -0,0 +1,44 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+
+/*
+ * \param nb_slots   the number of slots, rounded up to a power of 2
+ * \param slot_size  the size of a slot, rounded up to a multiple of the cache line size
+ *
+ * \return 0 if successful, -1 otherwise
+ */
+int ring_init(struct ring* r, unsigned int nb_slots, size_t slot_size)
+{
+  unsigned int size = 1;
+
+  while(size < nb_slots)
+  {
+    size <<= 1;
+  }
+
+  memset(r, 0x00, sizeof(*r));
+
+  r->slot_size = (slot_size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+  r->mask = size - 1;
+
+  if(posix_memalign((void**)&r->slots, CACHE_LINE_SIZE, size * r->slot_size))
+  {
+    fprintf(stderr, "can't allocate ring\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+void ring_free(struct ring* r)
+{
+  free(r->slots);
+  r->slots = NULL;
+}
@@ -0,0 +1,91 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef RING_H_
+#define RING_H_
+
+#include <stddef.h>
+
+#define CACHE_LINE_SIZE 64
+
+/*
+ * A lock-free single-producer/single-consumer ring of preallocated fixed-size slots.
+ *
+ * The producer reserves a slot, fills it, and commits it.
+ * The consumer peeks the oldest committed slot, processes it, and releases it.
+ * The indexes are on separate cache lines, and each side caches the index of the other side,
+ * so that the shared lines are only touched when the cached value says the ring is full/empty.
+ */
+struct ring
+{
+  unsigned char* slots;
+  size_t slot_size;
+  unsigned int mask;
+
+  unsigned int tail __attribute__((aligned(CACHE_LINE_SIZE))); // written by the producer
+  unsigned int cached_head;
+
+  unsigned int head __attribute__((aligned(CACHE_LINE_SIZE))); // written by the consumer
+  unsigned int cached_tail;
+};
+
+int ring_init(struct ring* r, unsigned int nb_slots, size_t slot_size);
+
+void ring_free(struct ring* r);
+
+static inline void* ring_slot(struct ring* r, unsigned int index)
+{
+  return r->slots + (index & r->mask) * r->slot_size;
+}
+
+/*
+ * Producer side: get the next free slot, or NULL if the ring is full.
+ */
+static inline void* ring_reserve(struct ring* r)
+{
+  if(r->tail - r->cached_head > r->mask)
+  {
+    r->cached_head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if(r->tail - r->cached_head > r->mask)
+    {
+      return NULL;
+    }
+  }
+  return ring_slot(r, r->tail);
+}
+
+/*
+ * Producer side: publish the slot returned by ring_reserve().
+ */
+static inline void ring_commit(struct ring* r)
+{
+  __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Consumer side: get the oldest committed slot, or NULL if the ring is empty.
+ */
+static inline void* ring_peek(struct ring* r)
+{
+  if(r->cached_tail == r->head)
+  {
+    r->cached_tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if(r->cached_tail == r->head)
+    {
+      return NULL;
+    }
+  }
+  return ring_slot(r, r->head);
+}
+
+/*
+ * Consumer side: give the slot returned by ring_peek() back to the producer.
+ */
+static inline void ring_release(struct ring* r)
+{
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -3,12 +3,19 @@
  License: GPLv3
  */
 
+#define _GNU_SOURCE
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/sco.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
 #include "bt_utils.h"
+#include "sco_con.h"
+#include "trace.h"
 
 #ifdef BT_POWER
 #warning "BT_POWER is already defined."
@@ -22,47 +29,74 @@ struct bt_power {
 };
 #endif
 
-int sco_listen(unsigned short psm)
+/*
+ * SCO sockets are non-blocking, like the L2CAP legs of the proxy.
+ * A listening socket defers the setup of the incoming links:
+ * an accepted link is only established once sco_authorize() is called,
+ * so that the proxy can first connect the other side.
+ */
+
+int sco_listen(const char* bdaddr_src)
 {
   struct sockaddr_sco loc_addr = { 0 };
+  int defer_setup = 1;
   int s;
 
   // allocate socket
-  if((s = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_SCO)) < 0)
+  if((s = socket(AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_CLOEXEC, BTPROTO_SCO)) < 0)
   {
     perror("socket");
-    exit(-1);
+    return -1;
   }
 
   loc_addr.sco_family = AF_BLUETOOTH;
-  loc_addr.sco_bdaddr = *BDADDR_ANY;
+  if(bdaddr_src)
+  {
+    str2ba(bdaddr_src, &loc_addr.sco_bdaddr);
+  }
+  else
+  {
+    loc_addr.sco_bdaddr = *BDADDR_ANY;
+  }
 
   if(bind(s, (struct sockaddr *) &loc_addr, sizeof(loc_addr)) < 0)
   {
     perror("bind");
-    exit(-1);
+    close(s);
+    return -1;
   }
 
-  int defer_setup = 1;
   if(setsockopt(s, SOL_BLUETOOTH, BT_DEFER_SETUP, &defer_setup, sizeof(defer_setup)) < 0)
   {
     perror("setsockopt BT_DEFER_SETUP");
-    exit(-1);
+    close(s);
+    return -1;
   }
 
   // put socket into listening mode
   if(listen(s, 10) < 0)
   {
     perror("listen");
-    exit(-1);
+    close(s);
+    return -1;
   }
 
-  printf("listening on psm: 0x%04x\n", psm);
+  printf("listening on SCO\n");
 
   return s;
 }
 
-int sco_accept(int s)
+static void set_power(int fd)
+{
+  //TODO: Is this needed?
+  struct bt_power pwr = {.force_active = BT_POWER_FORCE_ACTIVE_OFF};
+  if (setsockopt(fd, SOL_BLUETOOTH, BT_POWER, &pwr, sizeof(pwr)) < 0)
+  {
+    trace_printf("setsockopt BT_POWER: %s\n", strerror(errno));
+  }
+}
+
+int sco_accept(int s, bdaddr_t* src)
 {
   struct sockaddr_sco rem_addr = { 0 };
   int client;
@@ -70,34 +104,34 @@ int sco_accept(int s)
   socklen_t opt = sizeof(rem_addr);
 
   // accept one connection
-  if((client = accept(s, (struct sockaddr *) &rem_addr, &opt)) < 0)
+  if((client = accept4(s, (struct sockaddr *) &rem_addr, &opt, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
   {
-    perror("accept");
-    exit(-1);
+    trace_printf("accept: %s\n", strerror(errno));
+    return -1;
   }
 
   ba2str(&rem_addr.sco_bdaddr, buf);
-  printf("accepted connection from %s (SCO)\n", buf);
+  trace_printf("accepted connection from %s (SCO)\n", buf);
 
-  //TODO: Is this needed?
-  struct bt_power pwr = {.force_active = BT_POWER_FORCE_ACTIVE_OFF};
-  if (setsockopt(client, SOL_BLUETOOTH, BT_POWER, &pwr, sizeof(pwr)) < 0)
-  {
-    perror("setsockopt BT_POWER");
-  }
+  set_power(client);
+
+  bacpy(src, &rem_addr.sco_bdaddr);
 
   return client;
 }
 
+/*
+ * Start a non-blocking connection: the socket becomes writable once the link is established.
+ */
 int sco_connect(const char *bdaddr_src, const char *bdaddr_dest)
 {
   int fd;
   struct sockaddr_sco addr;
 
-  if ((fd = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_SCO)) < 0)
+  if ((fd = socket(PF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, BTPROTO_SCO)) < 0)
   {
-    perror("socket");
-    exit(-1);
+    trace_printf("socket: %s\n", strerror(errno));
+    return -1;
   }
 
   if(bdaddr_src)
@@ -107,28 +141,39 @@ int sco_connect(const char *bdaddr_src, const char *bdaddr_dest)
     str2ba(bdaddr_src, &addr.sco_bdaddr);
     if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
     {
-      perror("bind\n");
-      exit(-1);
+      trace_printf("bind: %s\n", strerror(errno));
+      close(fd);
+      return -1;
     }
   }
 
+  set_power(fd);
+
   memset(&addr, 0, sizeof(addr));
   addr.sco_family = AF_BLUETOOTH;
   str2ba(bdaddr_dest, &addr.sco_bdaddr);
-  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
   {
-    perror("connect");
-    exit(-1);
+    trace_printf("connect: %s\n", strerror(errno));
+    close(fd);
+    return -1;
   }
-  
-  printf("connected to %s (SCO)\n", bdaddr_dest);
 
-  //TODO: Is this needed?
-  struct bt_power pwr = {.force_active = BT_POWER_FORCE_ACTIVE_OFF};
-  if (setsockopt(fd, SOL_BLUETOOTH, BT_POWER, &pwr, sizeof(pwr)) < 0)
+  return fd;
+}
+
+/*
+ * Accept a deferred link: the first read on the socket lets the kernel answer the connection request.
+ */
+int sco_authorize(int fd)
+{
+  unsigned char c;
+
+  if(recv(fd, &c, sizeof(c), MSG_DONTWAIT) < 0 && errno != EAGAIN)
   {
-    perror("setsockopt BT_POWER");
+    trace_printf("recv: %s\n", strerror(errno));
+    return -1;
   }
-  
-  return fd;
+
+  return 0;
 }
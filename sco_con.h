@@ -6,14 +6,14 @@
 #ifndef SCO_CON_H_
 #define SCO_CON_H_
 
-int sco_connect(const char*, const char*, int);
+#include <bluetooth/bluetooth.h>
 
-int sco_send(int, const unsigned char*, int, int);
+int sco_listen(const char* bdaddr_src);
 
-int sco_recv(int, unsigned char*, int);
+int sco_accept(int s, bdaddr_t* src);
 
-int sco_listen(int);
+int sco_connect(const char* bdaddr_src, const char* bdaddr_dst);
 
-int sco_accept(int);
+int sco_authorize(int fd);
 
 #endif
@@ -0,0 +1,419 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "hash.h"
+#include "sdp.h"
+#include "trace.h"
+
+/*
+ * The SDP records of a device don't change, so the responses to its SDP requests can be replayed.
+ * A response is stored with the bdaddr of the device that sent it and the request without its transaction ID.
+ * It is sent back with the transaction ID of the new request.
+ *
+ * The cache file holds a line per response: <bdaddr> <request> <response>, in hexadecimal.
+ * The responses are appended as they are learned, the last one of a request wins when loading.
+ *
+ * The cache belongs to the thread that opened it: each event loop of the sharded mode loads the file,
+ * and appends the responses it learns with a single write per line, so that the lines of the loops don't mix.
+ * The entries are allocated when the file is loaded, with room for SDP_CACHE_SPARE more responses,
+ * and the lines are written by the trace thread (see trace_call()): learning a response doesn't allocate or write.
+ */
+
+#define SDP_ERROR_RSP 0x01
+#define SDP_SERVICE_SEARCH_REQ 0x02
+#define SDP_SERVICE_ATTR_REQ 0x04
+#define SDP_SERVICE_SEARCH_ATTR_REQ 0x06
+
+#define SDP_HEADER_SIZE 5 // PDU ID, transaction ID, parameter length
+
+/*
+ * The number of responses that can be learned, beyond the ones of the file.
+ */
+#define SDP_CACHE_SPARE 64
+
+#define SDP_LINE_SIZE (sizeof("00:00:00:00:00:00") + 2 * (1 + 2 * SDP_MAX_PDU) + 1)
+
+struct sdp_entry
+{
+  char bdaddr[sizeof("00:00:00:00:00:00")];
+  int req_len; // without the transaction ID
+  int rsp_len;
+  int used;    // in the table
+  int writing; // the trace thread appends it to the file
+  FILE* file;
+  unsigned char data[2 * SDP_MAX_PDU]; // request, then response
+};
+
+static __thread struct
+{
+  struct hash entries;
+  struct sdp_entry* pool;
+  unsigned int nb_entries;
+  FILE* file;
+  char line[SDP_LINE_SIZE]; // the buffer of the file, flushed after each line
+  struct
+  {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long learned;
+  } stats;
+} cache;
+
+static int is_pdu(const unsigned char* buf, int len)
+{
+  return len >= SDP_HEADER_SIZE && len <= SDP_MAX_PDU && (buf[3] << 8 | buf[4]) == len - SDP_HEADER_SIZE;
+}
+
+static int is_request(const unsigned char* buf, int len)
+{
+  return is_pdu(buf, len)
+      && (buf[0] == SDP_SERVICE_SEARCH_REQ || buf[0] == SDP_SERVICE_ATTR_REQ || buf[0] == SDP_SERVICE_SEARCH_ATTR_REQ);
+}
+
+/*
+ * FNV-1a, over the bdaddr and the request without its transaction ID.
+ */
+static uint64_t entry_key(const char* bdaddr, const unsigned char* req, int len)
+{
+  uint64_t key = 0xcbf29ce484222325ULL;
+  int i;
+
+  for(; *bdaddr; ++bdaddr)
+  {
+    key = (key ^ (unsigned char)*bdaddr) * 0x100000001b3ULL;
+  }
+  key = (key ^ req[0]) * 0x100000001b3ULL;
+  for(i = 3; i < len; ++i)
+  {
+    key = (key ^ req[i]) * 0x100000001b3ULL;
+  }
+
+  return key;
+}
+
+static struct sdp_entry* lookup(const char* bdaddr, const unsigned char* req, int len)
+{
+  struct sdp_entry* e;
+
+  if(!(e = hash_get(&cache.entries, entry_key(bdaddr, req, len))))
+  {
+    return NULL;
+  }
+
+  /*
+   * Another request with the same key is a miss.
+   */
+  if(strcmp(e->bdaddr, bdaddr) || e->req_len != len - 2 || e->data[0] != req[0]
+      || memcmp(e->data + 1, req + 3, len - 3))
+  {
+    return NULL;
+  }
+
+  return e;
+}
+
+/*
+ * Get an entry that is neither in the table nor being written.
+ */
+static struct sdp_entry* get_entry()
+{
+  struct sdp_entry* e;
+
+  for(e = cache.pool; e < cache.pool + cache.nb_entries; ++e)
+  {
+    if(!e->used && !__atomic_load_n(&e->writing, __ATOMIC_ACQUIRE))
+    {
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+static struct sdp_entry* store(const char* bdaddr, const unsigned char* req, int req_len, const unsigned char* rsp,
+    int rsp_len)
+{
+  struct sdp_entry* e;
+  struct sdp_entry* old;
+  uint64_t key;
+
+  if(!(e = get_entry()))
+  {
+    return NULL;
+  }
+
+  snprintf(e->bdaddr, sizeof(e->bdaddr), "%s", bdaddr);
+  e->req_len = req_len - 2;
+  e->rsp_len = rsp_len;
+  e->data[0] = req[0];
+  memcpy(e->data + 1, req + 3, req_len - 3);
+  memcpy(e->data + e->req_len, rsp, rsp_len);
+
+  /*
+   * Replace the entry with the same key, if any.
+   */
+  key = entry_key(bdaddr, req, req_len);
+  old = hash_get(&cache.entries, key);
+
+  /*
+   * The table has room for all the entries: this doesn't allocate.
+   */
+  if(hash_put(&cache.entries, key, e) < 0)
+  {
+    return NULL;
+  }
+
+  e->used = 1;
+  if(old)
+  {
+    old->used = 0;
+  }
+
+  return e;
+}
+
+static void write_hex(FILE* file, const unsigned char* buf, int len)
+{
+  int i;
+
+  for(i = 0; i < len; ++i)
+  {
+    fprintf(file, "%02x", buf[i]);
+  }
+}
+
+/*
+ * Trace thread: append the line of an entry.
+ * The request is written with the transaction ID of the response.
+ */
+static void append(void* arg)
+{
+  struct sdp_entry* e = arg;
+  const unsigned char* rsp = e->data + e->req_len;
+
+  fputs(e->bdaddr, e->file);
+  fputc(' ', e->file);
+  write_hex(e->file, e->data, 1);
+  write_hex(e->file, rsp + 1, 2);
+  write_hex(e->file, e->data + 1, e->req_len - 1);
+  fputc(' ', e->file);
+  write_hex(e->file, rsp, e->rsp_len);
+  fputc('\n', e->file);
+  fflush(e->file);
+
+  __atomic_store_n(&e->writing, 0, __ATOMIC_RELEASE);
+}
+
+static int read_hex(const char* str, unsigned char* buf, int size)
+{
+  int len = 0;
+
+  for(; str[0] && str[1] && len < size; str += 2)
+  {
+    if(sscanf(str, "%2hhx", buf + len++) != 1)
+    {
+      return -1;
+    }
+  }
+
+  return *str ? -1 : len;
+}
+
+static void load(FILE* file)
+{
+  char bdaddr[sizeof("00:00:00:00:00:00")];
+  char req_hex[2 * SDP_MAX_PDU + 1];
+  char rsp_hex[2 * SDP_MAX_PDU + 1];
+  unsigned char req[SDP_MAX_PDU];
+  unsigned char rsp[SDP_MAX_PDU];
+  int req_len, rsp_len;
+
+  while(fscanf(file, "%17s %2048s %2048s", bdaddr, req_hex, rsp_hex) == 3)
+  {
+    req_len = read_hex(req_hex, req, sizeof(req));
+    rsp_len = read_hex(rsp_hex, rsp, sizeof(rsp));
+    if(!is_request(req, req_len) || !is_pdu(rsp, rsp_len))
+    {
+      fprintf(stderr, "invalid sdp cache entry for %s\n", bdaddr);
+      continue;
+    }
+    store(bdaddr, req, req_len, rsp, rsp_len);
+  }
+}
+
+/*
+ * Load the responses of a cache file, and append the responses learned from now on.
+ */
+int sdp_cache_open(const char* path)
+{
+  unsigned int lines = 0;
+  FILE* file;
+  int c;
+
+  if((file = fopen(path, "r")))
+  {
+    while((c = getc(file)) != EOF)
+    {
+      lines += (c == '\n');
+    }
+    rewind(file);
+  }
+
+  /*
+   * The table is kept below its maximum load, so that it never grows.
+   */
+  cache.nb_entries = lines + SDP_CACHE_SPARE;
+  if(!(cache.pool = calloc(cache.nb_entries, sizeof(*cache.pool)))
+      || hash_init(&cache.entries, 2 * cache.nb_entries) < 0)
+  {
+    perror("calloc");
+    free(cache.pool);
+    cache.pool = NULL;
+    if(file)
+    {
+      fclose(file);
+    }
+    return -1;
+  }
+
+  if(file)
+  {
+    load(file);
+    fclose(file);
+  }
+
+  if(!(cache.file = fopen(path, "a")))
+  {
+    perror("fopen");
+    hash_free(&cache.entries);
+    free(cache.pool);
+    cache.pool = NULL;
+    return -1;
+  }
+
+  setvbuf(cache.file, cache.line, _IOFBF, sizeof(cache.line));
+
+  printf("sdp cache: %u responses loaded from %s\n", cache.entries.count, path);
+
+  return 0;
+}
+
+/*
+ * Answer an SDP request sent to a device, if the response of the device is known.
+ *
+ * \return the length of the response, -1 if the request has to be relayed
+ */
+int sdp_cache_answer(const char* bdaddr, const unsigned char* req, int len, unsigned char* rsp, int size)
+{
+  struct sdp_entry* e;
+
+  if(!cache.file || !is_request(req, len))
+  {
+    return -1;
+  }
+
+  if(!(e = lookup(bdaddr, req, len)) || e->rsp_len > size)
+  {
+    ++cache.stats.misses;
+    return -1;
+  }
+
+  ++cache.stats.hits;
+
+  memcpy(rsp, e->data + e->req_len, e->rsp_len);
+  rsp[1] = req[1];
+  rsp[2] = req[2];
+
+  return e->rsp_len;
+}
+
+/*
+ * Track an SDP PDU relayed from one side of a channel (0 or 1) to the other.
+ * A request is kept until the other side answers it, then the response is learned.
+ *
+ * \param bdaddr  the device that sent the PDU
+ */
+void sdp_track(struct sdp_transactions* t, int from, const char* bdaddr, const unsigned char* buf, int len)
+{
+  const unsigned char* req = t->requests[!from].buf;
+  int req_len = t->requests[!from].len;
+  struct sdp_entry* e;
+
+  if(is_request(buf, len))
+  {
+    memcpy(t->requests[from].buf, buf, len);
+    t->requests[from].len = len;
+    return;
+  }
+
+  if(!req_len || !is_pdu(buf, len) || buf[1] != req[1] || buf[2] != req[2])
+  {
+    return;
+  }
+
+  t->requests[!from].len = 0;
+
+  /*
+   * Error responses aren't cached: the next request will be relayed again.
+   */
+  if(buf[0] == SDP_ERROR_RSP || buf[0] != req[0] + 1)
+  {
+    return;
+  }
+
+  if(!cache.file || !(e = store(bdaddr, req, req_len, buf, len)))
+  {
+    return;
+  }
+
+  ++cache.stats.learned;
+
+  /*
+   * If the trace ring is full, the response is only known until the proxy stops.
+   */
+  e->file = cache.file;
+  __atomic_store_n(&e->writing, 1, __ATOMIC_RELAXED);
+  if(trace_call(append, e) < 0)
+  {
+    __atomic_store_n(&e->writing, 0, __ATOMIC_RELAXED);
+  }
+}
+
+void sdp_cache_close()
+{
+  struct timespec period = { 0, 1000000 };
+  unsigned int i;
+
+  if(!cache.file)
+  {
+    return;
+  }
+
+  /*
+   * Wait for the trace thread to append the last responses.
+   */
+  for(i = 0; i < cache.nb_entries; ++i)
+  {
+    while(__atomic_load_n(&cache.pool[i].writing, __ATOMIC_ACQUIRE))
+    {
+      nanosleep(&period, NULL);
+    }
+  }
+
+  printf("sdp cache: %u responses, %llu hits, %llu misses, %llu learned\n", cache.entries.count,
+      cache.stats.hits, cache.stats.misses, cache.stats.learned);
+
+  fclose(cache.file);
+  cache.file = NULL;
+
+  hash_free(&cache.entries);
+  free(cache.pool);
+  cache.pool = NULL;
+}
@@ -0,0 +1,32 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef SDP_H_
+#define SDP_H_
+
+#define SDP_MAX_PDU 1024
+
+/*
+ * The pending request of each side of an SDP channel.
+ * An SDP client waits for the response to a request before it sends the next one.
+ */
+struct sdp_transactions
+{
+  struct
+  {
+    int len; // 0 if there is no pending request
+    unsigned char buf[SDP_MAX_PDU];
+  } requests[2];
+};
+
+int sdp_cache_open(const char* path);
+
+int sdp_cache_answer(const char* bdaddr, const unsigned char* req, int len, unsigned char* rsp, int size);
+
+void sdp_track(struct sdp_transactions* t, int from, const char* bdaddr, const unsigned char* buf, int len);
+
+void sdp_cache_close();
+
+#endif
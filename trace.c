@@ -0,0 +1,380 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include "trace.h"
+
+/*
+ * Long enough for a status line, such as the percentiles of a histogram.
+ */
+#define TRACE_DATA_SIZE 160
+
+/*
+ * The writer thread polls the ring at this period (ns) when it is empty.
+ */
+#define TRACE_POLL_PERIOD 10000000
+
+typedef enum
+{
+  TRACE_PACKET,
+  TRACE_MESSAGE,
+  TRACE_CALL,
+} e_trace_type;
+
+/*
+ * A fixed-size binary record.
+ * A packet record holds the beginning of the payload, a message record holds the text,
+ * and a call record the function to call on the writer thread.
+ */
+struct trace_record
+{
+  unsigned int seq;
+  unsigned char type;
+  unsigned short psm;
+  unsigned short len;
+  const char* tag;
+  unsigned long long ts;
+  union
+  {
+    unsigned char data[TRACE_DATA_SIZE];
+    struct
+    {
+      void (*fn)(void*);
+      void* arg;
+    } call;
+  };
+} __attribute__((aligned(64)));
+
+/*
+ * A bounded multi-producer/single-consumer ring of records.
+ * The sequence number of a slot tells if it is free, or if it holds a record ready to be written.
+ * A producer never waits: if the ring is full, the record is dropped and counted.
+ */
+static struct
+{
+  struct trace_record* records;
+  unsigned int mask;
+  pthread_t thread;
+  volatile int done;
+  unsigned long long start;
+
+  unsigned int enqueue __attribute__((aligned(64)));
+  unsigned long long dropped;
+
+  unsigned int dequeue __attribute__((aligned(64)));
+  unsigned long long written;
+} trace;
+
+static unsigned long long get_time()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct trace_record* reserve(unsigned int* pos)
+{
+  struct trace_record* rec;
+  int diff;
+
+  *pos = __atomic_load_n(&trace.enqueue, __ATOMIC_RELAXED);
+
+  for(;;)
+  {
+    rec = trace.records + (*pos & trace.mask);
+    diff = (int)(__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) - *pos);
+    if(!diff)
+    {
+      if(__atomic_compare_exchange_n(&trace.enqueue, pos, *pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+        return rec;
+      }
+    }
+    else if(diff < 0)
+    {
+      __atomic_fetch_add(&trace.dropped, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+    else
+    {
+      *pos = __atomic_load_n(&trace.enqueue, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void commit(struct trace_record* rec, unsigned int pos)
+{
+  __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Trace a packet: its length and the beginning of its payload.
+ *
+ * \param tag  a string that lives as long as the program (e.g. the direction)
+ */
+void trace_packet(const char* tag, unsigned short psm, const unsigned char* buf, int len)
+{
+  struct trace_record* rec;
+  unsigned int pos;
+
+  if(!trace.records || !(rec = reserve(&pos)))
+  {
+    return;
+  }
+
+  rec->type = TRACE_PACKET;
+  rec->tag = tag;
+  rec->psm = psm;
+  rec->len = len;
+  rec->ts = get_time();
+  memcpy(rec->data, buf, len < TRACE_DATA_SIZE ? len : TRACE_DATA_SIZE);
+
+  commit(rec, pos);
+}
+
+/*
+ * Trace a message.
+ * It is formatted in the calling thread (this doesn't involve any system call),
+ * and truncated to TRACE_DATA_SIZE - 1 characters.
+ * If the trace isn't started, the message is printed to stdout.
+ */
+void trace_printf(const char* format, ...)
+{
+  struct trace_record* rec;
+  unsigned int pos;
+  va_list args;
+
+  va_start(args, format);
+
+  if(!trace.records)
+  {
+    vprintf(format, args);
+  }
+  else if((rec = reserve(&pos)))
+  {
+    rec->type = TRACE_MESSAGE;
+    rec->ts = get_time();
+    vsnprintf((char*)rec->data, TRACE_DATA_SIZE, format, args);
+    commit(rec, pos);
+  }
+
+  va_end(args);
+}
+
+/*
+ * Run a function on the writer thread, after the records traced before.
+ * This is for the writes that shouldn't block the calling thread, such as the appends to a file.
+ * If the trace isn't started, the function is called right away.
+ *
+ * \return 0 if successful, -1 if the ring is full (the function isn't called)
+ */
+int trace_call(void (*fn)(void*), void* arg)
+{
+  struct trace_record* rec;
+  unsigned int pos;
+
+  if(!trace.records)
+  {
+    fn(arg);
+    return 0;
+  }
+
+  if(!(rec = reserve(&pos)))
+  {
+    return -1;
+  }
+
+  rec->type = TRACE_CALL;
+  rec->call.fn = fn;
+  rec->call.arg = arg;
+
+  commit(rec, pos);
+
+  return 0;
+}
+
+static void write_record(struct trace_record* rec)
+{
+  unsigned long long ts = rec->ts - trace.start;
+  int i, len;
+
+  if(rec->type == TRACE_CALL)
+  {
+    rec->call.fn(rec->call.arg);
+    return;
+  }
+
+  printf("[%llu.%06llu] ", ts / 1000000000ULL, (ts / 1000) % 1000000);
+
+  switch(rec->type)
+  {
+    case TRACE_MESSAGE:
+      fputs((char*)rec->data, stdout);
+      break;
+    case TRACE_PACKET:
+      printf("%s (psm: 0x%04x) len: %hu\n", rec->tag, rec->psm, rec->len);
+      len = rec->len < TRACE_DATA_SIZE ? rec->len : TRACE_DATA_SIZE;
+      for(i=0; i<len; ++i)
+      {
+        printf("0x%02x ", rec->data[i]);
+        if(!((i+1)%8))
+        {
+          printf("\n");
+        }
+      }
+      printf(len < rec->len ? "...\n" : "\n");
+      break;
+  }
+}
+
+/*
+ * Write the records that are ready.
+ *
+ * \return the number of records written
+ */
+static unsigned int drain()
+{
+  struct trace_record* rec;
+  unsigned int n = 0;
+
+  for(;;)
+  {
+    rec = trace.records + (trace.dequeue & trace.mask);
+    if(__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != trace.dequeue + 1)
+    {
+      break;
+    }
+    write_record(rec);
+    __atomic_store_n(&rec->seq, trace.dequeue + trace.mask + 1, __ATOMIC_RELEASE);
+    ++trace.dequeue;
+    ++n;
+  }
+
+  trace.written += n;
+
+  return n;
+}
+
+static void* run(void* arg)
+{
+  struct timespec period = { 0, TRACE_POLL_PERIOD };
+
+  /*
+   * On Linux, this only lowers the priority of the calling thread.
+   */
+  if(setpriority(PRIO_PROCESS, 0, 10) < 0)
+  {
+    perror("setpriority");
+  }
+
+  while(!trace.done)
+  {
+    if(!drain())
+    {
+      fflush(stdout);
+      nanosleep(&period, NULL);
+    }
+  }
+
+  drain();
+  fflush(stdout);
+
+  return NULL;
+}
+
+/*
+ * Start the writer thread.
+ * It runs with the default scheduling policy, whatever the policy of the calling thread.
+ *
+ * \param nb_records  the capacity of the ring, rounded up to a power of 2
+ *
+ * \return 0 if successful, -1 otherwise
+ */
+int trace_start(unsigned int nb_records)
+{
+  struct sched_param param = { .sched_priority = 0 };
+  pthread_attr_t attr;
+  sigset_t mask, old;
+  unsigned int size = 1;
+  unsigned int i;
+
+  while(size < nb_records)
+  {
+    size <<= 1;
+  }
+
+  if(posix_memalign((void**)&trace.records, __alignof__(*trace.records), size * sizeof(*trace.records)))
+  {
+    fprintf(stderr, "can't allocate the trace ring\n");
+    trace.records = NULL;
+    return -1;
+  }
+
+  for(i=0; i<size; ++i)
+  {
+    trace.records[i].seq = i;
+  }
+
+  trace.mask = size - 1;
+  trace.start = get_time();
+
+  pthread_attr_init(&attr);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+  pthread_attr_setschedparam(&attr, &param);
+
+  /*
+   * Signals are handled by the calling thread.
+   */
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+  if(pthread_create(&trace.thread, &attr, run, NULL))
+  {
+    fprintf(stderr, "can't create the trace thread\n");
+    free(trace.records);
+    trace.records = NULL;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy(&attr);
+
+  if(!trace.records)
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Write the remaining records, and stop the writer thread.
+ * The records traced after this call are printed right away.
+ */
+void trace_stop()
+{
+  if(!trace.records)
+  {
+    return;
+  }
+
+  trace.done = 1;
+  pthread_join(trace.thread, NULL);
+
+  printf("trace: %llu records written, %llu dropped\n", trace.written, trace.dropped);
+
+  free(trace.records);
+  trace.records = NULL;
+}
@@ -0,0 +1,19 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+int trace_start(unsigned int nb_records);
+
+void trace_stop();
+
+void trace_packet(const char* tag, unsigned short psm, const unsigned char* buf, int len);
+
+void trace_printf(const char* format, ...) __attribute__ ((format (printf, 1, 2)));
+
+int trace_call(void (*fn)(void*), void* arg);
+
+#endif
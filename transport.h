@@ -0,0 +1,55 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <bluetooth/bluetooth.h>
+
+struct mmsghdr;
+
+/*
+ * The socket operations the proxy uses for its legs.
+ * All sockets are SOCK_SEQPACKET, and the accepted and connected ones are non-blocking.
+ * An mtu of 0 selects the default one of the transport.
+ * The outgoing mtu of a leg is the one it negotiated: the transport may take another path for larger packets,
+ * through the local adapter of the leg (dev_id, -1 if unknown).
+ *
+ * The SCO links of a transport are set up with the sco_* operations, and written and read with send(2)/recv(2).
+ * An accepted SCO link is established once it's authorized.
+ */
+struct transport
+{
+  const char* name;
+  int (*listen)(const char* bdaddr_src, unsigned short psm, unsigned short mtu);
+  int (*accept)(int fd, bdaddr_t* src, unsigned short* psm, unsigned short* cid);
+  int (*connect)(const char* bdaddr_src, const char* bdaddr_dst, int psm, unsigned short imtu, unsigned short omtu);
+  int (*is_connected)(int fd);
+  unsigned short (*get_cid)(int fd);
+  int (*get_src)(int fd, bdaddr_t* src);
+  void (*get_mtu)(int fd, unsigned short* imtu, unsigned short* omtu);
+  int (*send)(int dev_id, const char* bdaddr_dst, unsigned short cid, unsigned short omtu, int fd,
+      const unsigned char* buf, int len);
+  int (*recv)(int fd, unsigned char* buf, int len);
+  int (*recv_batch)(int fd, struct mmsghdr* msgs, unsigned int n);
+  int (*send_batch)(int dev_id, const char* bdaddr_dst, unsigned short cid, unsigned short omtu, int fd,
+      struct mmsghdr* msgs, unsigned int n);
+  int (*sco_listen)(const char* bdaddr_src);
+  int (*sco_accept)(int fd, bdaddr_t* src);
+  int (*sco_connect)(const char* bdaddr_src, const char* bdaddr_dst);
+  int (*sco_authorize)(int fd);
+};
+
+/*
+ * L2CAP and SCO sockets (l2cap_con.c, sco_con.c).
+ */
+extern const struct transport transport_bluetooth;
+
+/*
+ * AF_UNIX sockets in the abstract namespace (unix_con.c).
+ */
+extern const struct transport transport_unix;
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <bluetooth/bluetooth.h>
+#include "transport.h"
+#include "trace.h"
+
+/*
+ * Stand-ins for L2CAP sockets: AF_UNIX SOCK_SEQPACKET sockets in the abstract namespace.
+ *
+ * A listening socket for a bdaddr and a PSM is bound to "@l2cap_proxy/<bdaddr>/<psm>".
+ * A connecting socket is bound to "@l2cap_proxy/<bdaddr>/<psm>/<pid>.<n>",
+ * so that the bdaddr of the remote device can be retrieved when accepting the connection.
+ * There's no channel identifier and no ACL bypass.
+ * SCO links use the PSM 0x0000, and don't need to be authorized.
+ */
+
+#define UNIX_PREFIX "l2cap_proxy/"
+
+#define BDADDR_ZERO "00:00:00:00:00:00"
+
+static socklen_t unix_addr(struct sockaddr_un* addr, const char* bdaddr, unsigned short psm, const char* suffix)
+{
+  int len;
+
+  memset(addr, 0x00, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+
+  len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, UNIX_PREFIX "%s/0x%04x%s",
+      bdaddr ? bdaddr : BDADDR_ZERO, psm, suffix ? suffix : "");
+
+  return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/*
+ * There is no MTU: a packet is limited by the buffers of the proxy.
+ */
+static int unix_listen(const char* bdaddr_src, unsigned short psm, unsigned short mtu)
+{
+  struct sockaddr_un addr;
+  socklen_t len = unix_addr(&addr, bdaddr_src, psm, NULL);
+  int s;
+
+  if((s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+  {
+    perror("socket");
+    return -1;
+  }
+
+  if(bind(s, (struct sockaddr *) &addr, len) < 0)
+  {
+    perror("bind");
+    close(s);
+    return -1;
+  }
+
+  if(listen(s, 10) < 0)
+  {
+    perror("listen");
+    close(s);
+    return -1;
+  }
+
+  printf("listening on @%s\n", addr.sun_path + 1);
+
+  return s;
+}
+
+static int unix_accept(int s, bdaddr_t* src, unsigned short* psm, unsigned short* cid)
+{
+  struct sockaddr_un addr = { 0 };
+  socklen_t len = sizeof(addr);
+  char bdaddr[sizeof(BDADDR_ZERO)] = BDADDR_ZERO;
+  unsigned int p = 0;
+  int client;
+
+  if((client = accept4(s, (struct sockaddr *) &addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+  {
+    trace_printf("accept: %s\n", strerror(errno));
+    return -1;
+  }
+
+  /*
+   * An unbound peer is seen as 00:00:00:00:00:00.
+   */
+  if(len > offsetof(struct sockaddr_un, sun_path) + 1 && !addr.sun_path[0])
+  {
+    sscanf(addr.sun_path + 1, UNIX_PREFIX "%17[0-9A-Fa-f:]/%x", bdaddr, &p);
+  }
+
+  trace_printf("accepted connection from %s (psm: 0x%04x)\n", bdaddr, p);
+
+  str2ba(bdaddr, src);
+  *psm = p;
+  *cid = 0;
+
+  return client;
+}
+
+static int unix_connect(const char* bdaddr_src, const char* bdaddr_dst, int psm, unsigned short imtu, unsigned short omtu)
+{
+  static unsigned int count = 0;
+  struct sockaddr_un addr;
+  char suffix[sizeof("/4294967295.4294967295")];
+  socklen_t len;
+  int fd;
+
+  if((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+  {
+    trace_printf("socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  /*
+   * The loops of the sharded mode connect concurrently: each connection gets its own name.
+   */
+  snprintf(suffix, sizeof(suffix), "/%u.%u", (unsigned int) getpid(), __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED));
+  len = unix_addr(&addr, bdaddr_src, psm, suffix);
+
+  if(bind(fd, (struct sockaddr *) &addr, len) < 0)
+  {
+    trace_printf("bind: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  len = unix_addr(&addr, bdaddr_dst, psm, NULL);
+
+  /*
+   * Unlike L2CAP, a non-blocking AF_UNIX connect either succeeds at once, or fails.
+   */
+  if(connect(fd, (struct sockaddr *) &addr, len) < 0)
+  {
+    trace_printf("connect: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int unix_is_connected(int fd)
+{
+  int error = 0;
+  socklen_t lerror = sizeof(error);
+
+  if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &lerror) < 0)
+  {
+    trace_printf("getsockopt SO_ERROR: %s\n", strerror(errno));
+    return 0;
+  }
+
+  return !error;
+}
+
+static unsigned short unix_get_cid(int fd)
+{
+  return 0;
+}
+
+/*
+ * An accepted socket has the address of the listening socket.
+ */
+static int unix_get_src(int fd, bdaddr_t* src)
+{
+  struct sockaddr_un addr = { 0 };
+  socklen_t len = sizeof(addr);
+  char bdaddr[sizeof(BDADDR_ZERO)] = BDADDR_ZERO;
+
+  if(getsockname(fd, (struct sockaddr *) &addr, &len) < 0)
+  {
+    trace_printf("getsockname: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if(len > offsetof(struct sockaddr_un, sun_path) + 1 && !addr.sun_path[0])
+  {
+    sscanf(addr.sun_path + 1, UNIX_PREFIX "%17[0-9A-Fa-f:]", bdaddr);
+  }
+
+  str2ba(bdaddr, src);
+
+  return 0;
+}
+
+static void unix_get_mtu(int fd, unsigned short* imtu, unsigned short* omtu)
+{
+  *imtu = 0;
+  *omtu = 0;
+}
+
+static int unix_send(int dev_id, const char* bdaddr_dst, unsigned short cid, unsigned short omtu, int fd,
+    const unsigned char* buf, int len)
+{
+  if(send(fd, buf, len, MSG_NOSIGNAL) != len)
+  {
+    if(errno != EAGAIN)
+    {
+      trace_printf("send: %s\n", strerror(errno));
+    }
+    return -1;
+  }
+  return len;
+}
+
+static int unix_recv(int fd, unsigned char* buf, int len)
+{
+  return recv(fd, buf, len, MSG_DONTWAIT);
+}
+
+static int unix_recv_batch(int fd, struct mmsghdr* msgs, unsigned int n)
+{
+  return recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+}
+
+static int unix_send_batch(int dev_id, const char* bdaddr_dst, unsigned short cid, unsigned short omtu, int fd,
+    struct mmsghdr* msgs, unsigned int n)
+{
+  int ret = sendmmsg(fd, msgs, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+  if(ret < 0 && errno != EAGAIN)
+  {
+    trace_printf("sendmmsg: %s\n", strerror(errno));
+  }
+
+  return ret;
+}
+
+static int unix_sco_listen(const char* bdaddr_src)
+{
+  return unix_listen(bdaddr_src, 0, 0);
+}
+
+static int unix_sco_accept(int s, bdaddr_t* src)
+{
+  unsigned short psm;
+  unsigned short cid;
+
+  return unix_accept(s, src, &psm, &cid);
+}
+
+static int unix_sco_connect(const char* bdaddr_src, const char* bdaddr_dst)
+{
+  return unix_connect(bdaddr_src, bdaddr_dst, 0, 0, 0);
+}
+
+static int unix_sco_authorize(int fd)
+{
+  return 0;
+}
+
+const struct transport transport_unix =
+{
+  .name = "unix",
+  .listen = unix_listen,
+  .accept = unix_accept,
+  .connect = unix_connect,
+  .is_connected = unix_is_connected,
+  .get_cid = unix_get_cid,
+  .get_src = unix_get_src,
+  .get_mtu = unix_get_mtu,
+  .send = unix_send,
+  .recv = unix_recv,
+  .recv_batch = unix_recv_batch,
+  .send_batch = unix_send_batch,
+  .sco_listen = unix_sco_listen,
+  .sco_accept = unix_sco_accept,
+  .sco_connect = unix_sco_connect,
+  .sco_authorize = unix_sco_authorize,
+};
@@ -0,0 +1,304 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#include <string.h>
+#include "wheel.h"
+
+/*
+ * The number of ticks spanned by the whole wheel.
+ * A timer beyond it is put in the last slot of the top level, and placed again when that slot is cascaded.
+ */
+#define WHEEL_RANGE (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+
+void wheel_init(struct wheel* w, unsigned long long now)
+{
+  memset(w, 0x00, sizeof(*w));
+  w->tick = now / WHEEL_TICK;
+}
+
+static void slot_link(struct wheel* w, struct wheel_timer* t, unsigned int level, unsigned int index)
+{
+  struct wheel_timer** head = &w->slots[level][index];
+
+  t->slot = level * WHEEL_SLOTS + index;
+  t->next = *head;
+  if(t->next)
+  {
+    t->next->pprev = &t->next;
+  }
+  t->pprev = head;
+  *head = t;
+
+  w->occupied[level] |= 1ULL << index;
+}
+
+static void slot_unlink(struct wheel* w, struct wheel_timer* t)
+{
+  unsigned int level = t->slot / WHEEL_SLOTS;
+  unsigned int index = t->slot % WHEEL_SLOTS;
+
+  *t->pprev = t->next;
+  if(t->next)
+  {
+    t->next->pprev = t->pprev;
+  }
+  t->next = NULL;
+  t->pprev = NULL;
+
+  /*
+   * The timer may belong to a slot that is being processed, and that was emptied meanwhile.
+   */
+  if(!w->slots[level][index])
+  {
+    w->occupied[level] &= ~(1ULL << index);
+  }
+}
+
+/*
+ * Put a timer in the slot of its tick: level 0 if it is in the current span of level 0,
+ * level 1 if it is in the current span of level 1, and so on.
+ */
+static void place(struct wheel* w, struct wheel_timer* t)
+{
+  unsigned long long tick = t->deadline / WHEEL_TICK;
+  unsigned int level;
+
+  if(tick < w->tick)
+  {
+    tick = w->tick;
+  }
+  else if(tick - w->tick >= WHEEL_RANGE)
+  {
+    tick = w->tick + WHEEL_RANGE - 1;
+  }
+
+  for(level=0; level<WHEEL_LEVELS-1; ++level)
+  {
+    if(!((tick ^ w->tick) >> (WHEEL_BITS * (level + 1))))
+    {
+      break;
+    }
+  }
+
+  slot_link(w, t, level, (tick >> (WHEEL_BITS * level)) & SLOT_MASK);
+}
+
+/*
+ * Start a timer, or move it to another deadline.
+ */
+void wheel_add(struct wheel* w, struct wheel_timer* t, unsigned long long deadline)
+{
+  if(t->pprev)
+  {
+    slot_unlink(w, t);
+  }
+
+  t->deadline = deadline;
+  place(w, t);
+
+  ++w->stats.added;
+}
+
+void wheel_del(struct wheel* w, struct wheel_timer* t)
+{
+  if(!t->pprev)
+  {
+    return;
+  }
+
+  slot_unlink(w, t);
+
+  ++w->stats.cancelled;
+}
+
+/*
+ * Detach the timers of a slot.
+ */
+static struct wheel_timer* take(struct wheel* w, unsigned int level, unsigned int index)
+{
+  struct wheel_timer* list = w->slots[level][index];
+
+  w->slots[level][index] = NULL;
+  w->occupied[level] &= ~(1ULL << index);
+
+  return list;
+}
+
+/*
+ * Get the tick the next timers of a higher level have to be moved down at.
+ *
+ * \return the tick, 0 if there is no timer above level 0
+ */
+static unsigned long long cascade_tick(const struct wheel* w)
+{
+  unsigned long long bits;
+  unsigned long long span;
+  unsigned int level, index, shift;
+
+  for(level=1; level<WHEEL_LEVELS; ++level)
+  {
+    shift = WHEEL_BITS * level;
+    span = 1ULL << (shift + WHEEL_BITS);
+    index = (w->tick >> shift) & SLOT_MASK;
+
+    bits = (index < SLOT_MASK) ? w->occupied[level] & (~0ULL << (index + 1)) : 0;
+
+    if(bits)
+    {
+      return (w->tick & ~(span - 1)) + ((unsigned long long)__builtin_ctzll(bits) << shift);
+    }
+
+    /*
+     * The top level also holds the timers of its next turn.
+     */
+    if(level == WHEEL_LEVELS - 1 && w->occupied[level])
+    {
+      return (w->tick & ~(span - 1)) + span + ((unsigned long long)__builtin_ctzll(w->occupied[level]) << shift);
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Move the timers of the higher levels down, once the current tick reached the start of their slot.
+ */
+static void cascade(struct wheel* w)
+{
+  struct wheel_timer* list;
+  struct wheel_timer* t;
+  unsigned int level, index;
+
+  for(level=1; level<WHEEL_LEVELS; ++level)
+  {
+    index = (w->tick >> (WHEEL_BITS * level)) & SLOT_MASK;
+
+    list = take(w, level, index);
+
+    while((t = list))
+    {
+      list = t->next;
+      t->next = NULL;
+      place(w, t);
+      ++w->stats.cascaded;
+    }
+
+    if(index)
+    {
+      break;
+    }
+  }
+}
+
+/*
+ * Run the timers that are due, in the order of their ticks.
+ * A timer of the current tick that isn't due yet stays in its slot.
+ * A timer added by a callback runs at the next call at the earliest.
+ */
+void wheel_expire(struct wheel* w, unsigned long long now)
+{
+  unsigned long long target = now / WHEEL_TICK;
+  unsigned long long next;
+  unsigned long long bits;
+  struct wheel_timer* list;
+  struct wheel_timer* t;
+  unsigned int index;
+
+  if(target < w->tick)
+  {
+    return;
+  }
+
+  for(;;)
+  {
+    index = w->tick & SLOT_MASK;
+
+    list = take(w, 0, index);
+
+    while((t = list))
+    {
+      /*
+       * A callback may cancel the next timers of the list.
+       */
+      list = t->next;
+      if(list)
+      {
+        list->pprev = &list;
+      }
+      t->next = NULL;
+      t->pprev = NULL;
+
+      if(t->deadline <= now)
+      {
+        ++w->stats.expired;
+        t->expire(t, now);
+      }
+      else
+      {
+        place(w, t);
+      }
+    }
+
+    if(w->tick == target)
+    {
+      break;
+    }
+
+    /*
+     * Skip the empty slots: go to the next timers of level 0, or else to the next cascade.
+     */
+    bits = (index < SLOT_MASK) ? w->occupied[0] & (~0ULL << (index + 1)) : 0;
+
+    if(bits)
+    {
+      next = (w->tick & ~(unsigned long long)SLOT_MASK) + __builtin_ctzll(bits);
+    }
+    else
+    {
+      next = cascade_tick(w);
+    }
+
+    if(!next || next > target)
+    {
+      next = target;
+    }
+
+    w->tick = next;
+
+    if(!(w->tick & SLOT_MASK))
+    {
+      cascade(w);
+    }
+  }
+}
+
+/*
+ * Get the time the wheel has to be expired at: the deadline of the next timers of level 0,
+ * or else the time the next timers of a higher level have to be moved down.
+ *
+ * \return the time in ns, 0 if there is no pending timer
+ */
+unsigned long long wheel_next(struct wheel* w)
+{
+  unsigned long long bits;
+  unsigned long long next = 0;
+  struct wheel_timer* t;
+
+  if((bits = w->occupied[0] & (~0ULL << (w->tick & SLOT_MASK))))
+  {
+    for(t = w->slots[0][__builtin_ctzll(bits)]; t; t = t->next)
+    {
+      if(!next || t->deadline < next)
+      {
+        next = t->deadline;
+      }
+    }
+    return next;
+  }
+
+  return cascade_tick(w) * WHEEL_TICK;
+}
@@ -0,0 +1,67 @@
+/*
+ Copyright (c) 2013 Mathieu Laurendeau
+ License: GPLv3
+ */
+
+#ifndef WHEEL_H_
+#define WHEEL_H_
+
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_TICK 100000ULL // ns
+
+/*
+ * A timer, embedded in the object it belongs to.
+ */
+struct wheel_timer
+{
+  struct wheel_timer* next;
+  struct wheel_timer** pprev; // NULL if the timer isn't pending
+  unsigned int slot;          // level * WHEEL_SLOTS + index
+  unsigned long long deadline;
+  void (*expire)(struct wheel_timer* t, unsigned long long now);
+};
+
+/*
+ * A hierarchical timer wheel: each level has WHEEL_SLOTS slots, and a slot of a level spans a whole lower level.
+ * The timers of a higher level are moved down when the lower levels wrap around, until they reach level 0.
+ * Adding and cancelling a timer are O(1). The deadlines are in ns, on the CLOCK_MONOTONIC clock.
+ */
+struct wheel
+{
+  unsigned long long tick; // the timers of the previous ticks have expired
+  unsigned long long occupied[WHEEL_LEVELS]; // a bit per non-empty slot
+  struct wheel_timer* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  struct
+  {
+    unsigned long long added;
+    unsigned long long expired;
+    unsigned long long cancelled;
+    unsigned long long cascaded;
+  } stats;
+};
+
+static inline void wheel_timer_init(struct wheel_timer* t, void (*expire)(struct wheel_timer* t, unsigned long long now))
+{
+  t->next = NULL;
+  t->pprev = NULL;
+  t->expire = expire;
+}
+
+static inline int wheel_pending(const struct wheel_timer* t)
+{
+  return t->pprev != 0;
+}
+
+void wheel_init(struct wheel* w, unsigned long long now);
+
+void wheel_add(struct wheel* w, struct wheel_timer* t, unsigned long long deadline);
+
+void wheel_del(struct wheel* w, struct wheel_timer* t);
+
+void wheel_expire(struct wheel* w, unsigned long long now);
+
+unsigned long long wheel_next(struct wheel* w);
+
+#endif